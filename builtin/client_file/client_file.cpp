@@ -211,7 +211,8 @@ struct Module: public interface::Module, public client_file::Interface
 			ar(info.content);
 		}
 		network::access(m_server, [&](network::Interface *inetwork){
-			inetwork->send(packet.sender, "core:file_content", os.str());
+			inetwork->send(packet.sender, "core:file_content", os.str(),
+					network::CHANNEL_BULK);
 		});
 	}
 
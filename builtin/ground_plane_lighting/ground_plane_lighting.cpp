@@ -169,6 +169,9 @@ struct CInstance: public ground_plane_lighting::Instance
 
 	// Clients that are ready to receive things (by peer id)
 	set_<int> m_clients_initialized;
+	// Sector updates dropped because the client was behind (by peer id);
+	// sent again at a later tick
+	sm_<int, set_<YSTSector*>> m_unsent_sectors;
 
 	CInstance(interface::Server *server, SceneReference scene_ref):
 		m_server(server),
@@ -224,25 +227,53 @@ struct CInstance: public ground_plane_lighting::Instance
 
 	void on_tick(const interface::TickEvent &event)
 	{
-		if(!m_global_yst->m_dirty_sectors.empty()){
-			sv_<YSTSector*> dirty_sectors;
-			dirty_sectors.swap(m_global_yst->m_dirty_sectors);
-			for(YSTSector *sector : dirty_sectors){
-				ss_ s = interface::serialize_volume_compressed(*sector->volume);
-				std::ostringstream os(std::ios::binary);
-				{
-					cereal::PortableBinaryOutputArchive ar(os);
-					ar(sector->sector_p);
-					ar(s);
+		if(m_global_yst->m_dirty_sectors.empty() && m_unsent_sectors.empty())
+			return;
+		sv_<YSTSector*> dirty_sectors;
+		dirty_sectors.swap(m_global_yst->m_dirty_sectors);
+		// An update contains the whole sector, so one that is dropped can
+		// simply be sent again later
+		sm_<YSTSector*, ss_> updates;
+		auto get_update = [&](YSTSector *sector) -> const ss_& {
+			auto it = updates.find(sector);
+			if(it == updates.end())
+				it = updates.emplace(sector, serialize_sector(sector)).first;
+			return it->second;
+		};
+		network::access(m_server, [&](network::Interface *inetwork){
+			for(auto &peer: m_clients_initialized){
+				set_<YSTSector*> sectors(
+						dirty_sectors.begin(), dirty_sectors.end());
+				auto unsent_it = m_unsent_sectors.find(peer);
+				if(unsent_it != m_unsent_sectors.end()){
+					sectors.insert(unsent_it->second.begin(),
+							unsent_it->second.end());
+					m_unsent_sectors.erase(unsent_it);
+				}
+				// Once one is dropped the rest would be too
+				bool dropped = false;
+				for(YSTSector *sector : sectors){
+					if(!dropped)
+						dropped = !inetwork->send_droppable(peer,
+								"ground_plane_lighting:update",
+								get_update(sector));
+					if(dropped)
+						m_unsent_sectors[peer].insert(sector);
 				}
-				network::access(m_server, [&](network::Interface *inetwork){
-					for(auto &peer: m_clients_initialized){
-						inetwork->send(peer, "ground_plane_lighting:update",
-								os.str());
-					}
-				});
 			}
+		});
+	}
+
+	ss_ serialize_sector(YSTSector *sector)
+	{
+		ss_ s = interface::serialize_volume_compressed(*sector->volume);
+		std::ostringstream os(std::ios::binary);
+		{
+			cereal::PortableBinaryOutputArchive ar(os);
+			ar(sector->sector_p);
+			ar(s);
 		}
+		return os.str();
 	}
 
 	void on_peer_joined_scene(const replicate::PeerJoinedScene &event)
@@ -268,6 +299,7 @@ struct CInstance: public ground_plane_lighting::Instance
 	void on_peer_left_scene(const replicate::PeerLeftScene &event)
 	{
 		m_clients_initialized.erase(event.peer);
+		m_unsent_sectors.erase(event.peer);
 	}
 
 	void on_node_volume_updated(const voxelworld::NodeVolumeUpdated &event)
@@ -338,15 +370,9 @@ struct CInstance: public ground_plane_lighting::Instance
 	{
 		for(auto &pair : m_global_yst->m_sectors){
 			YSTSector *sector = &pair.second;
-			ss_ s = interface::serialize_volume_compressed(*sector->volume);
-			std::ostringstream os(std::ios::binary);
-			{
-				cereal::PortableBinaryOutputArchive ar(os);
-				ar(sector->sector_p);
-				ar(s);
-			}
+			ss_ data = serialize_sector(sector);
 			network::access(m_server, [&](network::Interface *inetwork){
-				inetwork->send(peer, "ground_plane_lighting:update", os.str());
+				inetwork->send(peer, "ground_plane_lighting:update", data);
 			});
 		}
 	}
@@ -399,12 +399,24 @@ struct Module: public interface::Module, public loader::Interface
 		log_i(MODULE, "Module load order: %s",
 				cs(dump(resolve.m_module_load_order)));
 
+		// Compile everything first; the dependency order only matters for
+		// constructing and initializing the modules
+		sv_<interface::ModuleInfo> infos;
 		for(const ss_ &name : resolve.m_module_load_order){
 			interface::ModuleInfo *info = get_module_info(name);
 			if(!info)
 				throw Exception(ss_()+"Couldn't get module info for \""+name+"\"");
-			if(!m_server->load_module(*info)){
-				m_server->shutdown(1, ss_()+"loader: Error loading module "+name);
+			infos.push_back(*info);
+		}
+		if(!m_server->build_modules(infos)){
+			m_server->shutdown(1, "loader: Error compiling modules");
+			return;
+		}
+
+		for(const interface::ModuleInfo &info : infos){
+			if(!m_server->load_module(info)){
+				m_server->shutdown(1, ss_()+"loader: Error loading module "+
+						info.name);
 				return;
 			}
 		}
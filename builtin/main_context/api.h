@@ -13,6 +13,14 @@ namespace Urho3D
 	class StringHash;
 }
 
+namespace interface
+{
+	namespace frame_scheduler
+	{
+		struct Scheduler;
+	}
+}
+
 namespace main_context
 {
 	namespace magic = Urho3D;
@@ -21,6 +29,15 @@ namespace main_context
 	struct OpaqueSceneReference;
 	typedef OpaqueSceneReference* SceneReference;
 
+	struct SceneStats
+	{
+		SceneReference scene = nullptr;
+		size_t num_steps = 0;
+		int64_t last_step_us = 0;
+		int64_t average_step_us = 0;
+		int64_t max_step_us = 0;
+	};
+
 	struct SceneDeleted: public interface::Event::Private
 	{
 		SceneReference scene;
@@ -44,6 +61,13 @@ namespace main_context
 		virtual void sub_magic_event(
 				const magic::StringHash &event_type,
 				const Event::Type &buildat_event_type) = 0;
+
+		// Work done in the scene outside of the frame itself should be done
+		// in slices given by this; a frame begins at each core:tick
+		virtual interface::frame_scheduler::Scheduler* get_frame_scheduler() = 0;
+
+		// Time taken by stepping each existing scene at core:tick
+		virtual sv_<SceneStats> get_scene_stats() = 0;
 	};
 
 	inline bool access(interface::Server *server,
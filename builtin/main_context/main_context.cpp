@@ -8,6 +8,7 @@
 #include "interface/server_config.h"
 #include "interface/event.h"
 #include "interface/magic_event_handler.h"
+#include "interface/frame_scheduler.h"
 #include "interface/os.h"
 #include "interface/fs.h"
 #include <Variant.h>
@@ -60,6 +61,7 @@ public:
 struct OpaqueSceneReference
 {
 	SharedPtr<Scene> scene;
+	SceneStats stats;
 
 	OpaqueSceneReference(const SharedPtr<Scene> &scene): scene(scene){}
 };
@@ -79,6 +81,8 @@ struct Module: public interface::Module, public main_context::Interface
 	sm_<Event::Type, SharedPtr<
 				interface::MagicEventHandler>> m_magic_event_handlers;
 
+	up_<interface::frame_scheduler::Scheduler> m_frame_scheduler;
+
 	Module(interface::Server *server):
 		interface::Module(MODULE),
 		m_server(server),
@@ -111,6 +115,9 @@ struct Module: public interface::Module, public main_context::Interface
 
 		const interface::ServerConfig &server_config = m_server->get_config();
 
+		m_frame_scheduler.reset(interface::frame_scheduler::createScheduler(
+				server_config.get<int64_t>("main_thread_budget_us")));
+
 		sv_<ss_> resource_paths = {
 			server_config.get<ss_>("urho3d_path")+"/Bin/CoreData",
 			server_config.get<ss_>("urho3d_path")+"/Bin/Data",
@@ -168,6 +175,10 @@ struct Module: public interface::Module, public main_context::Interface
 
 	void on_tick(const interface::TickEvent &event)
 	{
+		m_frame_scheduler->begin_frame();
+
+		step_scenes(event.dtime);
+
 		m_engine->SetNextTimeStep(event.dtime);
 		m_engine->RunFrame();
 
@@ -178,6 +189,41 @@ struct Module: public interface::Module, public main_context::Interface
 			String s = p->GetData(false, false, UINT_MAX);
 			p->BeginInterval();
 			log_v(MODULE, "Urho3D profiler:\n%s", s.CString());
+			log_v(MODULE, "Frame scheduler: %s", cs(
+					interface::frame_scheduler::format_stats(
+					m_frame_scheduler->get_stats())));
+			for(const SceneStats &stats : get_scene_stats()){
+				log_v(MODULE, "Scene %p: %zu steps; step time: last %ius, "
+						"average %ius, max %ius", stats.scene, stats.num_steps,
+						(int)stats.last_step_us, (int)stats.average_step_us,
+						(int)stats.max_step_us);
+			}
+		}
+	}
+
+	// Scenes are not updated by RunFrame() but stepped one by one here so that
+	// each of them can be timed.
+	// NOTE: Urho3D only sends events from its main thread and a scene step is
+	//       driven by events (scene update, physics steps, collisions), so
+	//       scenes cannot be stepped in parallel in worker threads.
+	void step_scenes(float dtime)
+	{
+		for(auto &pair : m_scenes){
+			OpaqueSceneReference *ref = pair.second.get();
+			if(!ref->scene)
+				continue;
+			int64_t t0 = interface::os::time_us();
+			ref->scene->Update(dtime);
+			int64_t step_us = interface::os::time_us() - t0;
+			SceneStats &stats = ref->stats;
+			stats.num_steps++;
+			stats.last_step_us = step_us;
+			if(stats.average_step_us == 0)
+				stats.average_step_us = step_us;
+			else
+				stats.average_step_us += (step_us - stats.average_step_us) / 16;
+			if(step_us > stats.max_step_us)
+				stats.max_step_us = step_us;
 		}
 	}
 
@@ -205,6 +251,21 @@ struct Module: public interface::Module, public main_context::Interface
 		return m_context;
 	}
 
+	interface::frame_scheduler::Scheduler* get_frame_scheduler()
+	{
+		return m_frame_scheduler.get();
+	}
+
+	sv_<SceneStats> get_scene_stats()
+	{
+		sv_<SceneStats> result;
+		for(auto &pair : m_scenes){
+			if(pair.second->scene)
+				result.push_back(pair.second->stats);
+		}
+		return result;
+	}
+
 	Scene* find_scene(SceneReference ref)
 	{
 		auto it = m_scenes.find(ref);
@@ -226,8 +287,11 @@ struct Module: public interface::Module, public main_context::Interface
 		SharedPtr<Scene> scene(new Scene(m_context));
 		log_d(MODULE, "create_scene() -> %p", scene.Get());
 
+		// Stepped by step_scenes()
+		scene->SetUpdateEnabled(false);
+
 		auto *physics = scene->CreateComponent<PhysicsWorld>(LOCAL);
-		physics->SetFps(30);
+		physics->SetFps(m_server->get_config().get<int64_t>("tick_rate_hz"));
 		physics->SetInterpolation(false);
 
 		// Useless but gets rid of warnings like
@@ -236,6 +300,7 @@ struct Module: public interface::Module, public main_context::Interface
 
 		// Insert into m_scenes
 		OpaqueSceneReference *ref = new OpaqueSceneReference(scene);
+		ref->stats.scene = ref;
 		m_scenes[ref] = std::move(up_<OpaqueSceneReference>(ref));
 		return ref;
 	}
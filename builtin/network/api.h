@@ -4,6 +4,7 @@
 #include "interface/event.h"
 #include "interface/server.h"
 #include "interface/module.h"
+#include "interface/packet_stream.h"
 #include <functional>
 
 namespace network
@@ -22,10 +23,19 @@ namespace network
 	{
 		typedef size_t Type;
 		PeerInfo::Id sender = 0;
-		ss_ name;
-		ss_ data;
+		// Shared with the packet type registry and the receive buffer of the
+		// peer instead of being copied for each packet
+		sp_<const ss_> name_p;
+		sp_<const ss_> data_p;
+		const ss_ &name;
+		const ss_ &data;
+		Packet(PeerInfo::Id sender, const sp_<const ss_> &name_p,
+				const sp_<const ss_> &data_p):
+			sender(sender), name_p(name_p), data_p(data_p),
+			name(*this->name_p), data(*this->data_p){}
 		Packet(PeerInfo::Id sender, const ss_ &name, const ss_ &data):
-			sender(sender), name(name), data(data){}
+			Packet(sender, std::make_shared<ss_>(name),
+					std::make_shared<ss_>(data)){}
 	};
 
 	struct NewClient: public interface::Event::Private
@@ -42,11 +52,90 @@ namespace network
 		OldClient(const PeerInfo &info): info(info){}
 	};
 
+	struct NetworkStats
+	{
+		size_t num_peers = 0;
+		size_t num_io_threads = 0;
+		size_t num_wakeups = 0; // Times sockets were handled
+		size_t num_timeouts = 0; // Wakeups of the poller with nothing to do
+		size_t num_ready_sockets = 0;
+		// From the poller returning to having handled the sockets, including
+		// waiting for access to the module
+		int64_t average_latency_us = 0;
+		int64_t max_latency_us = 0;
+		// Backpressure
+		size_t num_dropped_packets = 0;
+		size_t num_backpressure_disconnects = 0;
+		// Output coalescing
+		size_t num_flushes = 0; // Times collected output was sent
+		size_t num_send_calls = 0; // System calls
+		size_t num_bytes_sent = 0;
+		// Unreliable side channel
+		size_t num_udp_peers = 0; // Have said hello over UDP
+		size_t num_datagrams_sent = 0;
+		size_t num_datagrams_received = 0;
+		size_t num_unreliable_over_tcp = 0; // No UDP or too large for it
+		// Of all peers, including disconnected ones
+		interface::CompressionStats compression;
+	};
+
+	struct PeerStats
+	{
+		PeerInfo::Id id = 0;
+		size_t output_queue_bytes = 0; // Not yet sent
+		// Of the former, not yet taken from each channel
+		sv_<size_t> channel_queue_bytes;
+		size_t max_output_queue_bytes = 0;
+		size_t num_dropped_packets = 0;
+	};
+
+	// Sending never blocks; what the socket does not take right away is queued
+	// for the peer. A peer whose queue grows past network_peer_max_queue_bytes
+	// is disconnected.
+	// Packets keep their order only within a channel. Large packets are sent
+	// in fragments so that other channels are not blocked by them.
+	enum Channel
+	{
+		// Small latency-critical packets, eg. movement
+		CHANNEL_REALTIME,
+		CHANNEL_DEFAULT,
+		// Large transfers that can take long, eg. files
+		CHANNEL_BULK,
+		NUM_CHANNELS
+	};
+
 	struct Interface
 	{
+		// Sends on CHANNEL_DEFAULT
+		virtual void send(PeerInfo::Id recipient, const ss_ &name,
+				const ss_ &data) = 0;
 		virtual void send(PeerInfo::Id recipient, const ss_ &name,
+				const ss_ &data, Channel channel) = 0;
+		// Dropped instead of queued while the peer's queue is above
+		// network_peer_high_water_bytes; returns false if dropped. For data
+		// that the caller can send again later, eg. a full copy of something
+		// that supersedes the previous one.
+		virtual bool send_droppable(PeerInfo::Id recipient, const ss_ &name,
 				const ss_ &data) = 0;
+		// For transient state of which only the newest value matters, eg.
+		// positions. Sent over UDP if the peer has it and as droppable on
+		// CHANNEL_REALTIME otherwise. The client drops an update that
+		// arrives after a newer one of the same name and key.
+		virtual void send_unreliable(PeerInfo::Id recipient, const ss_ &name,
+				uint32_t key, const ss_ &data) = 0;
+		// The same kind of update, but always queued over TCP on channel and
+		// never dropped; eg. for the final value of something that stopped
+		// changing, or when the update must not arrive before earlier
+		// packets of the channel
+		virtual void send_unreliable_reliably(PeerInfo::Id recipient,
+				const ss_ &name, uint32_t key, const ss_ &data,
+				Channel channel) = 0;
+		// Output queued for the peer and not yet handed to its socket; 0 if
+		// the peer doesn't exist
+		virtual size_t get_unsent_bytes(PeerInfo::Id recipient) = 0;
+		virtual sv_<PeerStats> get_peer_stats() = 0;
 		virtual sv_<PeerInfo::Id> list_peers() = 0;
+		virtual NetworkStats get_stats() = 0;
 	};
 
 	inline bool access(interface::Server *server,
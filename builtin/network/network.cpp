@@ -4,15 +4,25 @@
 #include "core/log.h"
 #include "interface/module.h"
 #include "interface/server.h"
+#include "interface/server_config.h"
 #include "interface/event.h"
+#include "interface/event_pool.h"
 #include "interface/tcpsocket.h"
+#include "interface/udpsocket.h"
+#include "interface/datagram.h"
+#include "interface/session_recording.h"
 #include "interface/packet_stream.h"
 #include "interface/thread.h"
-#include "interface/select_handler.h"
+#include "interface/mutex.h"
+#include "interface/poller.h"
+#include "interface/os.h"
 #include <cereal/archives/portable_binary.hpp>
 #include <cereal/types/vector.hpp>
+#include <cereal/types/string.hpp>
 #include <cereal/types/tuple.hpp>
 #include <deque>
+#include <atomic>
+#include <algorithm>
 #ifdef _WIN32
 	#include "ports/windows_sockets.h"
 	#include "ports/windows_compat.h" // usleep()
@@ -21,20 +31,72 @@
 	#include <unistd.h> // usleep()
 #endif
 #include <errno.h>
+#include <cstring> // strerror()
 #define MODULE "network"
 
+#ifdef _WIN32
+	#define RECV_DONTWAIT 0 // Not needed; the Windows poller is level-triggered
+#else
+	#define RECV_DONTWAIT MSG_DONTWAIT
+#endif
+
+
 using interface::Event;
+namespace datagram = interface::datagram;
+namespace session_recording = interface::session_recording;
 
 namespace network {
 
 struct Module;
+struct Peer;
+
+// Each peer is handled by one I/O thread, which receives and parses its
+// packets without taking the module's lock. Sending happens in the threads
+// of other modules under the peer's own mutex.
+struct IoThread
+{
+	size_t index = 0;
+	up_<interface::Poller> poller;
+	sm_<int, sp_<Peer>> peers_by_socket;
+	// Sockets of peers with collected output and when it is due to be sent,
+	// in that order
+	std::deque<std::pair<int64_t, int>> due_flushes;
+	interface::Mutex mutex; // Protects each of the former variables
+	up_<interface::Thread> thread;
+};
 
 struct NetworkThread: public interface::ThreadedThing
 {
 	Module *m_module = nullptr;
+	IoThread *m_io_thread = nullptr;
 
-	NetworkThread(Module *module):
-		m_module(module)
+	NetworkThread(Module *module, IoThread *io_thread):
+		m_module(module),
+		m_io_thread(io_thread)
+	{}
+
+	void run(interface::Thread *thread);
+	void on_crash(interface::Thread *thread);
+};
+
+// A recorded client and the stream that turns its packets back into bytes
+struct ReplayedPeer
+{
+	sp_<Peer> peer;
+	up_<session_recording::Encoder> encoder;
+};
+
+// Feeds a recording to the module as if its clients were connected
+struct ReplayThread: public interface::ThreadedThing
+{
+	Module *m_module = nullptr;
+	up_<session_recording::Replayer> m_replayer;
+	// Recorded peer id -> replayed peer
+	sm_<uint32_t, ReplayedPeer> m_peers;
+
+	ReplayThread(Module *module, session_recording::Replayer *replayer):
+		m_module(module),
+		m_replayer(replayer)
 	{}
 
 	void run(interface::Thread *thread);
@@ -47,45 +109,165 @@ struct Peer
 
 	Id id = 0;
 	sp_<interface::TCPSocket> socket;
-	std::deque<char> socket_buffer;
-	interface::PacketStream packet_stream;
+	IoThread *io_thread = nullptr; // Not set if replayed
+	std::atomic_bool disconnected;
+	// Fed from a recording by ReplayThread instead of a socket; output is
+	// produced as usual but then discarded
+	bool replayed = false;
+
+	// Receiving; used only by io_thread (or ReplayThread)
+	interface::PacketStream input_stream;
+
+	// Sending; protected by mutex
+	interface::Mutex mutex;
+	// Queues packets in channels until they are due to be sent or until
+	// the socket takes more
+	interface::PacketStream output_stream;
+	// Output taken from the channels, waiting for the socket to be writable
+	std::deque<ss_> output_queue;
+	size_t output_offset = 0; // Bytes of the first string already sent
+	size_t output_queue_bytes = 0; // Not yet sent
+	size_t max_output_queue_bytes = 0; // Of get_unsent_bytes()
+	size_t num_dropped_packets = 0;
+	bool write_interest = false;
+	bool flush_scheduled = false; // In io_thread->due_flushes
+	// Copied from input_stream by io_thread
+	uint32_t peer_stream_flags = 0;
+	interface::CompressionStats input_compression_stats;
+	// Unreliable side channel; protected by mutex
+	ss_ udp_token;
+	ss_ udp_address; // Empty until the client has said hello over UDP
+	uint32_t next_unreliable_sequence = 0;
 
-	Peer(){}
 	Peer(Id id, sp_<interface::TCPSocket> socket):
-		id(id), socket(socket){}
+		id(id), socket(socket), disconnected(false)
+	{
+		// Look up the event type once when a packet type gets defined
+		input_stream.set_incoming_type_resolver([](const ss_ &name){
+			return interface::Event::t("network:packet_received/"+name);
+		});
+	}
+
+	// Including what is queued in the channels
+	size_t get_unsent_bytes() const
+	{
+		size_t bytes = output_queue_bytes;
+		for(size_t channel = 0; channel < NUM_CHANNELS; channel++)
+			bytes += output_stream.get_queued_output_bytes(channel);
+		return bytes;
+	}
 };
 
 struct Module: public interface::Module, public network::Interface
 {
 	interface::Server *m_server;
+	ss_ m_address = "any4";
+	ss_ m_port = "20000";
 	sp_<interface::TCPSocket> m_listening_socket;
-	sm_<Peer::Id, Peer> m_peers;
-	sm_<int, Peer*> m_peers_by_socket;
+	std::atomic_int m_listening_fd;
+	sm_<Peer::Id, sp_<Peer>> m_peers;
 	size_t m_next_peer_id = 1;
+	size_t m_next_io_thread = 0;
+	// Not set if UDP is disabled or could not be bound
+	sp_<interface::UDPSocket> m_udp_socket;
+	std::atomic_int m_udp_fd;
+	sm_<ss_, Peer::Id> m_peers_by_udp_token;
+	// Protects m_listening_socket, m_peers, m_udp_socket,
+	// m_peers_by_udp_token and the counters above
+	interface::Mutex m_peers_mutex;
 	bool m_will_restore_after_unload = false;
-	up_<interface::Thread> m_thread;
+	sv_<up_<IoThread>> m_io_threads;
+	NetworkStats m_stats;
+	// Of disconnected peers
+	interface::CompressionStats m_old_compression_stats;
+	NetworkStats m_last_logged_stats;
+	// Protects the stats above
+	interface::Mutex m_stats_mutex;
+	size_t m_high_water_bytes;
+	size_t m_max_queue_bytes;
+	size_t m_coalesce_bytes;
+	int64_t m_coalesce_us;
+	size_t m_fragment_bytes;
+	size_t m_send_window_bytes;
+	size_t m_max_packet_bytes;
+	bool m_udp_enabled;
+	interface::CompressionOptions m_compression;
+	sp_<session_recording::Recorder> m_recorder;
+	up_<interface::Thread> m_replay_thread;
 
 	Module(interface::Server *server):
 		interface::Module(MODULE),
 		m_server(server),
-		m_listening_socket(interface::createTCPSocket())
+		m_listening_socket(interface::createTCPSocket()),
+		m_listening_fd(-1),
+		m_udp_fd(-1),
+		m_high_water_bytes(server->get_config().get<int64_t>(
+				"network_peer_high_water_bytes")),
+		m_max_queue_bytes(server->get_config().get<int64_t>(
+				"network_peer_max_queue_bytes")),
+		m_coalesce_bytes(server->get_config().get<int64_t>(
+				"network_coalesce_bytes")),
+		m_coalesce_us(server->get_config().get<int64_t>(
+				"network_coalesce_us")),
+		m_fragment_bytes(server->get_config().get<int64_t>(
+				"network_fragment_bytes")),
+		m_send_window_bytes(server->get_config().get<int64_t>(
+				"network_send_window_bytes")),
+		m_max_packet_bytes(server->get_config().get<int64_t>(
+				"network_max_packet_bytes")),
+		m_udp_enabled(server->get_config().get<bool>("network_udp"))
 	{
 		log_d(MODULE, "network construct");
+		const interface::ServerConfig &config = server->get_config();
+		m_compression.enabled = config.get<bool>("network_compression");
+		m_compression.min_size = config.get<int64_t>(
+				"network_compression_min_bytes");
+		m_compression.level = config.get<int64_t>("network_compression_level");
+		m_compression.streaming = config.get<bool>(
+				"network_compression_streaming");
+
+		const ss_ &record_path = config.get<ss_>("network_record_path");
+		if(!record_path.empty()){
+			log_i(MODULE, "Recording session into %s", cs(record_path));
+			m_recorder = session_recording::getGlobalRecorder(record_path);
+		}
+
+		size_t num_io_threads = config.get<int64_t>("network_io_threads");
+		if(num_io_threads == 0)
+			num_io_threads = interface::os::get_num_cpus();
+		for(size_t i = 0; i < num_io_threads; i++){
+			up_<IoThread> io(new IoThread());
+			io->index = i;
+			io->poller.reset(interface::createPoller());
+			m_io_threads.push_back(std::move(io));
+		}
 	}
 
 	~Module()
 	{
 		log_d(MODULE, "network destruct");
 
-		m_thread->request_stop();
-		m_thread->join();
+		for(up_<IoThread> &io : m_io_threads){
+			io->thread->request_stop();
+			io->poller->wake();
+		}
+		for(up_<IoThread> &io : m_io_threads)
+			io->thread->join();
+		if(m_replay_thread){
+			m_replay_thread->request_stop();
+			m_replay_thread->join();
+		}
+		if(m_recorder){
+			m_recorder->flush();
+			log_recorder_stats();
+		}
 
 		if(m_will_restore_after_unload){
 			if(m_listening_socket->good()){
 				m_listening_socket->release_fd();
 			}
-			for(auto pair : m_peers){
-				const Peer &peer = pair.second;
+			for(auto &pair : m_peers){
+				const Peer &peer = *pair.second;
 				if(peer.socket->good()){
 					peer.socket->release_fd();
 				}
@@ -99,12 +281,19 @@ struct Module: public interface::Module, public network::Interface
 		m_server->sub_event(this, Event::t("core:start"));
 		m_server->sub_event(this, Event::t("core:unload"));
 		m_server->sub_event(this, Event::t("core:continue"));
+		m_server->sub_event(this, Event::t("core:stats"));
+		m_server->sub_event(this, Event::t("core:tick"));
+		m_server->sub_event(this, Event::t("core:replication_tick"));
+		m_server->sub_event(this, Event::t("network:packet_received/core:ping"));
 
-		// Don't start thread in constructor because in there this module is not
-		// guaranteed to be available by server->access_module()
-		m_thread.reset(interface::createThread(new NetworkThread(this)));
-		m_thread->set_name("network/select");
-		m_thread->start();
+		// Don't start threads in constructor because in there this module is
+		// not guaranteed to be available by server->access_module()
+		for(up_<IoThread> &io : m_io_threads){
+			io->thread.reset(interface::createThread(
+					new NetworkThread(this, io.get())));
+			io->thread->set_name("network/io "+itos(io->index));
+			io->thread->start();
+		}
 	}
 
 	void event(const Event::Type &type, const Event::Private *p)
@@ -112,13 +301,18 @@ struct Module: public interface::Module, public network::Interface
 		EVENT_VOIDN("core:start", on_start)
 		EVENT_VOIDN("core:unload", on_unload)
 		EVENT_VOIDN("core:continue", on_continue)
+		EVENT_VOIDN("core:stats", on_stats)
+		EVENT_VOIDN("core:tick", on_tick)
+		EVENT_VOIDN("core:replication_tick", on_tick)
+		EVENT_TYPEN("network:packet_received/core:ping", on_ping, Packet)
 	}
 
 	void on_start()
 	{
-		ss_ address = "any4";
-		ss_ port = "20000";
+		const ss_ &address = m_address;
+		const ss_ &port = m_port;
 
+		interface::MutexScope ms(m_peers_mutex);
 		if(!m_listening_socket->bind_fd(address, port) ||
 				!m_listening_socket->listen_fd()){
 			log_i(MODULE, "Failed to bind to %s:%s, fd=%i", cs(address), cs(port),
@@ -132,19 +326,87 @@ struct Module: public interface::Module, public network::Interface
 			log_i(MODULE, "Listening at %s:%s, fd=%i", cs(address), cs(port),
 					m_listening_socket->fd());
 		}
+		m_listening_fd = m_listening_socket->fd();
+		// Level-triggered because only one connection is accepted at a time
+		m_io_threads[0]->poller->add(m_listening_fd, false);
+		start_udp();
+		start_replay();
+	}
+
+	void start_replay()
+	{
+		const interface::ServerConfig &config = m_server->get_config();
+		const ss_ &path = config.get<ss_>("network_replay_path");
+		if(path.empty())
+			return;
+		double speed = config.get<double>("network_replay_speed");
+		log_i(MODULE, "Replaying %s at speed %f", cs(path), speed);
+		m_replay_thread.reset(interface::createThread(new ReplayThread(this,
+				session_recording::createReplayer(path, speed))));
+		m_replay_thread->set_name("network/replay");
+		m_replay_thread->start();
+	}
+
+	// Binds to the same port as TCP. Failing is not fatal; unreliable
+	// updates are then sent over TCP.
+	void start_udp()
+	{
+		if(!m_udp_enabled)
+			return;
+		sp_<interface::UDPSocket> socket(interface::createUDPSocket());
+		if(!socket->bind_fd(m_address, m_port)){
+			log_w(MODULE, "Failed to bind UDP to %s:%s; sending unreliable "
+					"updates over TCP", cs(m_address), cs(m_port));
+			return;
+		}
+		log_i(MODULE, "UDP at %s:%s, fd=%i", cs(m_address), cs(m_port),
+				socket->fd());
+		{
+			interface::MutexScope ms(m_peers_mutex);
+			m_udp_socket = socket;
+			m_udp_fd = socket->fd();
+		}
+		// Level-triggered so that a limited number of datagrams can be
+		// received at a time
+		m_io_threads[0]->poller->add(socket->fd(), false);
 	}
 
 	void on_unload()
 	{
 		log_v(MODULE, "on_unload");
 		m_will_restore_after_unload = true;
+		// Don't lose output collected during this tick
+		on_tick();
 
-		int listening_fd = m_listening_socket->fd();
-		sv_<std::tuple<Peer::Id, int>> peer_restore_info;
-		for(auto &pair : m_peers){
-			Peer &peer = pair.second;
-			peer_restore_info.push_back(std::tuple<Peer::Id, int>(
-					peer.id, peer.socket->fd()));
+		int listening_fd;
+		{
+			interface::MutexScope ms(m_peers_mutex);
+			listening_fd = m_listening_socket->fd();
+		}
+		sv_<std::tuple<Peer::Id, int, ss_, uint32_t>> peer_restore_info;
+		for(const sp_<Peer> &peer : get_peers()){
+			// A replay is not continued
+			if(peer->replayed)
+				continue;
+			interface::MutexScope ms(peer->mutex);
+			if(peer->disconnected)
+				continue;
+			// Whatever the socket didn't take yet is sent first after the
+			// restore so that the stream continues where it was cut
+			ss_ unsent;
+			for(const ss_ &s : peer->output_queue){
+				size_t offset = unsent.empty() ? peer->output_offset : 0;
+				unsent.append(s, offset, ss_::npos);
+			}
+			peer->output_queue.clear();
+			peer->output_offset = 0;
+			peer->output_queue_bytes = 0;
+			peer->output_stream.pull_output(unsent, SIZE_MAX);
+			// Continued so that an update still on its way can't pass as
+			// newer than the ones sent after the restore
+			peer_restore_info.push_back(
+					std::tuple<Peer::Id, int, ss_, uint32_t>(peer->id,
+					peer->socket->fd(), unsent, peer->next_unreliable_sequence));
 		}
 
 		std::ostringstream os(std::ios::binary);
@@ -162,7 +424,7 @@ struct Module: public interface::Module, public network::Interface
 		ss_ data = m_server->tmp_restore_data("network:restore_info");
 		// name, content, path
 		int listening_fd;
-		sv_<std::tuple<Peer::Id, int>> peer_restore_info;
+		sv_<std::tuple<Peer::Id, int, ss_, uint32_t>> peer_restore_info;
 		std::istringstream is(data, std::ios::binary);
 		{
 			cereal::PortableBinaryInputArchive ar(is);
@@ -170,133 +432,793 @@ struct Module: public interface::Module, public network::Interface
 			ar(peer_restore_info);
 		}
 
-		m_listening_socket.reset(interface::createTCPSocket(listening_fd));
+		{
+			interface::MutexScope ms(m_peers_mutex);
+			m_listening_socket.reset(interface::createTCPSocket(listening_fd));
+			m_listening_fd = listening_fd;
+		}
+		m_io_threads[0]->poller->add(listening_fd, false);
+		// Not restored; the clients are given new tokens
+		start_udp();
 
 		for(auto &tuple : peer_restore_info){
 			Peer::Id peer_id = std::get<0>(tuple);
 			int fd = std::get<1>(tuple);
-			log_i(MODULE, "Restoring peer %i: fd=%i", peer_id, fd);
+			const ss_ &unsent = std::get<2>(tuple);
+			log_i(MODULE, "Restoring peer %zu: fd=%i, %zu bytes unsent",
+					peer_id, fd, unsent.size());
 			sp_<interface::TCPSocket> socket(interface::createTCPSocket(fd));
-			m_peers[peer_id] = Peer(peer_id, socket);
-			m_peers_by_socket[socket->fd()] = &m_peers[peer_id];
+			socket->set_nonblocking(true);
+			sp_<Peer> peer = add_peer(peer_id, socket, false, unsent);
+			peer->next_unreliable_sequence = std::get<3>(tuple);
+			start_polling(peer);
+		}
+	}
+
+	void on_stats()
+	{
+		interface::PollerStats ps = get_poller_stats();
+		size_t num_peers = 0;
+		size_t num_udp_peers = 0;
+		size_t queued_bytes = 0;
+		for(const sp_<Peer> &peer : get_peers()){
+			interface::MutexScope ms(peer->mutex);
+			queued_bytes += peer->get_unsent_bytes();
+			num_peers++;
+			if(!peer->udp_address.empty())
+				num_udp_peers++;
 		}
+		interface::CompressionStats compression = get_compression_stats();
+		interface::MutexScope ms(m_stats_mutex);
+		log_v(MODULE, "%zu peers on %zu I/O threads; %zu wakeups (%zu "
+				"timeouts, %zu wake requests), %zu ready sockets (max %zu per "
+				"wakeup); handling latency average %ius, max %ius", num_peers,
+				m_io_threads.size(), ps.num_wakeups, ps.num_timeouts,
+				ps.num_wake_requests, ps.num_ready, ps.max_ready_per_wakeup,
+				(int)m_stats.average_latency_us, (int)m_stats.max_latency_us);
+		log_v(MODULE, "%zu bytes queued for output; %zu packets dropped and "
+				"%zu peers disconnected due to backpressure", queued_bytes,
+				m_stats.num_dropped_packets,
+				m_stats.num_backpressure_disconnects);
+		const NetworkStats &last = m_last_logged_stats;
+		size_t flushes = m_stats.num_flushes - last.num_flushes;
+		size_t calls = m_stats.num_send_calls - last.num_send_calls;
+		size_t bytes = m_stats.num_bytes_sent - last.num_bytes_sent;
+		log_v(MODULE, "%zu send calls in %zu flushes (%.1f per flush), "
+				"%zu bytes (%zu per call)", calls, flushes,
+				flushes ? (double)calls / flushes : 0.0, bytes,
+				calls ? bytes / calls : 0);
+		log_v(MODULE, "UDP: %zu of %zu peers; %zu datagrams sent, %zu "
+				"received; %zu unreliable updates sent over TCP",
+				num_udp_peers, num_peers,
+				m_stats.num_datagrams_sent - last.num_datagrams_sent,
+				m_stats.num_datagrams_received - last.num_datagrams_received,
+				m_stats.num_unreliable_over_tcp - last.num_unreliable_over_tcp);
+		m_last_logged_stats = m_stats;
+		log_v(MODULE, "Compression: %s", cs(interface::format_compression_stats(
+				compression)));
+		if(m_recorder)
+			log_recorder_stats();
 	}
 
-	void on_listen_event(int event_fd)
+	void log_recorder_stats()
+	{
+		session_recording::RecorderStats stats = m_recorder->get_stats();
+		log_v(MODULE, "Recorded %zu packets into %zu bytes",
+				stats.num_packets, stats.num_bytes);
+	}
+
+	// Answered from the event queue like any packet, so that the round trip
+	// measured by eg. buildat_loadgen includes dispatching and output ticks
+	void on_ping(const Packet &packet)
+	{
+		send(packet.sender, "core:pong", packet.data, false, CHANNEL_REALTIME);
+	}
+
+	interface::PollerStats get_poller_stats()
+	{
+		interface::PollerStats stats;
+		for(up_<IoThread> &io : m_io_threads){
+			interface::PollerStats ps = io->poller->get_stats();
+			stats.num_wakeups += ps.num_wakeups;
+			stats.num_timeouts += ps.num_timeouts;
+			stats.num_wake_requests += ps.num_wake_requests;
+			stats.num_ready += ps.num_ready;
+			if(ps.max_ready_per_wakeup > stats.max_ready_per_wakeup)
+				stats.max_ready_per_wakeup = ps.max_ready_per_wakeup;
+		}
+		return stats;
+	}
+
+	interface::CompressionStats get_compression_stats()
+	{
+		interface::CompressionStats stats;
+		{
+			interface::MutexScope ms(m_stats_mutex);
+			stats = m_old_compression_stats;
+		}
+		for(const sp_<Peer> &peer : get_peers()){
+			interface::MutexScope ms(peer->mutex);
+			interface::add_compression_stats(stats,
+					peer->output_stream.get_compression_stats());
+			interface::add_compression_stats(stats,
+					peer->input_compression_stats);
+		}
+		return stats;
+	}
+
+	// Output is normally sent by the I/O threads when it is due; this
+	// catches what was collected without one, eg. for a replayed peer or
+	// before polling started
+	void on_tick()
+	{
+		size_t num_flushes = 0;
+		for(const sp_<Peer> &peer : get_peers()){
+			interface::MutexScope ms(peer->mutex);
+			if(peer->disconnected || !peer->output_stream.has_queued_output())
+				continue;
+			pump_u(*peer);
+			num_flushes++;
+		}
+		if(num_flushes > 0){
+			interface::MutexScope ms(m_stats_mutex);
+			m_stats.num_flushes += num_flushes;
+		}
+	}
+
+	sv_<sp_<Peer>> get_peers()
+	{
+		interface::MutexScope ms(m_peers_mutex);
+		sv_<sp_<Peer>> peers;
+		for(auto &pair : m_peers)
+			peers.push_back(pair.second);
+		return peers;
+	}
+
+	sp_<Peer> find_peer(Peer::Id id)
+	{
+		interface::MutexScope ms(m_peers_mutex);
+		auto it = m_peers.find(id);
+		if(it == m_peers.end())
+			return sp_<Peer>();
+		return it->second;
+	}
+
+	// id == 0 allocates a new id. The peer is given to the I/O threads in
+	// turn, unless it is replayed; start_polling() has to be called then.
+	// unsent_output is sent before anything else.
+	sp_<Peer> add_peer(Peer::Id id, sp_<interface::TCPSocket> socket,
+			bool replayed = false, const ss_ &unsent_output = "")
+	{
+		sp_<Peer> peer(new Peer(id, socket));
+		peer->replayed = replayed;
+		{
+			interface::MutexScope ms(m_peers_mutex);
+			if(id == 0)
+				peer->id = m_next_peer_id++;
+			else if(id >= m_next_peer_id)
+				m_next_peer_id = id + 1;
+			m_peers[peer->id] = peer;
+			if(!replayed){
+				peer->io_thread = m_io_threads[
+						m_next_io_thread++ % m_io_threads.size()].get();
+			}
+		}
+		// A restored peer is still connected as far as the recording goes
+		if(m_recorder && id == 0)
+			m_recorder->peer_connected(peer->id);
+
+		peer->input_stream.set_compression(m_compression);
+		peer->input_stream.set_max_packet_size(m_max_packet_bytes);
+		peer->output_stream.set_compression(m_compression);
+		sv_<int> weights(NUM_CHANNELS);
+		weights[CHANNEL_REALTIME] = 8;
+		weights[CHANNEL_DEFAULT] = 4;
+		weights[CHANNEL_BULK] = 1;
+		peer->output_stream.set_output_channels(weights, m_fragment_bytes);
+		if(!unsent_output.empty()){
+			peer->output_queue.push_back(unsent_output);
+			peer->output_queue_bytes += unsent_output.size();
+		}
+		if(replayed)
+			return peer;
+		// Keep the kernel from buffering more than the send window so that
+		// the channels decide what is sent next
+		socket->set_unsent_low_water(m_send_window_bytes);
+		return peer;
+	}
+
+	// Lets the I/O thread of the peer receive and send. Packets of the peer
+	// can be emitted by it (possibly another thread) from here on.
+	void start_polling(const sp_<Peer> &peer)
+	{
+		IoThread *io = peer->io_thread;
+		int fd = peer->socket->fd();
+		{
+			interface::MutexScope ms(io->mutex);
+			io->peers_by_socket[fd] = peer;
+		}
+		io->poller->add(fd, true);
+		reset_unreliable(peer);
+		offer_udp(peer);
+	}
+
+	// Has the client forget the unreliable updates it has seen, as they
+	// were filtered by another instance of this module or another
+	// connection
+	void reset_unreliable(const sp_<Peer> &peer)
+	{
+		interface::MutexScope ms(peer->mutex);
+		send_u(*peer, "core:unreliable_reset", "", false, CHANNEL_REALTIME);
+	}
+
+	// Tells the client where to say hello over UDP to start receiving
+	// unreliable updates that way
+	void offer_udp(const sp_<Peer> &peer)
+	{
+		ss_ token = datagram::create_token();
+		{
+			interface::MutexScope ms(m_peers_mutex);
+			if(!m_udp_socket)
+				return;
+			m_peers_by_udp_token[token] = peer->id;
+		}
+		std::ostringstream os(std::ios::binary);
+		{
+			cereal::PortableBinaryOutputArchive ar(os);
+			ar((uint16_t)std::stoi(m_port));
+			ar(token);
+		}
+		interface::MutexScope ms(peer->mutex);
+		peer->udp_token = token;
+		send_u(*peer, "core:udp_offer", os.str(), false, CHANNEL_REALTIME);
+	}
+
+	sp_<Peer> find_peer_by_udp_token(const ss_ &token)
+	{
+		interface::MutexScope ms(m_peers_mutex);
+		auto it = m_peers_by_udp_token.find(token);
+		if(it == m_peers_by_udp_token.end())
+			return sp_<Peer>();
+		auto it2 = m_peers.find(it->second);
+		if(it2 == m_peers.end())
+			return sp_<Peer>();
+		return it2->second;
+	}
+
+	// Called by the I/O thread that has the UDP socket
+	void on_udp_event()
+	{
+		sp_<interface::UDPSocket> socket;
+		{
+			interface::MutexScope ms(m_peers_mutex);
+			socket = m_udp_socket;
+		}
+		if(!socket)
+			return;
+		// The rest are reported again at the next wakeup
+		static const size_t MAX_DATAGRAMS_PER_EVENT = 64;
+		char buf[datagram::MAX_SIZE];
+		size_t num_received = 0;
+		size_t num_sent = 0;
+		while(num_received < MAX_DATAGRAMS_PER_EVENT){
+			ss_ address;
+			ssize_t r = socket->receive_from(buf, sizeof buf, &address);
+			if(r == -1)
+				break;
+			num_received++;
+			datagram::Kind kind;
+			ss_ token;
+			if(!datagram::read_header(buf, r, &kind, &token) ||
+					kind != datagram::HELLO)
+				continue;
+			sp_<Peer> peer = find_peer_by_udp_token(token);
+			if(!peer)
+				continue;
+			{
+				// Also follows the client to a new address
+				interface::MutexScope ms(peer->mutex);
+				if(peer->udp_token != token)
+					continue;
+				if(peer->udp_address != address){
+					log_v(MODULE, "Client %zu: UDP from %s", peer->id,
+							cs(socket->format_address(address)));
+					peer->udp_address = address;
+				}
+			}
+			ss_ welcome;
+			datagram::write_header(datagram::WELCOME, token, welcome);
+			socket->send_to(welcome.c_str(), welcome.size(), address);
+			num_sent++;
+		}
+		interface::MutexScope ms(m_stats_mutex);
+		m_stats.num_datagrams_received += num_received;
+		m_stats.num_datagrams_sent += num_sent;
+	}
+
+	// Called by the I/O thread that has the listening socket
+	void on_listen_event(int event_fd, sv_<Event> &events)
 	{
 		log_v(MODULE, "network: on_listen_event(): fd=%i", event_fd);
+		sp_<interface::TCPSocket> listening_socket;
+		{
+			interface::MutexScope ms(m_peers_mutex);
+			listening_socket = m_listening_socket;
+		}
 		// Create socket
 		sp_<interface::TCPSocket> socket(interface::createTCPSocket());
 		// Accept connection
-		socket->accept_fd(*m_listening_socket.get());
+		if(!socket->accept_fd(*listening_socket))
+			return;
+		socket->set_nonblocking(true);
 		// Store socket
-		Peer::Id peer_id = m_next_peer_id++;
-		m_peers[peer_id] = Peer(peer_id, socket);
-		m_peers_by_socket[socket->fd()] = &m_peers[peer_id];
+		sp_<Peer> peer = add_peer(0, socket);
 		log_i(MODULE, "Client %zu from %s connected",
-				peer_id, cs(socket->get_remote_address()));
-		// Emit event
+				peer->id, cs(socket->get_remote_address()));
+		// Emitted before the peer's I/O thread can emit any of its packets
 		PeerInfo pinfo;
-		pinfo.id = peer_id;
+		pinfo.id = peer->id;
 		pinfo.address = socket->get_remote_address();
-		m_server->emit_event("network:client_connected", new NewClient(pinfo));
+		m_server->emit_event(Event("network:client_connected",
+				new NewClient(pinfo)));
+		{
+			// Let the client start compressing as early as possible
+			interface::MutexScope ms(peer->mutex);
+			peer->output_queue.push_back(ss_());
+			peer->output_stream.output_stream_options(
+					peer->output_queue.back());
+			peer->output_queue_bytes += peer->output_queue.back().size();
+		}
+		start_polling(peer);
+		interface::MutexScope ms(peer->mutex);
+		if(!peer->disconnected)
+			flush_u(*peer);
 	}
 
-	void on_incoming_data(int event_fd)
+	// Called by the I/O thread of the peer
+	void on_incoming_data(Peer &peer, sv_<Event> &events)
 	{
-		log_v(MODULE, "network: on_incoming_data(): fd=%i", event_fd);
-
-		auto it = m_peers_by_socket.find(event_fd);
-		if(it == m_peers_by_socket.end()){
-			log_w(MODULE, "network: Peer with fd=%i not found", event_fd);
+		if(peer.disconnected)
 			return;
-		}
-		Peer &peer = *it->second;
-
 		int fd = peer.socket->fd();
-		if(fd != event_fd)
-			throw Exception("on_incoming_data: fds don't match");
-		char buf[100000];
-		ssize_t r = recv(fd, buf, 100000, 0);
-		if(r == -1){
+		log_v(MODULE, "network: on_incoming_data(): fd=%i", fd);
+		// An edge-triggered socket is reported only once for all the data
+		// that has arrived, so read until there is no more
+		bool drain = peer.io_thread->poller->is_edge_triggered_supported();
+		for(;;){
+			// Receive straight into the packet stream's buffer
+			size_t space_size = 0;
+			char *space = peer.input_stream.get_input_space(&space_size);
+			ssize_t r = recv(fd, space, space_size, drain ? RECV_DONTWAIT : 0);
+			if(r == -1){
+				if(errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
 #ifdef ECONNRESET // No idea why this isn't defined on MinGW
-			if(errno == ECONNRESET){
-				log_v(MODULE, "Peer %zu: Connection reset by peer", peer.id);
+				if(errno == ECONNRESET){
+					log_v(MODULE, "Peer %zu: Connection reset by peer", peer.id);
+					// Not reported again, so handle as a disconnect
+					disconnect(peer, &events);
+					return;
+				}
+#endif
+				throw Exception(ss_()+"Receive failed: "+strerror(errno));
+			}
+			if(r == 0){
+				log_i(MODULE, "Client %zu from %s disconnected",
+						peer.id, cs(peer.socket->get_remote_address()));
+				disconnect(peer, &events);
 				return;
 			}
-#endif
-			throw Exception(ss_()+"Receive failed: "+strerror(errno));
+			log_v(MODULE, "Received %zu bytes", r);
+			try {
+				peer.input_stream.input_received(r,
+				[&](const interface::IncomingPacket &packet){
+					on_incoming_packet(peer, packet, events);
+				});
+			} catch(interface::UnknownPacketReceived &e){
+				log_w(MODULE, "%s", e.what());
+			} catch(interface::CorruptPacketReceived &e){
+				log_w(MODULE, "Client %zu: %s; disconnecting", peer.id, e.what());
+				disconnect(peer, &events);
+				return;
+			}
+			if(!drain)
+				break;
 		}
-		if(r == 0){
-			log_i(MODULE, "Client %zu from %s disconnected",
-					peer.id, cs(peer.socket->get_remote_address()));
+		update_peer_stream_flags(peer);
+	}
 
-			PeerInfo pinfo;
-			pinfo.id = peer.id;
-			pinfo.address = peer.socket->get_remote_address();
-			m_server->emit_event("network:client_disconnected",
-					new OldClient(pinfo));
+	void on_incoming_packet(Peer &peer,
+			const interface::IncomingPacket &packet, sv_<Event> &events)
+	{
+		if(m_recorder){
+			m_recorder->packet(session_recording::INCOMING, peer.id,
+					*packet.info->name, *packet.data);
+		}
+		events.push_back(Event(packet.info->resolved,
+				interface::event_pool::make<Packet>(
+				peer.id, packet.info->name, packet.data)));
+	}
 
-			m_peers_by_socket.erase(peer.socket->fd());
-			m_peers.erase(peer.id);
+	// Called after input; tells the sending side what the client can
+	// decompress
+	void update_peer_stream_flags(Peer &peer)
+	{
+		interface::MutexScope ms(peer.mutex);
+		uint32_t flags = peer.input_stream.get_peer_stream_flags();
+		if(flags != peer.peer_stream_flags){
+			peer.peer_stream_flags = flags;
+			peer.output_stream.set_peer_stream_flags(flags);
+		}
+		peer.input_compression_stats = peer.input_stream.get_compression_stats();
+	}
+
+	// If events is given, network:client_disconnected is added to it instead
+	// of being emitted right away
+	void disconnect(Peer &peer, sv_<Event> *events)
+	{
+		if(peer.disconnected.exchange(true))
 			return;
+		if(m_recorder)
+			m_recorder->peer_disconnected(peer.id);
+		PeerInfo pinfo;
+		pinfo.id = peer.id;
+		pinfo.address = peer.socket->get_remote_address();
+		Event event("network:client_disconnected", new OldClient(pinfo));
+		if(events)
+			events->push_back(std::move(event));
+		else
+			m_server->emit_event(std::move(event));
+
+		{
+			// Locked in the same order as elsewhere
+			interface::MutexScope ms(peer.mutex);
+			interface::MutexScope ms2(m_stats_mutex);
+			interface::add_compression_stats(m_old_compression_stats,
+					peer.output_stream.get_compression_stats());
+			interface::add_compression_stats(m_old_compression_stats,
+					peer.input_compression_stats);
+		}
+		IoThread *io = peer.io_thread;
+		if(io){
+			io->poller->remove(peer.socket->fd());
+			interface::MutexScope ms(io->mutex);
+			io->peers_by_socket.erase(peer.socket->fd());
+		}
+		ss_ udp_token;
+		{
+			interface::MutexScope ms(peer.mutex);
+			udp_token = peer.udp_token;
 		}
-		log_v(MODULE, "Received %zu bytes", r);
-		peer.socket_buffer.insert(peer.socket_buffer.end(), buf, buf + r);
+		interface::MutexScope ms(m_peers_mutex);
+		m_peers.erase(peer.id);
+		m_peers_by_udp_token.erase(udp_token);
+	}
 
-		try {
-			peer.packet_stream.input(peer.socket_buffer,
-			[&](const ss_ &name, const ss_ &data){
-				// Emit event
-				m_server->emit_event(ss_()+"network:packet_received/"+name,
-						new Packet(peer.id, name, data));
-			});
-		} catch(interface::UnknownPacketReceived &e){
-			log_w(MODULE, "%s", e.what());
+	// Sends as much of the output queue as the socket takes without blocking.
+	// Returns false if the peer was disconnected.
+	bool flush_u(Peer &peer)
+	{
+		static const size_t MAX_BUFFERS = 64;
+		interface::SendBuffer buffers[MAX_BUFFERS];
+		size_t num_send_calls = 0;
+		size_t num_bytes_sent = 0;
+		bool ok = true;
+		while(!peer.output_queue.empty()){
+			// Send as many queued strings as possible at once
+			size_t count = 0;
+			for(const ss_ &s : peer.output_queue){
+				if(count == MAX_BUFFERS)
+					break;
+				size_t offset = count == 0 ? peer.output_offset : 0;
+				buffers[count].data = s.c_str() + offset;
+				buffers[count].size = s.size() - offset;
+				count++;
+			}
+			ssize_t r = peer.socket->send_some(buffers, count);
+			num_send_calls++;
+			if(r == -1){
+				log_i(MODULE, "Client %zu: Send failed; disconnecting",
+						peer.id);
+				ok = false;
+				break;
+			}
+			if(r == 0)
+				break;
+			num_bytes_sent += r;
+			peer.output_queue_bytes -= r;
+			size_t left = r;
+			while(left > 0){
+				const ss_ &front = peer.output_queue.front();
+				size_t n = front.size() - peer.output_offset;
+				if(left < n){
+					peer.output_offset += left;
+					break;
+				}
+				left -= n;
+				peer.output_queue.pop_front();
+				peer.output_offset = 0;
+			}
+		}
+		{
+			interface::MutexScope ms(m_stats_mutex);
+			m_stats.num_send_calls += num_send_calls;
+			m_stats.num_bytes_sent += num_bytes_sent;
+		}
+		if(!ok){
+			disconnect(peer, nullptr);
+			return false;
 		}
+		// The rest is sent by the I/O thread once the socket is writable
+		bool more_in_channels = peer.output_stream.has_queued_output();
+		bool want_write = !peer.output_queue.empty() || more_in_channels;
+		// Enabling again makes an edge-triggered socket be reported even if
+		// it stayed writable, so that the next window is taken from the
+		// channels
+		if(want_write != peer.write_interest || more_in_channels){
+			peer.io_thread->poller->set_write_interest(
+					peer.socket->fd(), want_write);
+			peer.write_interest = want_write;
+		}
+		return true;
 	}
 
-	void send_u(Peer &peer, const ss_ &name, const ss_ &data)
+	// Moves up to a send window of output from the channels to the output
+	// queue and sends what the socket takes. Output beyond that stays in the
+	// channels, so that packets queued later in a higher priority channel
+	// can still be sent before it. Returns false if the peer was
+	// disconnected.
+	bool pump_u(Peer &peer)
 	{
-		peer.packet_stream.output(name, data, [&](const ss_ &packet_data){
-			peer.socket->send_fd(packet_data);
-		});
+		peer.flush_scheduled = false;
+		if(peer.replayed){
+			discard_output_u(peer);
+			return true;
+		}
+		if(peer.output_queue_bytes < m_send_window_bytes &&
+				peer.output_stream.has_queued_output()){
+			peer.output_queue.push_back(ss_());
+			ss_ &chunk = peer.output_queue.back();
+			peer.output_stream.pull_output(chunk,
+					m_send_window_bytes - peer.output_queue_bytes);
+			peer.output_queue_bytes += chunk.size();
+		}
+		if(!flush_u(peer))
+			return false;
+		size_t unsent_bytes = peer.get_unsent_bytes();
+		if(unsent_bytes > m_max_queue_bytes){
+			log_w(MODULE, "Client %zu: %zu bytes of output queued; "
+					"disconnecting", peer.id, unsent_bytes);
+			{
+				interface::MutexScope ms(m_stats_mutex);
+				m_stats.num_backpressure_disconnects++;
+			}
+			disconnect(peer, nullptr);
+			return false;
+		}
+		return true;
 	}
 
-	void send_u(PeerInfo::Id recipient, const ss_ &name, const ss_ &data)
+	// Output of a replayed peer is framed, compressed and pulled from the
+	// channels like that of a real one, and then counted as sent
+	void discard_output_u(Peer &peer)
 	{
-		// Grab Peer (which contains socket)
-		auto it = m_peers.find(recipient);
-		if(it == m_peers.end()){
-			log_w(MODULE, "network::send(): Peer %i doesn't exist",
-					recipient);
+		ss_ output;
+		while(peer.output_stream.has_queued_output())
+			peer.output_stream.pull_output(output, m_send_window_bytes);
+		interface::MutexScope ms(m_stats_mutex);
+		m_stats.num_bytes_sent += output.size();
+	}
+
+	// Returns false if dropped
+	bool send_u(Peer &peer, const ss_ &name, const ss_ &data, bool droppable,
+			Channel channel)
+	{
+		if(droppable && peer.get_unsent_bytes() >= m_high_water_bytes){
+			peer.num_dropped_packets++;
+			interface::MutexScope ms(m_stats_mutex);
+			m_stats.num_dropped_packets++;
+			return false;
+		}
+		if(m_recorder){
+			m_recorder->packet(session_recording::OUTGOING, peer.id, name,
+					data);
+		}
+		peer.output_stream.queue_output(channel, name, data);
+		size_t unsent_bytes = peer.get_unsent_bytes();
+		if(unsent_bytes > peer.max_output_queue_bytes)
+			peer.max_output_queue_bytes = unsent_bytes;
+		// Realtime packets go right away; others are collected for a moment
+		// so that what a module sends while handling an event goes together
+		if(channel == CHANNEL_REALTIME ||
+				unsent_bytes - peer.output_queue_bytes >= m_coalesce_bytes)
+			pump_u(peer);
+		else
+			schedule_flush_u(peer);
+		return true;
+	}
+
+	// Has the peer's I/O thread pump its output after network_coalesce_us
+	void schedule_flush_u(Peer &peer)
+	{
+		if(peer.flush_scheduled || !peer.io_thread)
 			return;
+		peer.flush_scheduled = true;
+		IoThread *io = peer.io_thread;
+		int64_t due_us = interface::os::monotonic_us() + m_coalesce_us;
+		bool was_idle = false;
+		{
+			interface::MutexScope ms(io->mutex);
+			was_idle = io->due_flushes.empty();
+			io->due_flushes.emplace_back(due_us, peer.socket->fd());
 		}
-		Peer &peer = it->second;
+		// Otherwise it is already waiting for an earlier one
+		if(was_idle)
+			io->poller->wake();
+	}
 
-		send_u(peer, name, data);
+	// Returns false if dropped; a missing peer doesn't count as that
+	bool send(PeerInfo::Id recipient, const ss_ &name, const ss_ &data,
+			bool droppable, Channel channel)
+	{
+		sp_<Peer> peer = find_peer(recipient);
+		if(!peer){
+			log_w(MODULE, "network::send(): Peer %zu doesn't exist",
+					recipient);
+			return true;
+		}
+		interface::MutexScope ms(peer->mutex);
+		if(peer->disconnected)
+			return true;
+		return send_u(*peer, name, data, droppable, channel);
 	}
 
 	// Interface for NetworkThread
 
-	sv_<int> get_sockets()
+	// Returns the peer handled by the I/O thread, if any
+	sp_<Peer> find_peer(IoThread &io, int fd)
+	{
+		interface::MutexScope ms(io.mutex);
+		auto it = io.peers_by_socket.find(fd);
+		if(it == io.peers_by_socket.end())
+			return sp_<Peer>();
+		return it->second;
+	}
+
+	// Returns how long the I/O thread can wait before a flush is due, at
+	// most max_us
+	int64_t get_flush_wait_us(IoThread &io, int64_t max_us)
+	{
+		interface::MutexScope ms(io.mutex);
+		if(io.due_flushes.empty())
+			return max_us;
+		int64_t wait_us = io.due_flushes.front().first -
+				interface::os::monotonic_us();
+		return std::max((int64_t)0, std::min(wait_us, max_us));
+	}
+
+	// Pumps the output of the peers whose flush is due
+	void handle_due_flushes(IoThread &io)
 	{
-		sv_<int> result;
-		result.push_back(m_listening_socket->fd());
-		for(auto &pair : m_peers){
-			Peer &peer = pair.second;
-			result.push_back(peer.socket->fd());
+		int64_t now_us = interface::os::monotonic_us();
+		sv_<int> fds;
+		{
+			interface::MutexScope ms(io.mutex);
+			while(!io.due_flushes.empty() &&
+					io.due_flushes.front().first <= now_us){
+				fds.push_back(io.due_flushes.front().second);
+				io.due_flushes.pop_front();
+			}
+		}
+		size_t num_flushes = 0;
+		for(int fd : fds){
+			sp_<Peer> peer = find_peer(io, fd);
+			if(!peer)
+				continue;
+			interface::MutexScope ms(peer->mutex);
+			// Not if pumped for some other reason meanwhile
+			if(peer->disconnected || !peer->flush_scheduled)
+				continue;
+			pump_u(*peer);
+			num_flushes++;
+		}
+		if(num_flushes > 0){
+			interface::MutexScope ms(m_stats_mutex);
+			m_stats.num_flushes += num_flushes;
 		}
-		return result;
 	}
 
-	void handle_active_socket(int fd)
+	// wakeup_us: When the poller returned the sockets
+	void handle_active_sockets(IoThread &io, const sv_<int> &readable_fds,
+			const sv_<int> &writable_fds, int64_t wakeup_us,
+			sv_<Event> &events)
 	{
-		if(fd == m_listening_socket->fd()){
-			on_listen_event(fd);
-		} else {
-			on_incoming_data(fd);
+		for(int fd : readable_fds){
+			if(fd == m_listening_fd){
+				on_listen_event(fd, events);
+				continue;
+			}
+			if(fd == m_udp_fd){
+				on_udp_event();
+				continue;
+			}
+			sp_<Peer> peer = find_peer(io, fd);
+			if(!peer){
+				log_w(MODULE, "network: Peer with fd=%i not found", fd);
+				continue;
+			}
+			on_incoming_data(*peer, events);
+		}
+		for(int fd : writable_fds){
+			sp_<Peer> peer = find_peer(io, fd);
+			if(!peer) // Can be disconnected already
+				continue;
+			interface::MutexScope ms(peer->mutex);
+			if(!peer->disconnected)
+				pump_u(*peer);
+		}
+		int64_t latency_us = interface::os::monotonic_us() - wakeup_us;
+		interface::MutexScope ms(m_stats_mutex);
+		m_stats.num_wakeups++;
+		if(m_stats.average_latency_us == 0)
+			m_stats.average_latency_us = latency_us;
+		else
+			m_stats.average_latency_us +=
+					(latency_us - m_stats.average_latency_us) / 16;
+		if(latency_us > m_stats.max_latency_us)
+			m_stats.max_latency_us = latency_us;
+	}
+
+	// Interface for ReplayThread
+
+	// Incoming packets are encoded and parsed again so that they cost what
+	// receiving them did. What the server recorded itself sending is not
+	// replayed; it is produced again by handling the rest.
+	void replay_record(const session_recording::Record &record,
+			sm_<uint32_t, ReplayedPeer> &peers, sv_<Event> &events)
+	{
+		if(record.kind == session_recording::CONNECT){
+			ReplayedPeer &rp = peers[record.peer];
+			if(rp.peer)
+				disconnect(*rp.peer, &events);
+			rp.peer = add_peer(0, sp_<interface::TCPSocket>(
+					interface::createTCPSocket()), true);
+			rp.encoder.reset(new session_recording::Encoder(m_compression));
+			log_v(MODULE, "Replaying recorded client %u as client %zu",
+					record.peer, rp.peer->id);
+			PeerInfo pinfo;
+			pinfo.id = rp.peer->id;
+			pinfo.address = "replay";
+			events.push_back(Event("network:client_connected",
+					new NewClient(pinfo)));
+			return;
+		}
+		auto it = peers.find(record.peer);
+		if(it == peers.end())
+			return;
+		Peer &peer = *it->second.peer;
+		if(record.kind == session_recording::DISCONNECT){
+			disconnect(peer, &events);
+			peers.erase(it);
+			return;
+		}
+		if(record.kind != session_recording::INCOMING || peer.disconnected)
+			return;
+		ss_ bytes;
+		it->second.encoder->encode(record.name, record.data, bytes);
+		try {
+			peer.input_stream.input(bytes.c_str(), bytes.size(),
+			[&](const interface::IncomingPacket &packet){
+				on_incoming_packet(peer, packet, events);
+			});
+		} catch(interface::UnknownPacketReceived &e){
+			log_w(MODULE, "%s", e.what());
+		} catch(interface::CorruptPacketReceived &e){
+			log_w(MODULE, "Client %zu: %s; disconnecting", peer.id, e.what());
+			disconnect(peer, &events);
+			return;
 		}
+		update_peer_stream_flags(peer);
 	}
 
 	// Interface
@@ -304,16 +1226,160 @@ struct Module: public interface::Module, public network::Interface
 	void send(PeerInfo::Id recipient, const ss_ &name, const ss_ &data)
 	{
 		log_d(MODULE, "network::send()");
-		send_u(recipient, name, data);
+		send(recipient, name, data, false, CHANNEL_DEFAULT);
+	}
+
+	void send(PeerInfo::Id recipient, const ss_ &name, const ss_ &data,
+			Channel channel)
+	{
+		log_d(MODULE, "network::send(): channel %i", (int)channel);
+		send(recipient, name, data, false, channel);
+	}
+
+	bool send_droppable(PeerInfo::Id recipient, const ss_ &name,
+			const ss_ &data)
+	{
+		log_d(MODULE, "network::send_droppable()");
+		return send(recipient, name, data, true, CHANNEL_DEFAULT);
+	}
+
+	void send_unreliable(PeerInfo::Id recipient, const ss_ &name,
+			uint32_t key, const ss_ &data)
+	{
+		log_d(MODULE, "network::send_unreliable()");
+		sp_<Peer> peer = find_peer(recipient);
+		if(!peer){
+			log_w(MODULE, "network::send_unreliable(): Peer %zu doesn't exist",
+					recipient);
+			return;
+		}
+		sp_<interface::UDPSocket> socket;
+		{
+			interface::MutexScope ms(m_peers_mutex);
+			socket = m_udp_socket;
+		}
+		interface::MutexScope ms(peer->mutex);
+		if(peer->disconnected)
+			return;
+		datagram::Update update;
+		update.sequence = peer->next_unreliable_sequence++;
+		update.key = key;
+		update.name = name;
+		update.data = data;
+		if(socket && !peer->udp_address.empty()){
+			ss_ d;
+			datagram::write_header(datagram::UPDATE, peer->udp_token, d);
+			datagram::write_update(update, d);
+			if(d.size() <= datagram::MAX_SIZE){
+				bool ok = socket->send_to(d.c_str(), d.size(),
+						peer->udp_address);
+				{
+					interface::MutexScope ms2(m_stats_mutex);
+					m_stats.num_datagrams_sent++;
+				}
+				if(ok){
+					// Recorded the same as if it had been sent over TCP
+					if(m_recorder){
+						m_recorder->packet(session_recording::OUTGOING,
+								peer->id, "core:unreliable",
+								d.substr(datagram::HEADER_SIZE));
+					}
+					return;
+				}
+			}
+		}
+		// Wrapped so that the client applies the same filter to it
+		ss_ payload;
+		datagram::write_update(update, payload);
+		{
+			interface::MutexScope ms2(m_stats_mutex);
+			m_stats.num_unreliable_over_tcp++;
+		}
+		send_u(*peer, "core:unreliable", payload, true, CHANNEL_REALTIME);
+	}
+
+	void send_unreliable_reliably(PeerInfo::Id recipient, const ss_ &name,
+			uint32_t key, const ss_ &data, Channel channel)
+	{
+		log_d(MODULE, "network::send_unreliable_reliably()");
+		sp_<Peer> peer = find_peer(recipient);
+		if(!peer){
+			log_w(MODULE, "network::send_unreliable_reliably(): Peer %zu "
+					"doesn't exist", recipient);
+			return;
+		}
+		interface::MutexScope ms(peer->mutex);
+		if(peer->disconnected)
+			return;
+		// Sequenced with the unreliable updates so that it doesn't override
+		// a newer one that arrives first
+		datagram::Update update;
+		update.sequence = peer->next_unreliable_sequence++;
+		update.key = key;
+		update.name = name;
+		update.data = data;
+		ss_ payload;
+		datagram::write_update(update, payload);
+		send_u(*peer, "core:unreliable", payload, false, channel);
+	}
+
+	size_t get_unsent_bytes(PeerInfo::Id recipient)
+	{
+		sp_<Peer> peer = find_peer(recipient);
+		if(!peer)
+			return 0;
+		interface::MutexScope ms(peer->mutex);
+		return peer->get_unsent_bytes();
+	}
+
+	sv_<PeerStats> get_peer_stats()
+	{
+		sv_<PeerStats> result;
+		for(const sp_<Peer> &peer : get_peers()){
+			interface::MutexScope ms(peer->mutex);
+			PeerStats stats;
+			stats.id = peer->id;
+			stats.output_queue_bytes = peer->get_unsent_bytes();
+			for(size_t channel = 0; channel < NUM_CHANNELS; channel++){
+				stats.channel_queue_bytes.push_back(
+						peer->output_stream.get_queued_output_bytes(channel));
+			}
+			stats.max_output_queue_bytes = peer->max_output_queue_bytes;
+			stats.num_dropped_packets = peer->num_dropped_packets;
+			result.push_back(stats);
+		}
+		return result;
+	}
+
+	NetworkStats get_stats()
+	{
+		interface::PollerStats ps = get_poller_stats();
+		interface::CompressionStats compression = get_compression_stats();
+		size_t num_peers = 0;
+		size_t num_udp_peers = 0;
+		for(const sp_<Peer> &peer : get_peers()){
+			interface::MutexScope ms(peer->mutex);
+			num_peers++;
+			if(!peer->udp_address.empty())
+				num_udp_peers++;
+		}
+		interface::MutexScope ms(m_stats_mutex);
+		NetworkStats stats = m_stats;
+		stats.num_peers = num_peers;
+		stats.num_udp_peers = num_udp_peers;
+		stats.num_io_threads = m_io_threads.size();
+		stats.num_timeouts = ps.num_timeouts;
+		stats.num_ready_sockets = ps.num_ready;
+		stats.compression = compression;
+		return stats;
 	}
 
 	sv_<PeerInfo::Id> list_peers()
 	{
+		interface::MutexScope ms(m_peers_mutex);
 		sv_<PeerInfo::Id> result;
-		for(auto &pair : m_peers){
-			Peer &peer = pair.second;
-			result.push_back(peer.id);
-		}
+		for(auto &pair : m_peers)
+			result.push_back(pair.first);
 		return result;
 	}
 
@@ -325,28 +1391,29 @@ struct Module: public interface::Module, public network::Interface
 
 void NetworkThread::run(interface::Thread *thread)
 {
-	interface::SelectHandler handler;
+	// Sockets are added to and removed from the poller by Module as they come
+	// and go; the poller itself is thread-safe
+	interface::Poller *poller = m_io_thread->poller.get();
+	// Packets of a wakeup are emitted together
+	sv_<Event> events;
 
 	while(!thread->stop_requested()){
-		sv_<int> sockets;
-		// We can avoid implementing our own mutex locking in Module by using
-		// interface::Server::access_module() instead of directly accessing it.
-		network::access(m_module->m_server, [&](network::Interface *inetwork){
-			sockets = m_module->get_sockets();
-		});
-
-		sv_<int> active_sockets;
-		bool ok = handler.check(500000, sockets, active_sockets);
+		sv_<int> readable_sockets;
+		sv_<int> writable_sockets;
+		int64_t wait_us = m_module->get_flush_wait_us(*m_io_thread, 500000);
+		bool ok = poller->wait(wait_us, readable_sockets, writable_sockets);
 		(void)ok; // Unused
 
-		if(active_sockets.empty())
+		m_module->handle_due_flushes(*m_io_thread);
+
+		if(readable_sockets.empty() && writable_sockets.empty())
 			continue;
+		int64_t wakeup_us = interface::os::monotonic_us();
 
-		network::access(m_module->m_server, [&](network::Interface *inetwork){
-			for(int fd: active_sockets){
-				m_module->handle_active_socket(fd);
-			}
-		});
+		// Module's lock is not taken; everything touched here has its own
+		m_module->handle_active_sockets(*m_io_thread, readable_sockets,
+				writable_sockets, wakeup_us, events);
+		m_module->m_server->emit_events(events);
 	}
 }
 
@@ -355,6 +1422,44 @@ void NetworkThread::on_crash(interface::Thread *thread)
 	m_module->m_server->shutdown(1, "NetworkThread crashed");
 }
 
+void ReplayThread::run(interface::Thread *thread)
+{
+	// Records due at the same time are emitted together
+	sv_<Event> events;
+
+	while(!thread->stop_requested()){
+		int64_t wait_us = m_replayer->update(
+		[&](const session_recording::Record &record){
+			m_module->replay_record(record, m_peers, events);
+		});
+		m_module->m_server->emit_events(events);
+		if(wait_us == -1)
+			break;
+		// Woken up at least this often to notice a stop request
+		if(wait_us > 0)
+			usleep(std::min(wait_us, (int64_t)100000));
+	}
+	if(thread->stop_requested())
+		return;
+
+	// Clients still connected at the end of the recording leave
+	for(auto &pair : m_peers)
+		m_module->disconnect(*pair.second.peer, &events);
+	m_peers.clear();
+	m_module->m_server->emit_events(events);
+
+	session_recording::ReplayStats stats = m_replayer->get_stats();
+	log_i(MODULE, "Replay ended: %zu records, %zu packets of %zu bytes; "
+			"at most %ims behind the recording", stats.num_records,
+			stats.num_packets, stats.num_bytes,
+			(int)(stats.max_behind_us / 1000));
+}
+
+void ReplayThread::on_crash(interface::Thread *thread)
+{
+	m_module->m_server->shutdown(1, "ReplayThread crashed");
+}
+
 extern "C" {
 	BUILDAT_EXPORT void* createModule_network(interface::Server *server){
 		return (void*)(new Module(server));
@@ -51,13 +51,36 @@ static ss_ buf_to_string(const magic::VectorBuffer &buf)
 	return ss_((const char*)&buf.GetBuffer().Front(), buf.GetBuffer().Size());
 }
 
+// The last latest data update sent of a node or component
+struct LatestData
+{
+	ss_ name;
+	uint id = 0;
+	uint node_id = 0; // Of the component, or the node itself
+	ss_ data;
+	bool changed = false; // Sent during the current sync
+};
+
 struct PeerState
 {
 	PeerId peer_id = 0;
 	main_context::SceneReference scene_ref = nullptr;
 	magic::SceneReplicationState scene_state;
+	// Nodes whose creation (or the creation of a component of theirs) may
+	// still be queued for the peer; their latest data is sent after it on
+	// the same channel instead of possibly overtaking it over UDP
+	set_<uint> unflushed_nodes;
+	// Latest data sent unreliably; once it stops changing, the last update
+	// is sent once reliably so that losing it doesn't leave the peer with a
+	// stale value. Keyed by latest_data_key().
+	sm_<uint64_t, LatestData> unsettled_latest;
 };
 
+static uint64_t latest_data_key(bool is_component, uint id)
+{
+	return (uint64_t)is_component<<32 | id;
+}
+
 struct Module: public interface::Module, public replicate::Interface
 {
 	interface::Server *m_server;
@@ -109,7 +132,7 @@ struct Module: public interface::Module, public replicate::Interface
 		m_server->sub_event(this, Event::t("core:continue"));
 		m_server->sub_event(this, Event::t("network:client_connected"));
 		m_server->sub_event(this, Event::t("network:client_disconnected"));
-		m_server->sub_event(this, Event::t("core:tick"));
+		m_server->sub_event(this, Event::t("core:replication_tick"));
 	}
 
 	void event(const Event::Type &type, const Event::Private *p)
@@ -121,7 +144,7 @@ struct Module: public interface::Module, public replicate::Interface
 				network::NewClient)
 		EVENT_TYPEN("network:client_disconnected", on_client_disconnected,
 				network::OldClient)
-		EVENT_TYPEN("core:tick", on_tick, interface::TickEvent)
+		EVENT_TYPEN("core:replication_tick", on_tick, interface::TickEvent)
 	}
 
 	void on_start()
@@ -208,6 +231,13 @@ struct Module: public interface::Module, public replicate::Interface
 				//       marked-for-update lists
 				scene->PrepareNetworkUpdate();
 
+				if(!ps.unflushed_nodes.empty()){
+					network::access(m_server, [&](network::Interface *inetwork){
+						if(inetwork->get_unsent_bytes(ps.peer_id) == 0)
+							ps.unflushed_nodes.clear();
+					});
+				}
+
 				magic::HashSet<uint> nodes_to_process;
 				uint scene_id = scene->GetID();
 				nodes_to_process.Insert(scene_id);
@@ -222,10 +252,53 @@ struct Module: public interface::Module, public replicate::Interface
 					sync_node(ps.peer_id, node_id, nodes_to_process, scene,
 							ps.scene_state);
 				}
+
+				settle_latest_data(ps);
 			}
 		});
 	}
 
+	// Sends reliably the latest data that didn't change during this sync
+	void settle_latest_data(PeerState &ps)
+	{
+		if(ps.unsettled_latest.empty())
+			return;
+		network::access(m_server, [&](network::Interface *inetwork){
+			for(auto it = ps.unsettled_latest.begin();
+					it != ps.unsettled_latest.end();){
+				LatestData &latest = it->second;
+				if(latest.changed){
+					latest.changed = false;
+					++it;
+					continue;
+				}
+				inetwork->send_unreliable_reliably(ps.peer_id, latest.name,
+						latest.id, latest.data, network::CHANNEL_REALTIME);
+				it = ps.unsettled_latest.erase(it);
+			}
+		});
+	}
+
+	void forget_latest_data(PeerId peer, bool is_component, uint id)
+	{
+		auto it = m_peers.find(peer);
+		if(it == m_peers.end())
+			return;
+		PeerState &ps = it->second;
+		ps.unsettled_latest.erase(latest_data_key(is_component, id));
+		if(is_component)
+			return;
+		// Components of the node
+		for(auto latest_it = ps.unsettled_latest.begin();
+				latest_it != ps.unsettled_latest.end();){
+			if(latest_it->second.node_id == id)
+				latest_it = ps.unsettled_latest.erase(latest_it);
+			else
+				++latest_it;
+		}
+		ps.unflushed_nodes.erase(id);
+	}
+
 	void sync_node(PeerId peer,
 			uint node_id, magic::HashSet<uint> &nodes_to_process,
 			magic::Scene *scene, magic::SceneReplicationState &scene_state)
@@ -253,6 +326,7 @@ struct Module: public interface::Module, public replicate::Interface
 				magic::VectorBuffer buf;
 				buf.WriteNetID(node_id);
 				send_to_peer(peer, "replicate:remove_node", buf);
+				forget_latest_data(peer, false, node_id);
 			} else {
 				sync_existing_node(peer, n, node_state, nodes_to_process,
 						scene, scene_state);
@@ -310,6 +384,7 @@ struct Module: public interface::Module, public replicate::Interface
 		}
 
 		send_to_peer(peer, "replicate:create_node", buf);
+		m_peers[peer].unflushed_nodes.insert(node->GetID());
 
 		node_state.markedDirty_ = false;
 		scene_state.dirtyNodes_.Erase(node->GetID());
@@ -353,7 +428,8 @@ struct Module: public interface::Module, public replicate::Interface
 				buf.WriteNetID(node->GetID());
 				node->WriteLatestDataUpdate(buf);
 
-				send_to_peer(peer, "replicate:latest_node_data", buf);
+				send_latest_to_peer(peer, "replicate:latest_node_data",
+						false, node->GetID(), node->GetID(), buf);
 			}
 
 			// ?
@@ -400,6 +476,7 @@ struct Module: public interface::Module, public replicate::Interface
 				magic::VectorBuffer buf;
 				buf.WriteNetID(component_id);
 				send_to_peer(peer, "replicate:remove_component", buf);
+				forget_latest_data(peer, true, component_id);
 				component_states.Erase(current_it);
 				continue;
 			}
@@ -429,7 +506,9 @@ struct Module: public interface::Module, public replicate::Interface
 					buf.WriteNetID(component->GetID());
 					component->WriteLatestDataUpdate(buf);
 
-					send_to_peer(peer, "replicate:latest_component_data", buf);
+					send_latest_to_peer(peer,
+							"replicate:latest_component_data", true,
+							component->GetID(), node->GetID(), buf);
 				}
 
 				// ?
@@ -472,6 +551,7 @@ struct Module: public interface::Module, public replicate::Interface
 				component->WriteInitialDeltaUpdate(buf);
 
 				send_to_peer(peer, "replicate:create_component", buf);
+				m_peers[peer].unflushed_nodes.insert(node->GetID());
 			}
 		}
 
@@ -488,6 +568,35 @@ struct Module: public interface::Module, public replicate::Interface
 		});
 	}
 
+	// Latest data (eg. positions) is superseded by the next update of the
+	// same node or component, so it is fine to lose some of it; the last one
+	// is sent again reliably by settle_latest_data()
+	void send_latest_to_peer(PeerId peer, const ss_ &name, bool is_component,
+			uint id, uint node_id, const magic::VectorBuffer &buf)
+	{
+		log_d(MODULE, "%s: Update size: %zu", cs(name), buf.GetBuffer().Size());
+		ss_ data = buf_to_string(buf);
+		PeerState &ps = m_peers[peer];
+		if(ps.unflushed_nodes.count(node_id)){
+			network::access(m_server, [&](network::Interface *inetwork){
+				inetwork->send_unreliable_reliably(peer, name, id, data,
+						network::CHANNEL_DEFAULT);
+			});
+			ps.unsettled_latest.erase(latest_data_key(is_component, id));
+			return;
+		}
+		network::access(m_server, [&](network::Interface *inetwork){
+			inetwork->send_unreliable(peer, name, id, data);
+		});
+		LatestData &latest =
+				ps.unsettled_latest[latest_data_key(is_component, id)];
+		latest.name = name;
+		latest.id = id;
+		latest.node_id = node_id;
+		latest.data = data;
+		latest.changed = true;
+	}
+
 	/*void send_to_all(const ss_ &name, const magic::VectorBuffer &buf)
 	{
 		log_i(MODULE, "%s: Update size: %zu, data=%s",
@@ -9,8 +9,6 @@ local dump = buildat.dump
 local M = {}
 log:info("voxelworld loading")
 
-local UPDATE_TIME_FRACTION = 0.10
-
 --local LOD_DISTANCE = 140
 --local LOD_DISTANCE = 100
 local LOD_DISTANCE = 80
@@ -35,8 +33,6 @@ local camera_dir = magic.Vector3(0, 0, 0)
 local camera_last_p = camera_p
 local camera_last_dir = camera_dir
 
-local end_of_update_processing_us = 0
-
 local voxel_reg = buildat.createVoxelRegistry()
 local atlas_reg = buildat.createAtlasRegistry()
 
@@ -289,11 +285,11 @@ function sub_events()
 			end
 		end
 
-		-- Node updates: Handle one or a few per frame
+		-- Node updates: Handle one or a few per frame, in the time given by
+		-- the frame's main thread work budget
 		local current_us = buildat.get_time_us()
-		-- Spend time doing this proportionate to the rest of the update cycle
-		local last_outer_frame_us = (current_us - end_of_update_processing_us)
-		local max_handling_time_us = last_outer_frame_us * UPDATE_TIME_FRACTION
+		local max_handling_time_us =
+				buildat.begin_work_slice("voxelworld:node_updates")
 		local stop_at_us = current_us + max_handling_time_us
 
 		node_update_queue:set_p(camera_p)
@@ -333,7 +329,7 @@ function sub_events()
 				break
 			end
 		end
-		end_of_update_processing_us = buildat.get_time_us()
+		buildat.end_work_slice("voxelworld:node_updates")
 
 		if camera_node then
 			camera_last_dir = camera_dir
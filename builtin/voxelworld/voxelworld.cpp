@@ -17,6 +17,8 @@
 #include "interface/polyvox_cereal.h"
 #include "interface/polyvox_std.h"
 #include "interface/os.h"
+#include "interface/thread_pool.h"
+#include "interface/frame_scheduler.h"
 #include <PolyVoxCore/RawVolume.h>
 #include <cereal/archives/portable_binary.hpp>
 #include <cereal/types/string.hpp>
@@ -318,18 +320,23 @@ struct CInstance: public voxelworld::Instance
 
 			Context *context = imc->get_context();
 
-			// Update node collision boxes
-			if(!m_nodes_needing_physics_update.empty()){
-				log_v(MODULE, "Updating physics of %zu nodes",
-						m_nodes_needing_physics_update.size());
-			}
-			for(QueuedNodePhysicsUpdate &update: m_nodes_needing_physics_update){
-				uint node_id = update.node_id;
+			// Update node collision boxes in the time given for it; what is
+			// left is continued on the next tick
+			if(m_nodes_needing_physics_update.empty())
+				return;
+			log_v(MODULE, "Updating physics of %zu nodes",
+					m_nodes_needing_physics_update.size());
+			auto *scheduler = imc->get_frame_scheduler();
+			interface::frame_scheduler::SliceScope slice(scheduler,
+					scheduler->register_consumer("voxelworld:physics_update"));
+			do {
+				uint node_id = m_nodes_needing_physics_update.back().node_id;
+				m_nodes_needing_physics_update.pop_back();
 				Node *n = scene->GetNode(node_id);
 				if(!n){
 					log_w(MODULE, "on_tick(): Node physics update: "
 							"Node %i not found", node_id);
-					return;
+					continue;
 				}
 				// Get volume
 				const Variant &var = n->GetVar(StringHash("buildat_voxel_data"));
@@ -340,8 +347,7 @@ struct CInstance: public voxelworld::Instance
 				// Update collision shape
 				interface::mesh::set_voxel_physics_boxes(n, context, *volume,
 						m_voxel_reg.get());
-			}
-			m_nodes_needing_physics_update.clear();
+			} while(!m_nodes_needing_physics_update.empty() && slice.has_time());
 		});
 
 		// Unload stuff if needed
@@ -872,34 +878,42 @@ struct CInstance: public voxelworld::Instance
 			m_sections_with_loaded_buffers.insert(it, section);
 	}
 
-	// Commit and unload chunk buffer
-	void commit_chunk_buffer(Section *section, size_t chunk_i)
+	// Checks whether the chunk buffer needs committing and runs the in-thread
+	// commit hooks on it; the volume can be serialized after this
+	bool prepare_chunk_buffer_commit(Section *section, size_t chunk_i)
 	{
 		ChunkBuffer &chunk_buffer = section->chunk_buffers[chunk_i];
 		if(!chunk_buffer.dirty){
 			// No changes
-			return;
+			return false;
 		}
 
 		pv::Vector3DInt32 chunk_p = section->get_chunk_p(chunk_i);
 		uint node_id = section->node_ids->getVoxelAt(chunk_p);
 
-		log_d(MODULE, "Committing chunk " PV3I_FORMAT " (node %i)",
-				PV3I_PARAMS(chunk_p), node_id);
-
 		if(node_id == 0){
-			log_w(MODULE, "commit_chunk_buffer() chunk_i=%zu: "
+			log_w(MODULE, "prepare_chunk_buffer_commit() chunk_i=%zu: "
 					"No node found for chunk " PV3I_FORMAT
 					" in section " PV3I_FORMAT,
 					chunk_i, PV3I_PARAMS(chunk_p),
 					PV3I_PARAMS(section->section_p));
-			return;
+			return false;
 		}
 
 		run_commit_hooks_in_thread(chunk_p, *chunk_buffer.volume);
+		return true;
+	}
 
-		ss_ new_data = interface::serialize_volume_compressed(
-				*chunk_buffer.volume);
+	// Commit and unload chunk buffer prepared by prepare_chunk_buffer_commit()
+	void commit_chunk_buffer(Section *section, size_t chunk_i,
+			const ss_ &new_data)
+	{
+		ChunkBuffer &chunk_buffer = section->chunk_buffers[chunk_i];
+		pv::Vector3DInt32 chunk_p = section->get_chunk_p(chunk_i);
+		uint node_id = section->node_ids->getVoxelAt(chunk_p);
+
+		log_d(MODULE, "Committing chunk " PV3I_FORMAT " (node %i)",
+				PV3I_PARAMS(chunk_p), node_id);
 
 		main_context::access(m_server, [&](main_context::Interface *imc){
 			Scene *scene = imc->check_scene(m_scene_ref);
@@ -973,11 +987,35 @@ struct CInstance: public voxelworld::Instance
 		log_d(MODULE, "Committing %zu dirty buffers in %zu sections",
 				m_total_buffers_dirty,
 				m_sections_with_loaded_buffers.size());
+		struct PreparedCommit {
+			Section *section;
+			size_t chunk_i;
+			ss_ data;
+		};
+		sv_<PreparedCommit> prepared;
 		for(Section *section : m_sections_with_loaded_buffers){
 			for(size_t i = 0; i < section->chunk_buffers.size(); i++){
-				commit_chunk_buffer(section, i);
+				if(prepare_chunk_buffer_commit(section, i))
+					prepared.push_back(PreparedCommit{section, i, ""});
 			}
 		}
+		// Compressing the volumes is the slow part and independent of
+		// everything else, so it is done in parallel. The pool is only
+		// locked while adding the jobs so that others can use it meanwhile.
+		up_<interface::thread_pool::TaskGroup> group;
+		m_server->access_thread_pool([&](
+				interface::thread_pool::ThreadPool *pool){
+			group.reset(pool->create_group());
+			for(PreparedCommit &c : prepared){
+				group->add([&c](){
+					c.data = interface::serialize_volume_compressed(
+							*c.section->chunk_buffers[c.chunk_i].volume);
+				});
+			}
+		});
+		group->wait();
+		for(PreparedCommit &c : prepared)
+			commit_chunk_buffer(c.section, c.chunk_i, c.data);
 	}
 
 	VoxelInstance get_voxel(const pv::Vector3DInt32 &p, bool disable_warnings)
@@ -90,9 +90,10 @@ struct CInstance: public worldgen::Instance
 
 	// Interface for GenerateThread
 
-	// NOTE: on_tick() cannot be used here, because as this takes much longer
-	//       than a tick, the ticks accumulate and result in nothing getting
-	//       queued but instead sectors get queued in the event queue.
+	// NOTE: This is not done in on_tick(), because as this takes much longer
+	//       than a tick, handling of generation requests and other events
+	//       would be delayed until the section is done. (Ticks themselves
+	//       would coalesce instead of accumulating in the event queue.)
 	void generate_next_section()
 	{
 		try {
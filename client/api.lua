@@ -6,10 +6,14 @@ local log = buildat.Logger("__client/api")
 buildat.connect_server    = __buildat_connect_server
 buildat.extension_path    = __buildat_extension_path
 buildat.get_time_us       = __buildat_get_time_us
+buildat.begin_work_slice  = __buildat_begin_work_slice
+buildat.end_work_slice    = __buildat_end_work_slice
 buildat.SpatialUpdateQueue = __buildat_SpatialUpdateQueue
 
 buildat.safe.disconnect    = __buildat_disconnect
 buildat.safe.get_time_us   = __buildat_get_time_us
+buildat.safe.begin_work_slice = __buildat_begin_work_slice
+buildat.safe.end_work_slice   = __buildat_end_work_slice
 buildat.safe.profiler_block_begin = __buildat_profiler_block_begin
 buildat.safe.profiler_block_end   = __buildat_profiler_block_end
 buildat.safe.VoxelName            = __buildat_VoxelName
@@ -0,0 +1,146 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+// Packet storm benchmark: Emits received-packet events into subscriber
+// queues like the server does, with the payloads allocated by new and by
+// interface::event_pool, and reports the time and heap allocations per
+// packet.
+#include "core/types.h"
+#include "network/api.h"
+#include "interface/event.h"
+#include "interface/event_pool.h"
+#include "interface/os.h"
+#include <c55/getopt.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <new>
+
+// Every heap allocation of the program is counted
+static std::atomic<size_t> g_num_heap_allocs(0);
+
+void* operator new(size_t size)
+{
+	g_num_heap_allocs++;
+	void *p = malloc(size);
+	if(!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t size) noexcept
+{
+	free(p);
+}
+
+struct StormOptions
+{
+	size_t num_packets = 2000000;
+	size_t num_subscribers = 4;
+	size_t data_size = 8;
+	// Queued events are handled (dropped) when a queue gets this long
+	size_t queue_length = 256;
+};
+
+// make: (sender, name, data) -> payload
+static void run_storm(const char *label, const StormOptions &o,
+		std::function<sp_<const interface::Event::Private>(
+				size_t sender, const sp_<const ss_> &name,
+				const sp_<const ss_> &data)> make)
+{
+	using interface::Event;
+	Event::Type type = Event::t("network:packet_received/bench:storm");
+	sp_<const ss_> name = std::make_shared<ss_>("bench:storm");
+	sv_<std::deque<Event>> queues(o.num_subscribers);
+
+	size_t allocs0 = g_num_heap_allocs;
+	int64_t t0 = interface::os::monotonic_us();
+	for(size_t i = 0; i < o.num_packets; i++){
+		sp_<const ss_> data = std::make_shared<ss_>(o.data_size, 'x');
+		Event event(type, make(i % 100, name, data));
+		for(std::deque<Event> &queue : queues)
+			queue.push_back(Event(event.type, event.p));
+		if(queues[0].size() >= o.queue_length){
+			for(std::deque<Event> &queue : queues)
+				queue.clear();
+		}
+	}
+	int64_t t1 = interface::os::monotonic_us();
+	size_t allocs = g_num_heap_allocs - allocs0;
+	// The data itself is allocated for each packet either way
+	printf("%s: %.1f ns and %.2f heap allocations per packet (of which 1 "
+			"is the data)\n", label, (t1 - t0) * 1000.0 / o.num_packets,
+			(double)allocs / o.num_packets);
+}
+
+int main(int argc, char *argv[])
+{
+	StormOptions o;
+
+	const char opts[100] = "hn:s:d:q:";
+	const char usagefmt[1000] =
+			"Usage: %s [OPTION]...\n"
+			"  -h                   Show this help\n"
+			"  -n [integer]         Number of packets (default 2000000)\n"
+			"  -s [integer]         Number of subscribers (default 4)\n"
+			"  -d [integer]         Packet data size (default 8)\n"
+			"  -q [integer]         Queue length at which events are handled\n"
+			"                       (default 256)\n"
+			;
+
+	int c;
+	while((c = c55_getopt(argc, argv, opts)) != -1)
+	{
+		switch(c)
+		{
+		case 'h':
+			printf(usagefmt, argv[0]);
+			return 1;
+		case 'n':
+			o.num_packets = atoi(c55_optarg);
+			break;
+		case 's':
+			o.num_subscribers = atoi(c55_optarg);
+			break;
+		case 'd':
+			o.data_size = atoi(c55_optarg);
+			break;
+		case 'q':
+			o.queue_length = atoi(c55_optarg);
+			break;
+		default:
+			fprintf(stderr, "ERROR: Invalid command-line argument\n");
+			fprintf(stderr, usagefmt, argv[0]);
+			return 1;
+		}
+	}
+	if(o.num_packets == 0 || o.num_subscribers == 0 || o.queue_length == 0){
+		fprintf(stderr, "ERROR: -n, -s and -q have to be positive\n");
+		return 1;
+	}
+
+	run_storm("new", o, [](size_t sender, const sp_<const ss_> &name,
+			const sp_<const ss_> &data){
+		return sp_<const interface::Event::Private>(
+				new network::Packet(sender, name, data));
+	});
+	run_storm("event_pool", o, [](size_t sender, const sp_<const ss_> &name,
+			const sp_<const ss_> &data){
+		return sp_<const interface::Event::Private>(
+				interface::event_pool::make<network::Packet>(
+				sender, name, data));
+	});
+
+	interface::event_pool::PoolStats stats = interface::event_pool::get_stats();
+	printf("event_pool: %zu allocations, %zu reused (%.2f%%), %zu unpooled, "
+			"%zu blocks free\n", stats.num_allocs, stats.num_reused,
+			stats.num_allocs ? 100.0 * stats.num_reused / stats.num_allocs : 0.0,
+			stats.num_unpooled, stats.num_free_blocks);
+	return 0;
+}
+// vim: set noet ts=4 sw=4:
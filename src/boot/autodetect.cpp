@@ -323,12 +323,13 @@ static bool detect_client_urho3d_paths(core::Config &config)
 
 // Public interface
 
-bool check_server_paths(const core::Config &config, bool log_issues)
+bool check_server_paths(const core::Config &config, bool log_issues,
+		bool need_compiler)
 {
 	bool ok = true;
 	if(!check_paths(config, server_paths, log_issues))
 		ok = false;
-	if(!check_paths(config, compiler_bin_paths, log_issues))
+	if(need_compiler && !check_paths(config, compiler_bin_paths, log_issues))
 		ok = false;
 	if(!check_paths(config, server_urho3d_paths, log_issues))
 		ok = false;
@@ -345,13 +346,13 @@ bool check_client_paths(const core::Config &config, bool log_issues)
 	return ok;
 }
 
-bool detect_server_paths(core::Config &config)
+bool detect_server_paths(core::Config &config, bool need_compiler)
 {
 	bool ok = true;
 
 	if(!detect_buildat_server_paths(config))
 		ok = false;
-	if(!detect_compiler_bin_paths(config))
+	if(need_compiler && !detect_compiler_bin_paths(config))
 		ok = false;
 	if(!detect_server_urho3d_paths(config))
 		ok = false;
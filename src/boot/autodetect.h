@@ -8,12 +8,16 @@ namespace boot
 {
 	namespace autodetect
 	{
+		// need_compiler = false skips the compiler, which a server with every
+		// module linked in doesn't use.
 		// Return value: true if paths seem alright
-		bool check_server_paths(const core::Config &config, bool log_issues);
+		bool check_server_paths(const core::Config &config, bool log_issues,
+				bool need_compiler = true);
 		bool check_client_paths(const core::Config &config, bool log_issues);
 
 		// Return value: true if succesful, false if failed
-		bool detect_server_paths(core::Config &config);
+		bool detect_server_paths(core::Config &config,
+				bool need_compiler = true);
 		bool detect_client_paths(core::Config &config);
 	}
 }
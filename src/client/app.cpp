@@ -10,6 +10,8 @@
 #include "interface/fs.h"
 #include "interface/voxel.h"
 #include "interface/thread_pool.h"
+#include "interface/frame_scheduler.h"
+#include "interface/packet_stream.h"
 #include <c55/getopt.h>
 #include <c55/os.h>
 #include <Application.h>
@@ -104,6 +106,9 @@ struct CApp: public App, public magic::Application
 	magic::SharedPtr<magic::Node> m_camera_node;
 
 	sp_<interface::thread_pool::ThreadPool> m_thread_pool;
+	up_<interface::frame_scheduler::Scheduler> m_frame_scheduler;
+	interface::frame_scheduler::ConsumerId m_thread_pool_post_consumer;
+	int64_t m_last_stats_print_us = 0;
 
 	CApp(magic::Context *context, const Options &options):
 		magic::Application(context),
@@ -111,13 +116,18 @@ struct CApp: public App, public magic::Application
 		L(nullptr),
 		m_options(options),
 		m_last_update_us(get_timeofday_us()),
-		m_thread_pool(interface::thread_pool::createThreadPool())
+		m_thread_pool(interface::thread_pool::createThreadPool()),
+		m_frame_scheduler(interface::frame_scheduler::createScheduler(
+				g_client_config.get<int64_t>("main_thread_budget_us")))
 	{
 		log_v(MODULE, "constructor()");
 		log_v(MODULE, "window size: %ix%i",
 				m_options.graphics.window_w, m_options.graphics.window_h);
 
-		m_thread_pool->start(4); // TODO: Configurable
+		m_thread_pool->start(
+				g_client_config.get<int64_t>("thread_pool_size"));
+		m_thread_pool_post_consumer =
+				m_frame_scheduler->register_consumer("ThreadPool::post");
 
 		sv_<ss_> resource_paths = {
 			g_client_config.get<ss_>("cache_path")+"/tmp",
@@ -297,6 +307,11 @@ struct CApp: public App, public magic::Application
 		return m_thread_pool.get();
 	}
 
+	interface::frame_scheduler::Scheduler* get_frame_scheduler()
+	{
+		return m_frame_scheduler.get();
+	}
+
 	lua_State* get_lua()
 	{
 		return L;
@@ -390,6 +405,10 @@ struct CApp: public App, public magic::Application
 		/*magic::AutoProfileBlock profiler_block(
 				GetSubsystem<magic::Profiler>(), "App::on_update");*/
 
+		// This is the first E_UPDATE handler; others (eg. Lua ones) that
+		// take slices of the frame's budget run after this
+		m_frame_scheduler->begin_frame();
+
 		if(g_sigint_received)
 			shutdown();
 		if(m_state)
@@ -398,7 +417,27 @@ struct CApp: public App, public magic::Application
 		{
 			magic::AutoProfileBlock profiler_block(
 					GetSubsystem<magic::Profiler>(), "Buildat|ThreadPool::post");
-			m_thread_pool->run_post();
+			interface::frame_scheduler::SliceScope slice(
+					m_frame_scheduler.get(), m_thread_pool_post_consumer);
+			m_thread_pool->run_post(slice.get_remaining_us());
+		}
+
+		int64_t now_us = get_timeofday_us();
+		if(now_us - m_last_stats_print_us >= 10000000){
+			m_last_stats_print_us = now_us;
+			interface::thread_pool::ThreadPoolStats stats =
+					m_thread_pool->get_stats();
+			log_d(MODULE, "Thread pool: %zu added, %zu finished, %zu skipped, "
+					"%zu superseded", stats.num_added, stats.num_finished,
+					stats.num_skipped, stats.num_superseded);
+			log_d(MODULE, "Frame scheduler: %s", cs(
+					interface::frame_scheduler::format_stats(
+					m_frame_scheduler->get_stats())));
+			if(m_state){
+				log_d(MODULE, "Network: %s", cs(
+						interface::format_compression_stats(
+						m_state->get_compression_stats())));
+			}
 		}
 
 #ifdef DEBUG_CORE_TIMING
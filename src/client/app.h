@@ -18,6 +18,9 @@ namespace interface {
 	namespace thread_pool {
 		struct ThreadPool;
 	}
+	namespace frame_scheduler {
+		struct Scheduler;
+	}
 }
 extern "C" {
 	struct lua_State;
@@ -71,6 +74,7 @@ namespace app
 				const ss_ &file_hash, const ss_ &cached_path) = 0;
 		virtual Urho3D::Scene* get_scene() = 0;
 		virtual interface::thread_pool::ThreadPool* get_thread_pool() = 0;
+		virtual interface::frame_scheduler::Scheduler* get_frame_scheduler() = 0;
 		virtual lua_State* get_lua() = 0;
 	};
 
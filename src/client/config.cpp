@@ -19,6 +19,29 @@ Config::Config()
 	set_default("server_address", "");
 	set_default("boot_to_menu", false);
 	set_default("menu_extension_name", "__menu");
+
+	// 0 = one worker thread per CPU
+	set_default("thread_pool_size", 0);
+	// Time per frame given to background work in the main thread, such as
+	// applying results of thread pool tasks and voxel node updates
+	set_default("main_thread_budget_us", 5000);
+
+	// Compression of packets sent to the server; see the server's
+	// network_compression settings
+	set_default("compression", true);
+	set_default("compression_min_bytes", 256);
+	set_default("compression_level", 1);
+	set_default("compression_streaming", false);
+	// Accept the server's offer of a UDP channel for transient updates
+	set_default("udp", true);
+
+	// Every packet to and from the server is recorded into this file if set.
+	// The file is started over when the client is rebooted.
+	set_default("record_path", "");
+	// A recording made by a client is replayed instead of connecting to a
+	// server if set; see the server's network_replay_speed
+	set_default("replay_path", "");
+	set_default("replay_speed", 1.0);
 }
 
 bool Config::check_paths()
@@ -41,7 +41,7 @@ int main(int argc, char *argv[])
 
 	client::Config &config = g_client_config;
 
-	const char opts[100] = "hs:P:C:U:l:L:m:";
+	const char opts[100] = "hs:P:C:U:l:L:m:t:R:Y:y:";
 	const char usagefmt[1000] =
 			"Usage: %s [OPTION]...\n"
 			"  -h                   Show this help\n"
@@ -52,6 +52,10 @@ int main(int argc, char *argv[])
 			"  -l [level number]    Set maximum log level (0...5)\n"
 			"  -L [log file path]   Append log to a specified file\n"
 			"  -m [name]            Choose menu extension name\n"
+			"  -t [integer]         Set number of worker threads (0 = auto)\n"
+			"  -R [path]            Record the session into a file\n"
+			"  -Y [path]            Replay a recording instead of connecting\n"
+			"  -y [speed]           Set replay speed (0 = as fast as possible)\n"
 			;
 
 	int c;
@@ -88,6 +92,22 @@ int main(int argc, char *argv[])
 			log_i(MODULE, "config.menu_extension_name: %s", c55_optarg);
 			config.set("menu_extension_name", c55_optarg);
 			break;
+		case 't':
+			log_i(MODULE, "config.thread_pool_size: %s", c55_optarg);
+			config.set("thread_pool_size", atoi(c55_optarg));
+			break;
+		case 'R':
+			log_i(MODULE, "config.record_path: %s", c55_optarg);
+			config.set("record_path", c55_optarg);
+			break;
+		case 'Y':
+			log_i(MODULE, "config.replay_path: %s", c55_optarg);
+			config.set("replay_path", c55_optarg);
+			break;
+		case 'y':
+			log_i(MODULE, "config.replay_speed: %s", c55_optarg);
+			config.set("replay_speed", atof(c55_optarg));
+			break;
 		default:
 			fprintf(stderr, "Invalid command-line argument\n");
 			fprintf(stderr, usagefmt, argv[0]);
@@ -111,7 +131,8 @@ int main(int argc, char *argv[])
 		sp_<client::State> state(client::createState(app0));
 		app0->set_state(state);
 
-		if(config.get<ss_>("server_address") != ""){
+		if(config.get<ss_>("server_address") != "" ||
+				config.get<ss_>("replay_path") != ""){
 			ss_ error;
 			if(!state->connect(config.get<ss_>("server_address"), &error)){
 				log_e(MODULE, "Connect failed: %s", cs(error));
@@ -5,7 +5,11 @@
 #include "client/app.h"
 #include "client/config.h"
 #include "interface/tcpsocket.h"
+#include "interface/udpsocket.h"
 #include "interface/packet_stream.h"
+#include "interface/datagram.h"
+#include "interface/session_recording.h"
+#include "interface/os.h"
 #include "interface/sha1.h"
 #include "interface/fs.h"
 #include "lua_bindings/replicate.h"
@@ -18,7 +22,6 @@
 #include <SmoothedTransform.h>
 #include <cstring>
 #include <fstream>
-#include <deque>
 
 #ifdef _WIN32
 	#ifndef WIN32_LEAN_AND_MEAN
@@ -45,6 +48,8 @@ namespace magic = Urho3D;
 using magic::Node;
 using magic::Component;
 using magic::SmoothedTransform;
+namespace datagram = interface::datagram;
+namespace session_recording = interface::session_recording;
 
 extern client::Config g_client_config;
 
@@ -53,8 +58,20 @@ namespace client {
 struct CState: public State
 {
 	sp_<interface::TCPSocket> m_socket;
-	std::deque<char> m_socket_buffer;
 	interface::PacketStream m_packet_stream;
+	ss_ m_host;
+	// Unreliable side channel, if offered by the server
+	up_<interface::UDPSocket> m_udp_socket;
+	ss_ m_udp_token;
+	bool m_udp_welcomed = false;
+	int64_t m_last_udp_hello_us = 0;
+	// Applied to unreliable updates whether they come over UDP or TCP
+	datagram::LatestFilter m_latest_filter;
+	// Set if packets to and from the server are recorded
+	up_<session_recording::Recorder> m_recorder;
+	// Set if a recording is replayed instead of connecting to a server
+	up_<session_recording::Replayer> m_replayer;
+	up_<session_recording::Encoder> m_replay_encoder;
 	sp_<app::App> m_app;
 	ss_ m_remote_cache_path;
 	ss_ m_tmp_path;
@@ -78,15 +95,96 @@ struct CState: public State
 		interface::fs::create_directories(m_remote_cache_path);
 		interface::fs::create_directories(m_tmp_path);
 
+		interface::CompressionOptions compression;
+		compression.enabled = g_client_config.get<bool>("compression");
+		compression.min_size = g_client_config.get<int64_t>(
+				"compression_min_bytes");
+		compression.level = g_client_config.get<int64_t>("compression_level");
+		compression.streaming = g_client_config.get<bool>(
+				"compression_streaming");
+		m_packet_stream.set_compression(compression);
+
+		const ss_ &record_path = g_client_config.get<ss_>("record_path");
+		if(!record_path.empty()){
+			log_i(MODULE, "client::State: Recording session into %s",
+					cs(record_path));
+			m_recorder.reset(session_recording::createRecorder(record_path));
+		}
+
 		setup_packet_handlers();
 	}
 
 	void update()
 	{
-		if(m_socket->wait_data(0)){
+		if(m_replayer){
+			update_replay();
+			return;
+		}
+		if(m_socket->wait_data(0))
 			read_socket();
-			handle_socket_buffer();
+		if(m_udp_socket)
+			update_udp();
+	}
+
+	void update_udp()
+	{
+		char buf[datagram::MAX_SIZE];
+		for(;;){
+			ssize_t r = m_udp_socket->receive_from(buf, sizeof buf, nullptr);
+			if(r == -1)
+				break;
+			datagram::Kind kind;
+			ss_ token;
+			// Anything else can be from before the server was reloaded
+			if(!datagram::read_header(buf, r, &kind, &token) ||
+					token != m_udp_token)
+				continue;
+			if(kind == datagram::WELCOME){
+				if(!m_udp_welcomed)
+					log_i(MODULE, "client::State: UDP channel established");
+				m_udp_welcomed = true;
+			} else if(kind == datagram::UPDATE){
+				// Recorded the same as if it had come over TCP
+				if(m_recorder){
+					m_recorder->packet(session_recording::INCOMING, 0,
+							"core:unreliable", ss_(buf + datagram::HEADER_SIZE,
+							r - datagram::HEADER_SIZE));
+				}
+				try {
+					handle_unreliable(buf + datagram::HEADER_SIZE,
+							r - datagram::HEADER_SIZE);
+				} catch(std::exception &e){
+					log_w(MODULE, "Exception on handling packet: %s", e.what());
+				}
+			}
 		}
+		// Until welcomed, and then to keep the address valid through NATs
+		int64_t interval_us = m_udp_welcomed ? 10000000 : 1000000;
+		if(interface::os::monotonic_us() - m_last_udp_hello_us >= interval_us)
+			send_udp_hello();
+	}
+
+	void send_udp_hello()
+	{
+		ss_ hello;
+		datagram::write_header(datagram::HELLO, m_udp_token, hello);
+		m_udp_socket->send_to(hello.c_str(), hello.size(), "");
+		m_last_udp_hello_us = interface::os::monotonic_us();
+	}
+
+	void handle_unreliable(const char *data, size_t size)
+	{
+		datagram::Update update;
+		if(!datagram::read_update(data, size, &update)){
+			log_w(MODULE, "Malformed unreliable update");
+			return;
+		}
+		if(!m_latest_filter.accept(update)){
+			log_d(MODULE, "Dropped stale update of %s %u",
+					cs(update.name), update.key);
+			return;
+		}
+		handle_packet(update.name, update.data);
 	}
 
 	bool connect_host_port(const ss_ &address, const ss_ &port, ss_ *error)
@@ -100,9 +198,16 @@ struct CState: public State
 
 		bool ok = m_socket->connect_fd(address, port);
 		if(ok){
+			m_host = address;
 			log_i(MODULE, "client::State: Connect succeeded (%s:%s)",
 					cs(address), cs(port));
 			m_connected = true;
+			if(m_recorder)
+				m_recorder->peer_connected(0);
+			// Let the server start compressing as early as possible
+			ss_ stream_options;
+			m_packet_stream.output_stream_options(stream_options);
+			m_socket->send_fd(stream_options);
 		} else {
 			log_i(MODULE, "client::State: Connect failed (%s:%s)",
 					cs(address), cs(port));
@@ -112,8 +217,64 @@ struct CState: public State
 		return ok;
 	}
 
+	// The server is not contacted; incoming packets of the recording are
+	// handled as they come due in update()
+	bool start_replay(const ss_ &path, ss_ *error)
+	{
+		if(m_connected){
+			if(error)
+				*error = "Cannot re-use state for new connection";
+			return false;
+		}
+		double speed = g_client_config.get<double>("replay_speed");
+		try {
+			m_replayer.reset(session_recording::createReplayer(path, speed));
+		} catch(Exception &e){
+			if(error)
+				*error = e.what();
+			return false;
+		}
+		m_replay_encoder.reset(new session_recording::Encoder(
+				m_packet_stream.m_compression));
+		log_i(MODULE, "client::State: Replaying %s at speed %f",
+				cs(path), speed);
+		m_connected = true;
+		return true;
+	}
+
+	void update_replay()
+	{
+		int64_t wait_us = -1;
+		try {
+			wait_us = m_replayer->update(
+			[&](const session_recording::Record &record){
+				if(record.kind != session_recording::INCOMING)
+					return;
+				ss_ bytes;
+				m_replay_encoder->encode(record.name, record.data, bytes);
+				m_packet_stream.input(bytes.c_str(), bytes.size(),
+				[&](const interface::IncomingPacket &packet){
+					on_incoming_packet(packet);
+				});
+			});
+		} catch(std::exception &e){
+			log_w(MODULE, "client::State: Replay failed: %s", e.what());
+		}
+		if(wait_us != -1)
+			return;
+		session_recording::ReplayStats stats = m_replayer->get_stats();
+		log_i(MODULE, "client::State: Replay ended: %zu records, %zu packets "
+				"of %zu bytes; at most %ims behind the recording",
+				stats.num_records, stats.num_packets, stats.num_bytes,
+				(int)(stats.max_behind_us / 1000));
+		m_replayer.reset();
+	}
+
 	bool connect(const ss_ &address, ss_ *error)
 	{
+		const ss_ &replay_path = g_client_config.get<ss_>("replay_path");
+		if(!replay_path.empty())
+			return start_replay(replay_path, error);
 		if(address.empty()){
 			if(error)
 				*error = "Cannot connect to empty address";
@@ -146,6 +307,8 @@ struct CState: public State
 	void send_packet(const ss_ &name, const ss_ &data)
 	{
 		log_v(MODULE, "send_packet(): name=%s", cs(name));
+		if(m_recorder)
+			m_recorder->packet(session_recording::OUTGOING, 0, name, data);
 		m_packet_stream.output(name, data, [&](const ss_ &packet_data){
 			m_socket->send_fd(packet_data);
 		});
@@ -187,8 +350,10 @@ struct CState: public State
 	void read_socket()
 	{
 		int fd = m_socket->fd();
-		char buf[100000];
-		ssize_t r = recv(fd, buf, 100000, 0);
+		// Receive straight into the packet stream's buffer
+		size_t space_size = 0;
+		char *space = m_packet_stream.get_input_space(&space_size);
+		ssize_t r = recv(fd, space, space_size, 0);
 		if(r == -1)
 			throw Exception(ss_()+"Receive failed: "+strerror(errno));
 		if(r == 0){
@@ -196,19 +361,39 @@ struct CState: public State
 			return;
 		}
 		log_d(MODULE, "Received %zu bytes", r);
-		m_socket_buffer.insert(m_socket_buffer.end(), buf, buf + r);
+		try {
+			m_packet_stream.input_received(r,
+			[&](const interface::IncomingPacket &packet){
+				on_incoming_packet(packet);
+			});
+			// Answer right away if the server started its compression
+			// streams over so that it can compress again
+			ss_ stream_options;
+			m_packet_stream.output_stream_options(stream_options);
+			if(!stream_options.empty())
+				m_socket->send_fd(stream_options);
+		} catch(interface::CorruptPacketReceived &e){
+			log_w(MODULE, "%s; disconnecting", e.what());
+			m_socket->close_fd();
+		}
 	}
 
-	void handle_socket_buffer()
+	void on_incoming_packet(const interface::IncomingPacket &packet)
 	{
-		m_packet_stream.input(m_socket_buffer,
-		[&](const ss_ &name, const ss_ &data){
-			try {
-				handle_packet(name, data);
-			} catch(std::exception &e){
-				log_w(MODULE, "Exception on handling packet: %s", e.what());
-			}
-		});
+		if(m_recorder){
+			m_recorder->packet(session_recording::INCOMING, 0,
+					*packet.info->name, *packet.data);
+		}
+		try {
+			handle_packet(*packet.info->name, *packet.data);
+		} catch(std::exception &e){
+			log_w(MODULE, "Exception on handling packet: %s", e.what());
+		}
+	}
+
+	interface::CompressionStats get_compression_stats()
+	{
+		return m_packet_stream.get_compression_stats();
 	}
 
 	void setup_packet_handlers();
@@ -237,6 +422,47 @@ void CState::setup_packet_handlers()
 			m_app->run_script(data);
 	};
 
+	m_packet_handlers["core:udp_offer"] =
+			[this](const ss_ &packet_name, const ss_ &data)
+	{
+		uint16_t port;
+		ss_ token;
+		std::istringstream is(data, std::ios::binary);
+		{
+			cereal::PortableBinaryInputArchive ar(is);
+			ar(port);
+			ar(token);
+		}
+		if(!g_client_config.get<bool>("udp") || m_replayer){
+			log_v(MODULE, "Ignoring UDP offer");
+			return;
+		}
+		m_udp_token = token;
+		m_udp_welcomed = false;
+		m_udp_socket.reset(interface::createUDPSocket());
+		if(!m_udp_socket->connect_fd(m_host, itos(port))){
+			log_w(MODULE, "client::State: Failed to open UDP to %s:%i",
+					cs(m_host), port);
+			m_udp_socket.reset();
+			return;
+		}
+		send_udp_hello();
+	};
+
+	m_packet_handlers["core:unreliable"] =
+			[this](const ss_ &packet_name, const ss_ &data)
+	{
+		handle_unreliable(data.c_str(), data.size());
+	};
+
+	// Sent when connected and after the server's network module has been
+	// reloaded, whether or not UDP is used
+	m_packet_handlers["core:unreliable_reset"] =
+			[this](const ss_ &packet_name, const ss_ &data)
+	{
+		m_latest_filter.clear();
+	};
+
 	m_packet_handlers["core:announce_file"] =
 			[this](const ss_ &packet_name, const ss_ &data)
 	{
@@ -492,12 +718,27 @@ void CState::setup_packet_handlers()
 	m_packet_handlers["replicate:remove_node"] =
 			[this](const ss_ &packet_name, const ss_ &data)
 	{
+		magic::Scene *scene = m_app->get_scene();
+		magic::MemoryBuffer msg(data.c_str(), data.size());
+		uint node_id = msg.ReadNetID();
+		// The ids can be reused by new nodes and components
+		m_latest_filter.forget("replicate:latest_node_data", node_id);
+		Node *node = scene->GetNode(node_id);
+		if(node){
+			for(const auto &c : node->GetComponents()){
+				m_latest_filter.forget("replicate:latest_component_data",
+						c->GetID());
+			}
+		}
 		log_w(MODULE, "TODO: %s", cs(packet_name));
 	};
 
 	m_packet_handlers["replicate:remove_component"] =
 			[this](const ss_ &packet_name, const ss_ &data)
 	{
+		magic::MemoryBuffer msg(data.c_str(), data.size());
+		uint c_id = msg.ReadNetID();
+		m_latest_filter.forget("replicate:latest_component_data", c_id);
 		log_w(MODULE, "TODO: %s", cs(packet_name));
 	};
 
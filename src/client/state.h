@@ -5,6 +5,7 @@
 
 namespace interface {
 	struct TCPSocket;
+	struct CompressionStats;
 }
 namespace app {
 	struct App;
@@ -24,6 +25,7 @@ namespace client
 		virtual ss_ get_file_path(const ss_ &name, ss_ *dst_file_hash = NULL) = 0;
 		// Throws exception if not found
 		virtual ss_ get_file_content(const ss_ &name) = 0;
+		virtual interface::CompressionStats get_compression_stats() = 0;
 	};
 
 	State* createState(sp_<app::App> app);
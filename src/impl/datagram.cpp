@@ -0,0 +1,116 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+#include "interface/datagram.h"
+#include <random>
+
+namespace interface {
+namespace datagram {
+
+static void append_u16le(ss_ &out, size_t v)
+{
+	out += (char)(v & 0xff);
+	out += (char)((v>>8) & 0xff);
+}
+
+static void append_u32le(ss_ &out, size_t v)
+{
+	append_u16le(out, v & 0xffff);
+	append_u16le(out, (v>>16) & 0xffff);
+}
+
+static size_t read_u16le(const uchar *p)
+{
+	return (size_t)p[0] | ((size_t)p[1]<<8);
+}
+
+static uint32_t read_u32le(const uchar *p)
+{
+	return (uint32_t)read_u16le(p) | ((uint32_t)read_u16le(p + 2)<<16);
+}
+
+ss_ create_token()
+{
+	std::random_device rd;
+	ss_ token;
+	while(token.size() < TOKEN_SIZE){
+		uint32_t r = rd();
+		for(size_t i = 0; i < 4 && token.size() < TOKEN_SIZE; i++)
+			token += (char)((r>>(i*8)) & 0xff);
+	}
+	return token;
+}
+
+void write_header(Kind kind, const ss_ &token, ss_ &out)
+{
+	out += (char)kind;
+	out += token;
+}
+
+bool read_header(const char *data, size_t size, Kind *kind, ss_ *token)
+{
+	if(size < HEADER_SIZE)
+		return false;
+	uchar k = data[0];
+	if(k != HELLO && k != WELCOME && k != UPDATE)
+		return false;
+	*kind = (Kind)k;
+	token->assign(data + 1, TOKEN_SIZE);
+	return true;
+}
+
+void write_update(const Update &update, ss_ &out)
+{
+	append_u32le(out, update.sequence);
+	append_u32le(out, update.key);
+	append_u16le(out, update.name.size());
+	out += update.name;
+	out += update.data;
+}
+
+bool read_update(const char *data, size_t size, Update *update)
+{
+	const uchar *p = (const uchar*)data;
+	if(size < 10)
+		return false;
+	size_t name_size = read_u16le(p + 8);
+	if(size < 10 + name_size)
+		return false;
+	update->sequence = read_u32le(p);
+	update->key = read_u32le(p + 4);
+	update->name.assign(data + 10, name_size);
+	update->data.assign(data + 10 + name_size, size - 10 - name_size);
+	return true;
+}
+
+bool LatestFilter::accept(const Update &update)
+{
+	sm_<uint32_t, uint32_t> &latest = m_latest[update.name];
+	auto it = latest.find(update.key);
+	// Compared so that wrapping around is handled
+	if(it != latest.end() && (int32_t)(update.sequence - it->second) <= 0){
+		num_dropped++;
+		return false;
+	}
+	latest[update.key] = update.sequence;
+	num_accepted++;
+	return true;
+}
+
+void LatestFilter::clear()
+{
+	m_latest.clear();
+}
+
+void LatestFilter::forget(const ss_ &name, uint32_t key)
+{
+	auto it = m_latest.find(name);
+	if(it == m_latest.end())
+		return;
+	it->second.erase(key);
+	if(it->second.empty())
+		m_latest.erase(it);
+}
+
+}
+}
+// vim: set noet ts=4 sw=4:
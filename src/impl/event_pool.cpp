@@ -0,0 +1,120 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+#include "interface/event_pool.h"
+#include "interface/mutex.h"
+#include <new>
+
+namespace interface {
+namespace event_pool {
+
+static const size_t SIZE_CLASS_GRANULARITY = 16;
+static const size_t NUM_SIZE_CLASSES = 16; // Up to 256 bytes
+static const size_t MAX_FREE_BLOCKS_PER_CLASS = 4096;
+
+struct SizeClass
+{
+	sv_<void*> free_blocks;
+	size_t num_allocs = 0;
+	size_t num_reused = 0;
+	interface::Mutex mutex; // Protects each of the former variables
+};
+
+struct Pool
+{
+	SizeClass m_classes[NUM_SIZE_CLASSES];
+	size_t m_num_unpooled = 0;
+	interface::Mutex m_unpooled_mutex; // Protects m_num_unpooled
+
+	static size_t get_class(size_t size)
+	{
+		return (size + SIZE_CLASS_GRANULARITY - 1) / SIZE_CLASS_GRANULARITY - 1;
+	}
+
+	void* allocate(size_t size)
+	{
+		size_t ci = get_class(size);
+		if(size == 0 || ci >= NUM_SIZE_CLASSES){
+			{
+				interface::MutexScope ms(m_unpooled_mutex);
+				m_num_unpooled++;
+			}
+			return ::operator new(size);
+		}
+		SizeClass &c = m_classes[ci];
+		{
+			interface::MutexScope ms(c.mutex);
+			c.num_allocs++;
+			if(!c.free_blocks.empty()){
+				c.num_reused++;
+				void *p = c.free_blocks.back();
+				c.free_blocks.pop_back();
+				return p;
+			}
+		}
+		return ::operator new((ci + 1) * SIZE_CLASS_GRANULARITY);
+	}
+
+	void deallocate(void *p, size_t size)
+	{
+		if(p == nullptr)
+			return;
+		size_t ci = get_class(size);
+		if(size == 0 || ci >= NUM_SIZE_CLASSES){
+			::operator delete(p);
+			return;
+		}
+		SizeClass &c = m_classes[ci];
+		{
+			interface::MutexScope ms(c.mutex);
+			if(c.free_blocks.size() < MAX_FREE_BLOCKS_PER_CLASS){
+				c.free_blocks.push_back(p);
+				return;
+			}
+		}
+		::operator delete(p);
+	}
+
+	PoolStats get_stats()
+	{
+		PoolStats stats;
+		{
+			interface::MutexScope ms(m_unpooled_mutex);
+			stats.num_unpooled = m_num_unpooled;
+			stats.num_allocs = m_num_unpooled;
+		}
+		for(SizeClass &c : m_classes){
+			interface::MutexScope ms(c.mutex);
+			stats.num_allocs += c.num_allocs;
+			stats.num_reused += c.num_reused;
+			stats.num_free_blocks += c.free_blocks.size();
+		}
+		return stats;
+	}
+};
+
+// Never destructed because events can be freed by threads that outlive static
+// destructors
+static Pool* get_pool()
+{
+	static Pool *pool = new Pool();
+	return pool;
+}
+
+void* allocate(size_t size)
+{
+	return get_pool()->allocate(size);
+}
+
+void deallocate(void *p, size_t size)
+{
+	get_pool()->deallocate(p, size);
+}
+
+PoolStats get_stats()
+{
+	return get_pool()->get_stats();
+}
+
+}
+}
+// vim: set noet ts=4 sw=4:
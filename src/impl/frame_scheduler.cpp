@@ -0,0 +1,179 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+#include "interface/frame_scheduler.h"
+#include "interface/mutex.h"
+#include "interface/os.h"
+#include "core/log.h"
+#include <cstdio>
+#define MODULE "frame_scheduler"
+
+namespace interface {
+namespace frame_scheduler {
+
+struct Consumer
+{
+	bool ran_this_frame = false;
+	bool ran_last_frame = false;
+	int64_t slice_start_us = 0;
+	int64_t slice_us = 0;
+	int64_t this_frame_us = 0;
+	ConsumerStats stats;
+};
+
+struct CScheduler: public Scheduler
+{
+	int64_t m_budget_us;
+	int64_t m_min_slice_us; // 0 = budget / 8
+	int64_t m_frame_start_us = 0;
+	int64_t m_used_this_frame_us = 0;
+	sv_<Consumer> m_consumers;
+	FrameStats m_stats;
+	interface::Mutex m_mutex; // Protects each of the former variables
+
+	CScheduler(int64_t budget_us, int64_t min_slice_us):
+		m_budget_us(budget_us),
+		m_min_slice_us(min_slice_us)
+	{}
+
+	Consumer& check_consumer(ConsumerId id)
+	{
+		if(id >= m_consumers.size())
+			throw Exception("frame_scheduler: Invalid consumer id");
+		return m_consumers[id];
+	}
+
+	int64_t get_min_slice_us()
+	{
+		if(m_min_slice_us != 0)
+			return m_min_slice_us;
+		return m_budget_us / 8;
+	}
+
+	// Interface
+
+	void set_budget_us(int64_t budget_us)
+	{
+		interface::MutexScope ms(m_mutex);
+		m_budget_us = budget_us;
+	}
+
+	int64_t get_budget_us()
+	{
+		interface::MutexScope ms(m_mutex);
+		return m_budget_us;
+	}
+
+	ConsumerId register_consumer(const ss_ &name)
+	{
+		interface::MutexScope ms(m_mutex);
+		for(size_t i = 0; i < m_consumers.size(); i++){
+			if(m_consumers[i].stats.name == name)
+				return i;
+		}
+		m_consumers.push_back(Consumer());
+		m_consumers.back().stats.name = name;
+		return m_consumers.size() - 1;
+	}
+
+	void begin_frame()
+	{
+		interface::MutexScope ms(m_mutex);
+		int64_t now_us = interface::os::time_us();
+		if(m_frame_start_us != 0){
+			int64_t frame_us = now_us - m_frame_start_us;
+			m_stats.num_frames++;
+			m_stats.last_frame_us = frame_us;
+			if(m_stats.average_frame_us == 0)
+				m_stats.average_frame_us = frame_us;
+			else
+				m_stats.average_frame_us +=
+						(frame_us - m_stats.average_frame_us) / 16;
+			if(frame_us > m_stats.max_frame_us)
+				m_stats.max_frame_us = frame_us;
+			m_stats.last_work_us = m_used_this_frame_us;
+			if(m_used_this_frame_us > m_budget_us)
+				m_stats.num_frames_over_budget++;
+		}
+		for(Consumer &c : m_consumers){
+			c.ran_last_frame = c.ran_this_frame;
+			c.ran_this_frame = false;
+			c.stats.last_frame_us = c.this_frame_us;
+			c.this_frame_us = 0;
+		}
+		m_frame_start_us = now_us;
+		m_used_this_frame_us = 0;
+	}
+
+	int64_t begin_slice(ConsumerId id)
+	{
+		interface::MutexScope ms(m_mutex);
+		Consumer &consumer = check_consumer(id);
+		// Leave an equal share for everyone expected to run after this
+		size_t num_sharing = 1;
+		for(size_t i = 0; i < m_consumers.size(); i++){
+			const Consumer &c = m_consumers[i];
+			if(i != id && c.ran_last_frame && !c.ran_this_frame)
+				num_sharing++;
+		}
+		int64_t slice_us = (m_budget_us - m_used_this_frame_us) / num_sharing;
+		int64_t min_slice_us = get_min_slice_us();
+		if(slice_us < min_slice_us){
+			slice_us = min_slice_us;
+			consumer.stats.num_starved_slices++;
+		}
+		consumer.ran_this_frame = true;
+		consumer.slice_start_us = interface::os::time_us();
+		consumer.slice_us = slice_us;
+		return slice_us;
+	}
+
+	void end_slice(ConsumerId id)
+	{
+		interface::MutexScope ms(m_mutex);
+		Consumer &consumer = check_consumer(id);
+		int64_t used_us = interface::os::time_us() - consumer.slice_start_us;
+		m_used_this_frame_us += used_us;
+		consumer.this_frame_us += used_us;
+		consumer.stats.total_us += used_us;
+		consumer.stats.num_slices++;
+		if(used_us > consumer.slice_us)
+			consumer.stats.num_overruns++;
+	}
+
+	FrameStats get_stats()
+	{
+		interface::MutexScope ms(m_mutex);
+		FrameStats stats = m_stats;
+		for(const Consumer &c : m_consumers)
+			stats.consumers.push_back(c.stats);
+		return stats;
+	}
+};
+
+Scheduler* createScheduler(int64_t budget_us, int64_t min_slice_us)
+{
+	return new CScheduler(budget_us, min_slice_us);
+}
+
+ss_ format_stats(const FrameStats &stats)
+{
+	char buf[200];
+	snprintf(buf, sizeof buf, "%zu frames (%zu over budget); frame time: "
+			"last %ius, average %ius, max %ius; last work: %ius",
+			stats.num_frames, stats.num_frames_over_budget,
+			(int)stats.last_frame_us, (int)stats.average_frame_us,
+			(int)stats.max_frame_us, (int)stats.last_work_us);
+	ss_ s = buf;
+	for(const ConsumerStats &c : stats.consumers){
+		snprintf(buf, sizeof buf, "\n  %s: %zu slices (%zu starved, "
+				"%zu overruns), total %ims, last frame %ius",
+				cs(c.name), c.num_slices, c.num_starved_slices, c.num_overruns,
+				(int)(c.total_us / 1000), (int)c.last_frame_us);
+		s += buf;
+	}
+	return s;
+}
+
+}
+}
+// vim: set noet ts=4 sw=4:
@@ -4,6 +4,7 @@
 #include "interface/fs.h"
 #include <cstring>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 namespace interface {
@@ -21,6 +22,21 @@ void sleep_us(int us)
 	usleep(us);
 }
 
+int64_t monotonic_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + (int64_t)ts.tv_nsec / 1000;
+}
+
+void sleep_until_monotonic_us(int64_t deadline_us)
+{
+	struct timespec ts;
+	ts.tv_sec = deadline_us / 1000000;
+	ts.tv_nsec = (deadline_us % 1000000) * 1000;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+}
+
 ss_ get_current_exe_path()
 {
 	char buf[BUFSIZ];
@@ -30,6 +46,14 @@ ss_ get_current_exe_path()
 	return buf;
 }
 
+size_t get_num_cpus()
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n < 1)
+		return 1;
+	return n;
+}
+
 }
 }
 // vim: set noet ts=4 sw=4:
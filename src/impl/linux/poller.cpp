@@ -0,0 +1,160 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+#include "interface/poller.h"
+#include "interface/mutex.h"
+#include "core/log.h"
+#include <cstring>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#define MODULE "__poller"
+
+namespace interface {
+
+static const size_t MAX_EVENTS_PER_WAIT = 256;
+
+struct CPoller: public Poller
+{
+	int m_epoll_fd = -1;
+	int m_wake_fd = -1;
+	sm_<int, uint32_t> m_registered_events; // Without EPOLLOUT
+	interface::Mutex m_registered_mutex; // Protects m_registered_events
+	PollerStats m_stats;
+	interface::Mutex m_stats_mutex; // Protects m_stats
+
+	CPoller()
+	{
+		m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if(m_epoll_fd == -1)
+			throw Exception(ss_()+"epoll_create1() failed: "+strerror(errno));
+		m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(m_wake_fd == -1){
+			close(m_epoll_fd);
+			throw Exception(ss_()+"eventfd() failed: "+strerror(errno));
+		}
+		add(m_wake_fd, true);
+	}
+
+	~CPoller()
+	{
+		close(m_wake_fd);
+		close(m_epoll_fd);
+	}
+
+	void add(int fd, bool edge_triggered)
+	{
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof ev);
+		ev.events = EPOLLIN | EPOLLRDHUP | (edge_triggered ? (uint32_t)EPOLLET : 0);
+		ev.data.fd = fd;
+		interface::MutexScope ms(m_registered_mutex);
+		if(epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1){
+			throw Exception(ss_()+"epoll_ctl(EPOLL_CTL_ADD, "+itos(fd)+
+					") failed: "+strerror(errno));
+		}
+		m_registered_events[fd] = ev.events;
+	}
+
+	void set_write_interest(int fd, bool enabled)
+	{
+		interface::MutexScope ms(m_registered_mutex);
+		auto it = m_registered_events.find(fd);
+		if(it == m_registered_events.end())
+			throw Exception("set_write_interest(): fd "+itos(fd)+
+					" not added");
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof ev);
+		ev.events = it->second | (enabled ? (uint32_t)EPOLLOUT : 0);
+		ev.data.fd = fd;
+		if(epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1){
+			log_w(MODULE, "epoll_ctl(EPOLL_CTL_MOD, %i) failed: %s",
+					fd, strerror(errno));
+		}
+	}
+
+	void remove(int fd)
+	{
+		{
+			interface::MutexScope ms(m_registered_mutex);
+			m_registered_events.erase(fd);
+		}
+		// Closed fds are removed by the kernel already
+		if(epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr) == -1 &&
+				errno != EBADF && errno != ENOENT){
+			log_w(MODULE, "epoll_ctl(EPOLL_CTL_DEL, %i) failed: %s",
+					fd, strerror(errno));
+		}
+	}
+
+	void wake()
+	{
+		{
+			interface::MutexScope ms(m_stats_mutex);
+			m_stats.num_wake_requests++;
+		}
+		uint64_t one = 1;
+		// EAGAIN means a wakeup is already pending
+		if(write(m_wake_fd, &one, sizeof one) == -1 && errno != EAGAIN)
+			log_w(MODULE, "write(eventfd) failed: %s", strerror(errno));
+	}
+
+	bool wait(int timeout_us, sv_<int> &readable_fds, sv_<int> &writable_fds)
+	{
+		struct epoll_event events[MAX_EVENTS_PER_WAIT];
+		int timeout_ms = (timeout_us + 999) / 1000;
+		int r = epoll_wait(m_epoll_fd, events, MAX_EVENTS_PER_WAIT, timeout_ms);
+		if(r == -1){
+			if(errno == EINTR)
+				return false; // The process is probably quitting
+			log_w(MODULE, "epoll_wait() failed: %s", strerror(errno));
+			// Don't consume 100% CPU and flood logs
+			usleep(1000 * 100);
+			return false;
+		}
+		size_t num_ready = 0;
+		for(int i = 0; i < r; i++){
+			int fd = events[i].data.fd;
+			if(fd == m_wake_fd){
+				uint64_t count;
+				while(read(m_wake_fd, &count, sizeof count) > 0);
+				continue;
+			}
+			// Errors and hangups are found out by reading
+			if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+				readable_fds.push_back(fd);
+			if(events[i].events & EPOLLOUT)
+				writable_fds.push_back(fd);
+			num_ready++;
+		}
+		interface::MutexScope ms(m_stats_mutex);
+		if(r == 0){
+			m_stats.num_timeouts++;
+		} else {
+			m_stats.num_wakeups++;
+			m_stats.num_ready += num_ready;
+			if(num_ready > m_stats.max_ready_per_wakeup)
+				m_stats.max_ready_per_wakeup = num_ready;
+		}
+		return true;
+	}
+
+	bool is_edge_triggered_supported()
+	{
+		return true;
+	}
+
+	PollerStats get_stats()
+	{
+		interface::MutexScope ms(m_stats_mutex);
+		return m_stats;
+	}
+};
+
+Poller* createPoller()
+{
+	return new CPoller();
+}
+
+}
+// vim: set noet ts=4 sw=4:
@@ -1,64 +1,298 @@
 // http://www.apache.org/licenses/LICENSE-2.0
 // Copyright 2014 Perttu Ahola <celeron55@gmail.com>
 #include "interface/packet_stream.h"
+#include "interface/os.h"
 #include "core/log.h"
+#include "zlib.h"
+#include <cstdio>
 #define MODULE "__packet_stream"
 
 namespace interface {
 
-void PacketStream::input(std::deque<char> &socket_buffer,
-		std::function<void(const ss_&name, const ss_&data)> cb)
+// Flags of core:stream_options; what the sender can decompress
+static const uint32_t STREAM_FLAG_ZLIB = 0x01;
+static const uint32_t STREAM_FLAG_ZLIB_STREAMED = 0x02;
+
+struct ZlibContext
 {
-	for(;;){
-		if(socket_buffer.size() < 6)
+	z_stream z;
+	bool deflating;
+
+	ZlibContext(bool deflating, int level):
+		deflating(deflating)
+	{
+		memset(&z, 0, sizeof z);
+		int ret = deflating ? deflateInit(&z, level) : inflateInit(&z);
+		if(ret != Z_OK)
+			throw Exception("PacketStream: zlib initialization failed");
+	}
+	~ZlibContext()
+	{
+		if(deflating)
+			deflateEnd(&z);
+		else
+			inflateEnd(&z);
+	}
+};
+
+void add_compression_stats(CompressionStats &to, const CompressionStats &from)
+{
+	to.num_compressed += from.num_compressed;
+	to.compressed_bytes_in += from.compressed_bytes_in;
+	to.compressed_bytes_out += from.compressed_bytes_out;
+	to.num_not_smaller += from.num_not_smaller;
+	to.compress_us += from.compress_us;
+	to.num_decompressed += from.num_decompressed;
+	to.decompressed_bytes_in += from.decompressed_bytes_in;
+	to.decompressed_bytes_out += from.decompressed_bytes_out;
+	to.decompress_us += from.decompress_us;
+}
+
+ss_ format_compression_stats(const CompressionStats &stats)
+{
+	char buf[300];
+	snprintf(buf, sizeof buf, "compressed %zu packets (%zu not smaller): "
+			"%zu -> %zu bytes (%.1f%%) in %ims; decompressed %zu packets: "
+			"%zu -> %zu bytes in %ims",
+			stats.num_compressed, stats.num_not_smaller,
+			stats.compressed_bytes_in, stats.compressed_bytes_out,
+			stats.compressed_bytes_in ? 100.0 * stats.compressed_bytes_out /
+					stats.compressed_bytes_in : 0.0,
+			(int)(stats.compress_us / 1000), stats.num_decompressed,
+			stats.decompressed_bytes_in, stats.decompressed_bytes_out,
+			(int)(stats.decompress_us / 1000));
+	return buf;
+}
+
+// Headers are always little-endian
+static size_t read_u16le(const uchar *p)
+{
+	return (size_t)p[0]<<0 | (size_t)p[1]<<8;
+}
+
+static size_t read_u32le(const uchar *p)
+{
+	return (size_t)p[0]<<0 | (size_t)p[1]<<8 |
+			(size_t)p[2]<<16 | (size_t)p[3]<<24;
+}
+
+// Free space offered to the receiver at a time
+static const size_t INPUT_CHUNK_SIZE = 65536;
+// Payloads at least this large are received directly into their own buffer
+static const size_t LARGE_PAYLOAD_SIZE = 65536;
+static const size_t HEADER_SIZE = 6;
+
+char* PacketStream::get_input_space(size_t *size)
+{
+	if(m_large_payload){
+		ss_ &payload = *m_large_payload;
+		if(m_large_payload_received == payload.size()){
+			// Grow geometrically so that the payload is copied only a few
+			// times, but never ahead of the data by more than its size
+			size_t grow = payload.size() > INPUT_CHUNK_SIZE ?
+					payload.size() : INPUT_CHUNK_SIZE;
+			size_t left = m_large_payload_size - payload.size();
+			payload.resize(payload.size() + (grow < left ? grow : left));
+		}
+		*size = payload.size() - m_large_payload_received;
+		return &payload[m_large_payload_received];
+	}
+	char *space = m_input.prepare(INPUT_CHUNK_SIZE);
+	*size = m_input.m_storage.size() - m_input.m_end;
+	return space;
+}
+
+void PacketStream::input_received(size_t size,
+		std::function<void(const IncomingPacket &packet)> cb)
+{
+	if(m_large_payload){
+		m_large_payload_received += size;
+		if(m_large_payload_received < m_large_payload_size)
 			return;
-		size_t type =
-				(socket_buffer[0] & 0xff)<<0 |
-				(socket_buffer[1] & 0xff)<<8;
-		size_t size =
-				(socket_buffer[2] & 0xff)<<0 |
-				(socket_buffer[3] & 0xff)<<8 |
-				(socket_buffer[4] & 0xff)<<16 |
-				(socket_buffer[5] & 0xff)<<24;
-		//log_d(MODULE, "size=%zu", size);
-		if(socket_buffer.size() < 6 + size)
+		sp_<const ss_> data_p = std::move(m_large_payload);
+		m_large_payload.reset();
+		m_large_payload_received = 0;
+		m_large_payload_size = 0;
+		handle_packet(m_large_payload_type, std::move(data_p), cb);
+		// get_input_space() offered no more than the payload
+		return;
+	}
+	m_input.commit(size);
+	while(m_input.size() >= HEADER_SIZE){
+		const uchar *header = (const uchar*)m_input.data();
+		PacketType type = read_u16le(&header[0]);
+		size_t payload_size = read_u32le(&header[2]);
+		if(payload_size > m_max_packet_size)
+			throw CorruptPacketReceived(ss_()+"Packet is too large ("+
+					itos(payload_size)+" bytes)");
+		size_t buffered = m_input.size() - HEADER_SIZE;
+		if(buffered < payload_size){
+			if(payload_size < LARGE_PAYLOAD_SIZE)
+				return;
+			// Move what there is of the payload into a buffer of its own;
+			// the rest will be received straight into it
+			m_large_payload = std::make_shared<ss_>(
+					m_input.data() + HEADER_SIZE, buffered);
+			m_large_payload_received = buffered;
+			m_large_payload_size = payload_size;
+			m_large_payload_type = type;
+			m_input.consume(HEADER_SIZE + buffered);
 			return;
+		}
 		log_d(MODULE, "Received full packet; type=%zu, "
-				"length=6+%zu", type, size);
-		ss_ data(socket_buffer.begin() + 6, socket_buffer.begin() + 6 + size);
-		socket_buffer.erase(socket_buffer.begin(),
-				socket_buffer.begin() + 6 + size);
-
-		ss_ name = m_incoming_types.get_name(type);
-
-		if(name == "core:define_packet_type"){
-			PacketType type1 =
-					data[0]<<0 |
-					data[1]<<8;
-			size_t name1_size =
-					data[2]<<0 |
-					data[3]<<8 |
-					data[4]<<16 |
-					data[5]<<24;
-			if(data.size() < 6 + name1_size)
-				continue;
-			ss_ name1(&data.c_str()[6], name1_size);
-			log_d(MODULE, "<< core:define_packet_type %zu %s", type1, cs(name1));
-			m_incoming_types.set(type1, name1);
-			continue;
+				"length=6+%zu", type, payload_size);
+		sp_<const ss_> data_p = std::make_shared<ss_>(
+				m_input.data() + HEADER_SIZE, payload_size);
+		m_input.consume(HEADER_SIZE + payload_size);
+		handle_packet(type, std::move(data_p), cb);
+	}
+}
+
+void PacketStream::input(const char *data, size_t size,
+		std::function<void(const IncomingPacket &packet)> cb)
+{
+	while(size > 0){
+		size_t space_size = 0;
+		char *space = get_input_space(&space_size);
+		size_t n = size < space_size ? size : space_size;
+		memcpy(space, data, n);
+		data += n;
+		size -= n;
+		input_received(n, cb);
+	}
+}
+
+void PacketStream::handle_packet(PacketType type, sp_<const ss_> data_p,
+		std::function<void(const IncomingPacket &packet)> cb)
+{
+	if(type & PACKET_COMPRESSED){
+		bool streamed = type & PACKET_STREAMED;
+		type &= PACKET_TYPE_MASK;
+		// Continues a stream started before this end existed; the peer
+		// starts a new one once it gets the stream options of this end
+		if(streamed && !m_peer_stream_options_received){
+			log_w(MODULE, "Dropping streamed packet (type %zu) received "
+					"before stream options", type);
+			return;
+		}
+		data_p = decompress(*data_p, streamed);
+	}
+	const ss_ &data = *data_p;
+	const IncomingPacketTypeInfo &info = m_incoming_types.get_info(type);
+
+	if(type == 2){ // core:fragment
+		if(data.size() < 1)
+			throw CorruptPacketReceived("Empty fragment");
+		size_t channel = (uchar)data[0];
+		if(channel >= MAX_CHANNELS)
+			throw CorruptPacketReceived(ss_()+"Fragment of invalid channel "+
+					itos(channel));
+		// Buffered at most once per channel, and only as the fragments
+		// arrive
+		ss_ &frame = m_incoming_fragments[channel];
+		frame.append(data, 1, ss_::npos);
+		if(frame.size() < HEADER_SIZE)
+			return;
+		const uchar *header = (const uchar*)frame.c_str();
+		PacketType frame_type = read_u16le(&header[0]);
+		size_t frame_size = read_u32le(&header[2]);
+		if(frame_size > m_max_packet_size ||
+				frame.size() > HEADER_SIZE + frame_size ||
+				(frame_type & PACKET_TYPE_MASK) == 2)
+			throw CorruptPacketReceived("Invalid fragmented packet");
+		if(frame.size() < HEADER_SIZE + frame_size)
+			return;
+		sp_<ss_> frame_data = std::make_shared<ss_>(
+				frame, HEADER_SIZE, frame_size);
+		ss_().swap(frame);
+		handle_packet(frame_type, std::move(frame_data), cb);
+		return;
+	}
+
+	if(type == 1){ // core:stream_options
+		if(data.size() < 4)
+			return;
+		if(m_peer_stream_options_received){
+			log_d(MODULE, "Peer started its streams over");
+			m_inflate_streamed.reset();
+			m_deflate_streamed.reset();
+			m_stream_options_sent = false;
+			// The peer doesn't know the types this end has defined anymore
+			m_highest_known_type = 99;
 		}
+		m_peer_stream_options_received = true;
+		m_peer_stream_flags = read_u32le((const uchar*)data.c_str());
+		log_d(MODULE, "<< core:stream_options %x", m_peer_stream_flags);
+		return;
+	}
 
-		log_d(MODULE, "<< %s", cs(name));
-		cb(name, data);
+	if(type == 0){ // core:define_packet_type
+		if(data.size() < 6)
+			return;
+		const uchar *p = (const uchar*)data.c_str();
+		PacketType type1 = read_u16le(&p[0]);
+		size_t name1_size = read_u32le(&p[2]);
+		if(data.size() < 6 + name1_size)
+			return;
+		ss_ name1(&data.c_str()[6], name1_size);
+		log_d(MODULE, "<< core:define_packet_type %zu %s", type1, cs(name1));
+		m_incoming_types.set(type1, name1);
+		return;
 	}
+
+	log_d(MODULE, "<< %s", cs(*info.name));
+	IncomingPacket packet;
+	packet.type = type;
+	packet.info = &info;
+	packet.data = std::move(data_p);
+	cb(packet);
+}
+
+static void append_u16le(ss_ &out, size_t v)
+{
+	char b[2] = {(char)((v>>0) & 0xff), (char)((v>>8) & 0xff)};
+	out.append(b, 2);
+}
+
+static void append_u32le(ss_ &out, size_t v)
+{
+	char b[4] = {(char)((v>>0) & 0xff), (char)((v>>8) & 0xff),
+			(char)((v>>16) & 0xff), (char)((v>>24) & 0xff)};
+	out.append(b, 4);
 }
 
 void PacketStream::output(const ss_ &name, const ss_ &data,
 		std::function<void(const ss_&packet_data)> cb)
 {
+	ss_ out;
+	out.reserve(HEADER_SIZE + data.size());
+	output(name, data, out);
+	cb(out);
+}
+
+void PacketStream::output_stream_options(ss_ &out)
+{
+	if(m_stream_options_sent)
+		return;
+	m_stream_options_sent = true;
+	log_d(MODULE, ">> core:stream_options");
+	append_u16le(out, 1);
+	append_u32le(out, 4);
+	append_u32le(out, STREAM_FLAG_ZLIB | STREAM_FLAG_ZLIB_STREAMED);
+}
+
+void PacketStream::output(const ss_ &name, const ss_ &data, ss_ &out)
+{
+	PacketType type = output_type(name, out);
+	output_frame(type, data, true, out);
+}
+
+PacketType PacketStream::output_type(const ss_ &name, ss_ &out)
+{
+	output_stream_options(out);
+
 	PacketType type = m_outgoing_types.get(name);
-	log_d(MODULE, "output(): name=\"%s\", data.size()=%zu",
-			cs(name), data.size());
+	log_d(MODULE, "output(): name=\"%s\"", cs(name));
 
 	// Send new packet types if needed
 	log_d(MODULE, "m_outgoing_types.m_next_type=%zu"
@@ -71,30 +305,232 @@ void PacketStream::output(const ss_ &name, const ss_ &data,
 		t1 < m_outgoing_types.m_next_type; t1++){
 			ss_ name = m_outgoing_types.get_name(t1);
 			log_d(MODULE, "Sending type %zu = %s", t1, cs(name));
-			std::ostringstream os(std::ios::binary);
-			os<<(char)((t1>>0) & 0xff);
-			os<<(char)((t1>>8) & 0xff);
-			os<<(char)((name.size()>>0) & 0xff);
-			os<<(char)((name.size()>>8) & 0xff);
-			os<<(char)((name.size()>>16) & 0xff);
-			os<<(char)((name.size()>>24) & 0xff);
-			os<<name;
-			output("core:define_packet_type", os.str(), cb);
+			log_d(MODULE, ">> core:define_packet_type");
+			append_u16le(out, 0);
+			append_u32le(out, 6 + name.size());
+			append_u16le(out, t1);
+			append_u32le(out, name.size());
+			out += name;
 		}
 	}
 
 	log_d(MODULE, ">> %s", cs(name));
+	return type;
+}
+
+void PacketStream::output_frame(PacketType type, const ss_ &data,
+		bool allow_streamed, ss_ &out)
+{
+	const ss_ *payload = &data;
+	sp_<const ss_> compressed;
+	if(m_compression.enabled && (m_peer_stream_flags & STREAM_FLAG_ZLIB) &&
+			!data.empty() && data.size() >= m_compression.min_size){
+		bool streamed = allow_streamed && m_compression.streaming &&
+				(m_peer_stream_flags & STREAM_FLAG_ZLIB_STREAMED);
+		compressed = compress(data, streamed);
+		// The peer has to decompress everything that went into the stream
+		if(streamed || compressed->size() < data.size()){
+			type |= PACKET_COMPRESSED | (streamed ? PACKET_STREAMED : 0);
+			payload = compressed.get();
+		} else {
+			m_compression_stats.num_not_smaller++;
+		}
+	}
+
+	// Write actual packet including type and length
+	append_u16le(out, type);
+	append_u32le(out, payload->size());
+	out += *payload;
+}
+
+void PacketStream::set_output_channels(const sv_<int> &weights,
+		size_t fragment_size)
+{
+	if(weights.size() > MAX_CHANNELS)
+		throw Exception(ss_()+"PacketStream: Too many channels ("+
+				itos(weights.size())+")");
+	m_channels.resize(weights.size());
+	for(size_t i = 0; i < weights.size(); i++)
+		m_channels[i].weight = weights[i] > 0 ? weights[i] : 1;
+	m_fragment_size = fragment_size;
+}
+
+void PacketStream::queue_output(size_t channel, const ss_ &name,
+		const ss_ &data)
+{
+	if(channel >= m_channels.size())
+		throw Exception(ss_()+"PacketStream: Invalid channel "+itos(channel));
+	OutgoingChannel &ch = m_channels[channel];
+	ch.queue.push_back(QueuedPacket());
+	ch.queue.back().name = name;
+	ch.queue.back().data = data;
+	ch.queued_bytes += HEADER_SIZE + data.size();
+}
+
+bool PacketStream::has_queued_output() const
+{
+	for(const OutgoingChannel &ch : m_channels){
+		if(ch.queued_bytes > 0)
+			return true;
+	}
+	return false;
+}
+
+size_t PacketStream::get_queued_output_bytes(size_t channel) const
+{
+	if(channel >= m_channels.size())
+		return 0;
+	return m_channels[channel].queued_bytes;
+}
+
+// Deficit round robin: each visit gives a channel its weight times the
+// fragment size worth of bytes to send; what it doesn't use is kept for the
+// next visit as long as the channel has something queued.
+void PacketStream::pull_output(ss_ &out, size_t max_size)
+{
+	output_stream_options(out);
+	size_t start_size = out.size();
+	while(out.size() - start_size < max_size && has_queued_output()){
+		OutgoingChannel &ch = m_channels[m_next_channel];
+		size_t channel = m_next_channel;
+		m_next_channel = (m_next_channel + 1) % m_channels.size();
+		if(ch.queued_bytes == 0){
+			ch.deficit = 0;
+			continue;
+		}
+		ch.deficit += (int64_t)ch.weight * m_fragment_size;
+		while(ch.deficit > 0 && ch.queued_bytes > 0 &&
+				out.size() - start_size < max_size){
+			size_t size_was = out.size();
+			if(ch.fragmenting.empty()){
+				QueuedPacket &packet = ch.queue.front();
+				size_t packet_size = HEADER_SIZE + packet.data.size();
+				PacketType type = output_type(packet.name, out);
+				if(packet_size <= m_fragment_size){
+					output_frame(type, packet.data, true, out);
+				} else {
+					// The frame is decoded only once all of it has arrived,
+					// which can be after later packets of other channels, so
+					// it can't use the shared compression stream
+					output_frame(type, packet.data, false, ch.fragmenting);
+					ch.fragment_offset = 0;
+					ch.queued_bytes += ch.fragmenting.size();
+				}
+				ch.queued_bytes -= packet_size;
+				ch.queue.pop_front();
+			}
+			if(!ch.fragmenting.empty()){
+				size_t n = ch.fragmenting.size() - ch.fragment_offset;
+				if(n > m_fragment_size)
+					n = m_fragment_size;
+				log_d(MODULE, ">> core:fragment %zu: %zu bytes", channel, n);
+				append_u16le(out, 2);
+				append_u32le(out, 1 + n);
+				out += (char)channel;
+				out.append(ch.fragmenting, ch.fragment_offset, n);
+				ch.fragment_offset += n;
+				ch.queued_bytes -= n;
+				if(ch.fragment_offset == ch.fragmenting.size()){
+					ss_().swap(ch.fragmenting);
+					ch.fragment_offset = 0;
+				}
+			}
+			ch.deficit -= out.size() - size_was;
+		}
+		if(ch.queued_bytes == 0)
+			ch.deficit = 0;
+	}
+}
+
+// Compressed payloads are preceded by their uncompressed size
+sp_<const ss_> PacketStream::compress(const ss_ &data, bool streamed)
+{
+	int64_t t0 = interface::os::monotonic_us();
+	sp_<ZlibContext> &context = streamed ? m_deflate_streamed : m_deflate;
+	if(!context)
+		context = std::make_shared<ZlibContext>(true, m_compression.level);
+	else if(!streamed)
+		deflateReset(&context->z);
+	z_stream &z = context->z;
+
+	sp_<ss_> out_p = std::make_shared<ss_>();
+	ss_ &out = *out_p;
+	append_u32le(out, data.size());
+	// A sync flush can need a few bytes more than this
+	out.resize(4 + deflateBound(&z, data.size()) + 16);
+	size_t used = 4;
+	z.next_in = (Bytef*)data.c_str();
+	z.avail_in = data.size();
+	for(;;){
+		z.next_out = (Bytef*)&out[used];
+		z.avail_out = out.size() - used;
+		int status = deflate(&z, streamed ? Z_SYNC_FLUSH : Z_FINISH);
+		used = out.size() - z.avail_out;
+		if(status == Z_STREAM_ERROR)
+			throw Exception("PacketStream: deflate failed");
+		if(streamed ? (z.avail_in == 0 && z.avail_out != 0) :
+				status == Z_STREAM_END)
+			break;
+		out.resize(out.size() * 2);
+	}
+	out.resize(used);
+
+	CompressionStats &stats = m_compression_stats;
+	stats.num_compressed++;
+	stats.compressed_bytes_in += data.size();
+	stats.compressed_bytes_out += out.size();
+	stats.compress_us += interface::os::monotonic_us() - t0;
+	return out_p;
+}
+
+sp_<const ss_> PacketStream::decompress(const ss_ &data, bool streamed)
+{
+	int64_t t0 = interface::os::monotonic_us();
+	if(data.size() < 4)
+		throw CorruptPacketReceived("Compressed packet is too short");
+	size_t size = read_u32le((const uchar*)data.c_str());
+	// Deflate can't do better than about 1032:1, so a larger declared size
+	// can't be right and is not allocated
+	if(size > m_max_packet_size || size > (data.size() - 4) * 1032 + 64)
+		throw CorruptPacketReceived(ss_()+"Compressed packet declares "
+				"invalid size ("+itos(size)+" from "+itos(data.size())+
+				" bytes)");
+	sp_<ZlibContext> &context = streamed ? m_inflate_streamed : m_inflate;
+	if(!context)
+		context = std::make_shared<ZlibContext>(false, 0);
+	else if(!streamed)
+		inflateReset(&context->z);
+	z_stream &z = context->z;
+
+	sp_<ss_> out_p = std::make_shared<ss_>(size, '\0');
+	ss_ &out = *out_p;
+	z.next_in = (Bytef*)data.c_str() + 4;
+	z.avail_in = data.size() - 4;
+	z.next_out = (Bytef*)&out[0];
+	z.avail_out = out.size();
+	int status = inflate(&z, Z_SYNC_FLUSH);
+	if(status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+		throw CorruptPacketReceived(ss_()+"Inflate failed: "+itos(status));
+	if(z.avail_out != 0 || (!streamed && status != Z_STREAM_END))
+		throw CorruptPacketReceived("Compressed packet has wrong size");
+	// The end of a sync flush can be left over when the output is full
+	while(streamed && z.avail_in > 0){
+		char dummy;
+		z.next_out = (Bytef*)&dummy;
+		z.avail_out = 1;
+		status = inflate(&z, Z_SYNC_FLUSH);
+		if(z.avail_out == 0 || (status != Z_OK && status != Z_BUF_ERROR))
+			throw CorruptPacketReceived("Compressed packet has wrong size");
+		if(status == Z_BUF_ERROR)
+			throw CorruptPacketReceived("Compressed packet has extra data");
+	}
 
-	// Create actual packet including type and length
-	std::ostringstream os(std::ios::binary);
-	os<<(char)((type>>0) & 0xff);
-	os<<(char)((type>>8) & 0xff);
-	os<<(char)((data.size()>>0) & 0xff);
-	os<<(char)((data.size()>>8) & 0xff);
-	os<<(char)((data.size()>>16) & 0xff);
-	os<<(char)((data.size()>>24) & 0xff);
-	os<<data;
-	cb(os.str());
+	CompressionStats &stats = m_compression_stats;
+	stats.num_decompressed++;
+	stats.decompressed_bytes_in += data.size();
+	stats.decompressed_bytes_out += out.size();
+	stats.decompress_us += interface::os::monotonic_us() - t0;
+	return out_p;
 }
 
 }
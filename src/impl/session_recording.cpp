@@ -0,0 +1,305 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+#include "interface/session_recording.h"
+#include "interface/mutex.h"
+#include "interface/os.h"
+#include <fstream>
+
+namespace interface {
+namespace session_recording {
+
+static const char MAGIC[] = "BSR";
+static const uchar VERSION = 1;
+// Records given at once by Replayer::update() when replaying as fast as
+// possible
+static const size_t MAX_RECORDS_PER_UPDATE = 1000;
+
+static void append_varint(ss_ &out, uint64_t v)
+{
+	while(v >= 0x80){
+		out += (char)((v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	out += (char)v;
+}
+
+struct CRecorder: public Recorder
+{
+	std::ofstream m_file;
+	int64_t m_last_us;
+	sm_<ss_, size_t> m_name_ids;
+	RecorderStats m_stats;
+	ss_ m_buffer;
+	interface::Mutex m_mutex; // Protects each of the former variables
+
+	CRecorder(const ss_ &path):
+		m_file(path, std::ios::binary | std::ios::trunc),
+		m_last_us(interface::os::monotonic_us())
+	{
+		if(!m_file.good())
+			throw Exception("Could not open recording: "+path);
+		m_buffer += MAGIC;
+		m_buffer += (char)VERSION;
+	}
+
+	~CRecorder()
+	{
+		flush();
+	}
+
+	void write_time_u()
+	{
+		int64_t now_us = interface::os::monotonic_us();
+		append_varint(m_buffer, now_us - m_last_us);
+		m_last_us = now_us;
+	}
+
+	void buffer_written_u()
+	{
+		if(m_buffer.size() >= 65536)
+			flush_u();
+	}
+
+	void flush_u()
+	{
+		m_file.write(m_buffer.c_str(), m_buffer.size());
+		m_stats.num_bytes += m_buffer.size();
+		m_buffer.clear();
+		m_file.flush();
+	}
+
+	// Interface
+
+	void peer_connected(uint32_t peer)
+	{
+		interface::MutexScope ms(m_mutex);
+		m_buffer += (char)CONNECT;
+		write_time_u();
+		append_varint(m_buffer, peer);
+		buffer_written_u();
+	}
+
+	void peer_disconnected(uint32_t peer)
+	{
+		interface::MutexScope ms(m_mutex);
+		m_buffer += (char)DISCONNECT;
+		write_time_u();
+		append_varint(m_buffer, peer);
+		buffer_written_u();
+	}
+
+	void packet(RecordKind kind, uint32_t peer, const ss_ &name,
+			const ss_ &data)
+	{
+		interface::MutexScope ms(m_mutex);
+		auto it = m_name_ids.find(name);
+		if(it == m_name_ids.end()){
+			size_t id = m_name_ids.size();
+			it = m_name_ids.insert(std::make_pair(name, id)).first;
+			m_buffer += (char)NAME;
+			append_varint(m_buffer, name.size());
+			m_buffer += name;
+		}
+		m_buffer += (char)kind;
+		write_time_u();
+		append_varint(m_buffer, peer);
+		append_varint(m_buffer, it->second);
+		append_varint(m_buffer, data.size());
+		m_buffer += data;
+		m_stats.num_packets++;
+		buffer_written_u();
+	}
+
+	void flush()
+	{
+		interface::MutexScope ms(m_mutex);
+		flush_u();
+	}
+
+	RecorderStats get_stats()
+	{
+		interface::MutexScope ms(m_mutex);
+		RecorderStats stats = m_stats;
+		stats.num_bytes += m_buffer.size();
+		return stats;
+	}
+};
+
+Recorder* createRecorder(const ss_ &path)
+{
+	return new CRecorder(path);
+}
+
+sp_<Recorder> getGlobalRecorder(const ss_ &path)
+{
+	static sm_<ss_, sp_<Recorder>> recorders;
+	static interface::Mutex mutex;
+	interface::MutexScope ms(mutex);
+	sp_<Recorder> &recorder = recorders[path];
+	if(!recorder)
+		recorder.reset(new CRecorder(path));
+	return recorder;
+}
+
+struct CReplayer: public Replayer
+{
+	std::ifstream m_file;
+	ss_ m_path;
+	double m_speed;
+	sv_<ss_> m_names;
+	int64_t m_time_us = 0; // Of the last read record
+	int64_t m_start_us = 0; // When replaying was started
+	// Read but not yet given
+	Record m_next;
+	bool m_has_next = false;
+	bool m_ended = false;
+	ReplayStats m_stats;
+
+	CReplayer(const ss_ &path, double speed):
+		m_file(path, std::ios::binary),
+		m_path(path),
+		m_speed(speed)
+	{
+		if(!m_file.good())
+			throw Exception("Could not open recording: "+path);
+		char header[4];
+		if(!m_file.read(header, sizeof header) ||
+				ss_(header, 3) != MAGIC || (uchar)header[3] != VERSION)
+			throw Exception("Not a recording of a known version: "+path);
+	}
+
+	void corrupt()
+	{
+		throw Exception("Corrupt recording: "+m_path);
+	}
+
+	// Returns false at the end of the file
+	bool read_byte(uchar *b)
+	{
+		char c;
+		if(!m_file.get(c))
+			return false;
+		*b = c;
+		return true;
+	}
+
+	uint64_t read_varint()
+	{
+		uint64_t v = 0;
+		for(int shift = 0; shift < 64; shift += 7){
+			uchar b;
+			if(!read_byte(&b))
+				corrupt();
+			v |= (uint64_t)(b & 0x7f) << shift;
+			if(!(b & 0x80))
+				return v;
+		}
+		corrupt();
+		return 0;
+	}
+
+	void read_string(size_t size, ss_ &s)
+	{
+		s.resize(size);
+		if(size > 0 && !m_file.read(&s[0], size))
+			corrupt();
+	}
+
+	// Returns false at the end of the recording
+	bool read_record(Record &r)
+	{
+		for(;;){
+			uchar kind;
+			if(!read_byte(&kind))
+				return false;
+			if(kind == NAME){
+				ss_ name;
+				read_string(read_varint(), name);
+				m_names.push_back(name);
+				continue;
+			}
+			if(kind > OUTGOING)
+				corrupt();
+			r.kind = (RecordKind)kind;
+			m_time_us += read_varint();
+			r.time_us = m_time_us;
+			r.peer = read_varint();
+			r.name.clear();
+			r.data.clear();
+			if(kind == INCOMING || kind == OUTGOING){
+				size_t name_id = read_varint();
+				if(name_id >= m_names.size())
+					corrupt();
+				r.name = m_names[name_id];
+				read_string(read_varint(), r.data);
+			}
+			return true;
+		}
+	}
+
+	// Interface
+
+	int64_t update(std::function<void(const Record &record)> cb)
+	{
+		int64_t now_us = interface::os::monotonic_us();
+		if(m_start_us == 0)
+			m_start_us = now_us;
+		for(size_t i = 0; !m_ended; i++){
+			if(!m_has_next){
+				m_has_next = read_record(m_next);
+				if(!m_has_next){
+					m_ended = true;
+					break;
+				}
+			}
+			if(m_speed > 0){
+				int64_t due_us = m_start_us + m_next.time_us / m_speed;
+				if(due_us > now_us)
+					return due_us - now_us;
+				if(now_us - due_us > m_stats.max_behind_us)
+					m_stats.max_behind_us = now_us - due_us;
+			} else if(i == MAX_RECORDS_PER_UPDATE){
+				return 0;
+			}
+			m_has_next = false;
+			m_stats.num_records++;
+			if(m_next.kind == INCOMING || m_next.kind == OUTGOING){
+				m_stats.num_packets++;
+				m_stats.num_bytes += m_next.data.size();
+			}
+			cb(m_next);
+		}
+		return -1;
+	}
+
+	ReplayStats get_stats()
+	{
+		return m_stats;
+	}
+};
+
+Replayer* createReplayer(const ss_ &path, double speed)
+{
+	return new CReplayer(path, speed);
+}
+
+Encoder::Encoder(const CompressionOptions &compression)
+{
+	m_stream.set_compression(compression);
+	// Let the receiving end tell what it can decompress
+	PacketStream receiver;
+	receiver.set_compression(compression);
+	ss_ stream_options;
+	receiver.output_stream_options(stream_options);
+	m_stream.input(stream_options.c_str(), stream_options.size(),
+			[](const IncomingPacket &packet){});
+}
+
+void Encoder::encode(const ss_ &name, const ss_ &data, ss_ &out)
+{
+	m_stream.output(name, data, out);
+}
+
+}
+}
+// vim: set noet ts=4 sw=4:
@@ -8,9 +8,12 @@
 	#include <unistd.h>
 	#include <sys/types.h>
 	#include <sys/socket.h>
+	#include <sys/uio.h> // struct iovec
+	#include <limits.h> // IOV_MAX
 	#include <errno.h>
 	#include <fcntl.h>
 	#include <netinet/in.h>
+	#include <netinet/tcp.h> // TCP_NOTSENT_LOWAT
 	#include <netdb.h>
 	#define closesocket close
 //typedef int socket_t;
@@ -280,12 +283,114 @@ struct CTCPSocket: public TCPSocket
 	{
 		if(m_fd == -1)
 			return false;
-		if(send(m_fd, &data[0], data.size(), 0) == -1){
-			std::cerr<<"send: "<<strerror(errno)<<std::endl;
-			return false;
+		// send() can send less than asked even when blocking
+		size_t sent = 0;
+		while(sent < data.size()){
+			ssize_t r = send(m_fd, &data[sent], data.size() - sent, 0);
+			if(r == -1){
+				if(errno == EINTR)
+					continue;
+				std::cerr<<"send: "<<strerror(errno)<<std::endl;
+				return false;
+			}
+			sent += r;
 		}
 		return true;
 	}
+	ssize_t send_some(const char *data, size_t size)
+	{
+		if(m_fd == -1)
+			return -1;
+		for(;;){
+			ssize_t r = send(m_fd, data, size, 0);
+			if(r != -1)
+				return r;
+#ifdef _WIN32
+			if(WSAGetLastError() == WSAEWOULDBLOCK)
+				return 0;
+#else
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if(errno == EINTR)
+				continue;
+#endif
+			log_v("tcpsocket", "send: %s", strerror(errno));
+			return -1;
+		}
+	}
+	ssize_t send_some(const SendBuffer *buffers, size_t count)
+	{
+		if(m_fd == -1)
+			return -1;
+#ifdef _WIN32
+		WSABUF bufs[64];
+		if(count > 64)
+			count = 64;
+		for(size_t i = 0; i < count; i++){
+			bufs[i].buf = (char*)buffers[i].data;
+			bufs[i].len = buffers[i].size;
+		}
+		DWORD sent = 0;
+		if(WSASend(m_fd, bufs, count, &sent, 0, NULL, NULL) == 0)
+			return sent;
+		if(WSAGetLastError() == WSAEWOULDBLOCK)
+			return 0;
+		log_v("tcpsocket", "WSASend failed");
+		return -1;
+#else
+		struct iovec iov[64];
+		if(count > 64)
+			count = 64;
+		if(count > IOV_MAX)
+			count = IOV_MAX;
+		for(size_t i = 0; i < count; i++){
+			iov[i].iov_base = (void*)buffers[i].data;
+			iov[i].iov_len = buffers[i].size;
+		}
+		struct msghdr msg;
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		for(;;){
+			ssize_t r = sendmsg(m_fd, &msg, 0);
+			if(r != -1)
+				return r;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if(errno == EINTR)
+				continue;
+			log_v("tcpsocket", "sendmsg: %s", strerror(errno));
+			return -1;
+		}
+#endif
+	}
+	bool set_nonblocking(bool nonblocking)
+	{
+		if(m_fd == -1)
+			return false;
+#ifdef _WIN32
+		u_long mode = nonblocking ? 1 : 0;
+		return ioctlsocket(m_fd, FIONBIO, &mode) == 0;
+#else
+		int flags = fcntl(m_fd, F_GETFL, 0);
+		if(flags == -1)
+			return false;
+		flags = nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+		return fcntl(m_fd, F_SETFL, flags) == 0;
+#endif
+	}
+	bool set_unsent_low_water(size_t bytes)
+	{
+		if(m_fd == -1)
+			return false;
+#ifdef TCP_NOTSENT_LOWAT
+		int value = bytes;
+		return setsockopt(m_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+				&value, sizeof value) == 0;
+#else
+		return false;
+#endif
+	}
 	bool wait_data(int timeout_us)
 	{
 		if(m_fd == -1)
@@ -3,10 +3,16 @@
 #include "interface/thread_pool.h"
 #include "interface/mutex.h"
 #include "interface/semaphore.h"
+#include "interface/thread.h"
 #include "interface/debug.h"
+#include "interface/os.h"
+#include "interface/trace.h"
 #include "core/log.h"
 #include <c55/os.h>
 #include <deque>
+#include <algorithm>
+#include <exception>
+#include <typeinfo>
 #ifdef _WIN32
 	#include "ports/windows_compat.h"
 #else
@@ -19,15 +25,151 @@
 namespace interface {
 namespace thread_pool {
 
+// Span name of a part of a task; empty if not tracing
+static ss_ get_trace_name(const char *part, const Task &task)
+{
+	if(!interface::trace::is_enabled())
+		return "";
+	return ss_()+part+" "+typeid(task).name();
+}
+
+struct CThreadPool;
+
+struct CTaskGroup: public TaskGroup
+{
+	CThreadPool *m_pool;
+	size_t m_num_pending = 0;
+	std::exception_ptr m_exception;
+	interface::Mutex m_mutex; // Protects each of the former variables
+	interface::Semaphore m_job_done_sem; // Posted whenever a job finishes
+
+	CTaskGroup(CThreadPool *pool):
+		m_pool(pool)
+	{}
+	~CTaskGroup();
+
+	void finish_job(std::exception_ptr e)
+	{
+		interface::MutexScope ms(m_mutex);
+		m_num_pending--;
+		if(e && !m_exception)
+			m_exception = e;
+		// Posted while locked so that wait() cannot return and destroy the
+		// semaphore before this is done with it
+		m_job_done_sem.post();
+	}
+
+	// Interface
+
+	void add(std::function<void()> job);
+	void wait();
+};
+
+struct CTaskHandle: public TaskHandle
+{
+	bool m_cancelled = false;
+	bool m_superseded = false;
+	bool m_post_started = false;
+	interface::Mutex m_mutex; // Protects each of the former variables
+
+	void supersede()
+	{
+		interface::MutexScope ms(m_mutex);
+		if(!m_post_started)
+			m_superseded = true;
+	}
+
+	// Returns false if the task has been cancelled or superseded
+	bool start_post()
+	{
+		interface::MutexScope ms(m_mutex);
+		if(m_cancelled || m_superseded)
+			return false;
+		m_post_started = true;
+		return true;
+	}
+
+	bool is_superseded()
+	{
+		interface::MutexScope ms(m_mutex);
+		return m_superseded;
+	}
+
+	// Interface
+
+	void cancel()
+	{
+		interface::MutexScope ms(m_mutex);
+		if(!m_post_started)
+			m_cancelled = true;
+	}
+
+	bool is_cancelled()
+	{
+		interface::MutexScope ms(m_mutex);
+		return m_cancelled || m_superseded;
+	}
+};
+
+struct QueuedTask
+{
+	up_<Task> task;
+	sp_<CTaskHandle> handle;
+	TaskOptions options;
+};
+
+// Inserts after the tasks of the same or higher priority
+static void insert_task(std::deque<QueuedTask> &tasks, QueuedTask task)
+{
+	auto it = std::upper_bound(tasks.begin(), tasks.end(),
+			task.options.priority, [](int priority, const QueuedTask &t){
+		return priority > t.options.priority;
+	});
+	tasks.insert(it, std::move(task));
+}
+
+// A job of a TaskGroup
+struct Job
+{
+	CTaskGroup *group = nullptr;
+	std::function<void()> function;
+};
+
+struct Worker
+{
+	size_t index = 0;
+	CThreadPool *pool = nullptr;
+	pthread_t thread;
+	bool stop_requested = true;
+	bool running = false;
+	// The owner pops from the front; other workers steal from the back
+	std::deque<Job> jobs; // Preferred over tasks
+	// Sorted by descending priority; everyone pops from the front
+	std::deque<QueuedTask> tasks;
+	std::deque<QueuedTask> output_tasks; // Push back, pop front
+	interface::Mutex mutex; // Protects each of the former variables
+};
+
 struct CThreadPool: public ThreadPool
 {
-	bool m_running = false;
-	std::deque<up_<Task>> m_input_queue; // Push back, pop front
-	std::deque<up_<Task>> m_output_queue; // Push back, pop front
+	sv_<up_<Worker>> m_workers; // Only modified when not running
+	size_t m_next_input_worker = 0;
+	std::deque<Job> m_orphan_jobs; // Jobs added while not running
+	std::deque<QueuedTask> m_orphan_tasks; // Handed to workers by start()
+	sm_<ss_, wp_<CTaskHandle>> m_handles_by_key;
+	ThreadPoolStats m_stats;
 	interface::Mutex m_mutex; // Protects each of the former variables
-	interface::Semaphore m_tasks_sem; // Counts input tasks
 
-	//std::deque<up_<Task>> m_pre_tasks; // Push back, pop front
+	// Counts queued jobs and tasks (and wakeups when stopping); a worker that
+	// wakes up may find its work stolen already, which is fine.
+	interface::Semaphore m_work_sem;
+
+	// Set to the Worker in each worker thread of this pool
+	interface::ThreadLocalKey m_current_worker_key;
+
+	// Main thread only
+	QueuedTask m_unfinished_post_task;
+	size_t m_next_output_worker = 0;
 
 	~CThreadPool()
 	{
@@ -35,129 +177,374 @@ struct CThreadPool: public ThreadPool
 		join();
 	}
 
-	struct Thread {
-		bool stop_requested = true;
-		bool running = false;
-		interface::Mutex mutex; // Protects each of the former variables
-		CThreadPool *pool = nullptr;
-		pthread_t thread;
-	};
-	sv_<Thread> m_threads;
-
 	static void* run_thread(void *arg)
 	{
-		Thread *thread = (Thread*)arg;
+		Worker *worker = (Worker*)arg;
+		CThreadPool *pool = worker->pool;
 		log_d(MODULE, "Worker thread %p start", arg);
 #ifndef _WIN32
 		// Set name
-		if(pthread_setname_np(thread->thread, "buildat:worker")){
-			log_w(MODULE, "Failed to set worker thread %p name", thread);
+		if(pthread_setname_np(pthread_self(), "buildat:worker")){
+			log_w(MODULE, "Failed to set worker thread %p name", worker);
 		}
 		// Disable all signals
 		sigset_t sigset;
 		sigemptyset(&sigset);
 		(void)pthread_sigmask(SIG_SETMASK, &sigset, NULL);
 #endif
+		pool->m_current_worker_key.set(worker);
+		interface::trace::set_thread_name("thread_pool/"+itos(worker->index));
 		// Go on
 		for(;;){
-			// Wait for a task
-			thread->pool->m_tasks_sem.wait();
-			up_<Task> current;
-			{ // Grab the task from pool's input queue
-				interface::MutexScope ms_pool(thread->pool->m_mutex);
-				if(thread->pool->m_input_queue.empty()){
-					// Can happen in special cases, eg. when stopping thread
-					interface::MutexScope ms(thread->mutex);
-					// So, if stopping thread, stop thread
-					if(thread->stop_requested)
-						break;
+			// Wait for work
+			pool->m_work_sem.wait();
+			{
+				interface::MutexScope ms(worker->mutex);
+				if(worker->stop_requested)
+					break;
+			}
+			// Jobs first, own before stolen; then the most urgent task
+			Job job;
+			QueuedTask task;
+			if(!pool->pop_work(worker->index, &job, &task))
+				continue; // Someone else got to it first
+			if(job.group)
+				run_job(job);
+			else if(task.handle->is_cancelled())
+				pool->drop_task(task);
+			else
+				pool->run_task_thread(worker, std::move(task));
+		}
+		log_d(MODULE, "Worker thread %p exit", arg);
+		interface::MutexScope ms(worker->mutex);
+		worker->running = false;
+		pthread_exit(NULL);
+	}
+
+	static void run_job(Job &job)
+	{
+		std::exception_ptr e;
+		try {
+			interface::trace::SpanScope trace_span("task", "job");
+			job.function();
+		} catch(...){
+			e = std::current_exception();
+		}
+		job.group->finish_job(e);
+	}
+
+	void run_task_thread(Worker *worker, QueuedTask task)
+	{
+		// Run the task's threaded part
+		try {
+			interface::trace::SpanScope trace_span("task",
+					get_trace_name("thread", *task.task));
+			while(!task.task->thread());
+		} catch(std::exception &e){
+			log_w(MODULE, "Worker task failed: %s", e.what());
+			interface::debug::log_exception_backtrace();
+		}
+		// Push the task to the worker's output queue
+		interface::MutexScope ms(worker->mutex);
+		worker->output_tasks.push_back(std::move(task));
+	}
+
+	bool pop_work(size_t own_index, Job *job, QueuedTask *task)
+	{
+		{
+			Worker &worker = *m_workers[own_index];
+			interface::MutexScope ms(worker.mutex);
+			if(!worker.jobs.empty()){
+				*job = std::move(worker.jobs.front());
+				worker.jobs.pop_front();
+				return true;
+			}
+		}
+		if(steal_job(own_index + 1, job))
+			return true;
+		return pop_task(own_index, task);
+	}
+
+	// Takes the highest priority task at the front of any worker's queue, so
+	// that priorities hold across workers; the own queue wins ties
+	bool pop_task(size_t own_index, QueuedTask *task)
+	{
+		size_t num_workers = m_workers.size(); // Constant while running
+		for(;;){
+			Worker *best = nullptr;
+			int best_priority = 0;
+			for(size_t i = 0; i < num_workers; i++){
+				Worker &worker = *m_workers[(own_index + i) % num_workers];
+				interface::MutexScope ms(worker.mutex);
+				if(worker.tasks.empty())
 					continue;
+				int priority = worker.tasks.front().options.priority;
+				if(!best || priority > best_priority){
+					best = &worker;
+					best_priority = priority;
 				}
-				current = std::move(thread->pool->m_input_queue.front());
-				thread->pool->m_input_queue.pop_front();
 			}
-			// Run the task's threaded part
-			try {
-				while(!current->thread());
-			} catch(std::exception &e){
-				log_w(MODULE, "Worker task failed: %s", e.what());
-				interface::debug::log_exception_backtrace();
+			if(!best)
+				return false;
+			interface::MutexScope ms(best->mutex);
+			// Look again if someone else got to it first
+			if(best->tasks.empty() ||
+					best->tasks.front().options.priority < best_priority)
+				continue;
+			*task = std::move(best->tasks.front());
+			best->tasks.pop_front();
+			return true;
+		}
+	}
+
+	bool steal_job(size_t first_index, Job *job)
+	{
+		size_t num_workers = m_workers.size();
+		for(size_t i = 0; i < num_workers; i++){
+			Worker &victim = *m_workers[(first_index + i) % num_workers];
+			interface::MutexScope ms(victim.mutex);
+			if(!victim.jobs.empty()){
+				*job = std::move(victim.jobs.back());
+				victim.jobs.pop_back();
+				return true;
 			}
-			// Push the task to pool's output queue
-			{
-				interface::MutexScope ms_pool(thread->pool->m_mutex);
-				thread->pool->m_output_queue.push_back(std::move(current));
+		}
+		return false;
+	}
+
+	// Returns the worker whose queue new work from the current thread goes to:
+	// the current worker itself if called from one, otherwise round-robin.
+	// Returns nullptr if the pool has no threads.
+	Worker* get_input_worker()
+	{
+		Worker *current = (Worker*)m_current_worker_key.get();
+		if(current)
+			return current;
+		interface::MutexScope ms(m_mutex);
+		if(m_workers.empty())
+			return nullptr;
+		Worker *worker = m_workers[m_next_input_worker % m_workers.size()].get();
+		m_next_input_worker++;
+		return worker;
+	}
+
+	void push_job(Job job)
+	{
+		Worker *worker = get_input_worker();
+		if(!worker){
+			// No threads; the job is run by whoever waits for the group
+			interface::MutexScope ms(m_mutex);
+			m_orphan_jobs.push_back(std::move(job));
+			return;
+		}
+		{
+			interface::MutexScope ms(worker->mutex);
+			if(worker->stop_requested){
+				job.group->finish_job(std::make_exception_ptr(
+						Exception("Thread pool is stopping")));
+				return;
 			}
+			worker->jobs.push_front(std::move(job));
 		}
-		log_d(MODULE, "Worker thread %p exit", arg);
-		interface::MutexScope ms(thread->mutex);
-		thread->running = false;
-		pthread_exit(NULL);
+		m_work_sem.post();
+	}
+
+	// Runs one queued job in the calling thread; returns false if there were
+	// none
+	bool help_run_job()
+	{
+		Job job;
+		{
+			interface::MutexScope ms(m_mutex);
+			if(!m_orphan_jobs.empty()){
+				job = std::move(m_orphan_jobs.front());
+				m_orphan_jobs.pop_front();
+			}
+		}
+		if(!job.group){
+			Worker *current = (Worker*)m_current_worker_key.get();
+			size_t first_index = current ? current->index : 0;
+			if(m_workers.empty() || !steal_job(first_index, &job))
+				return false;
+		}
+		run_job(job);
+		return true;
+	}
+
+	QueuedTask pop_output_task(size_t *total_queue_size)
+	{
+		QueuedTask task;
+		*total_queue_size = 0;
+		size_t num_workers = m_workers.size();
+		for(size_t i = 0; i < num_workers; i++){
+			Worker &worker = *m_workers[(m_next_output_worker + i) % num_workers];
+			interface::MutexScope ms(worker.mutex);
+			*total_queue_size += worker.output_tasks.size();
+			if(!task.task && !worker.output_tasks.empty()){
+				task = std::move(worker.output_tasks.front());
+				worker.output_tasks.pop_front();
+			}
+		}
+		m_next_output_worker++;
+		return task;
+	}
+
+	// Counts a cancelled or superseded task as such and forgets it
+	void drop_task(QueuedTask &task)
+	{
+		interface::MutexScope ms(m_mutex);
+		if(task.handle->is_superseded())
+			m_stats.num_superseded++;
+		else
+			m_stats.num_skipped++;
+		forget_key(task);
+		task.task.reset();
+	}
+
+	// Called when the task is done with; m_mutex must be locked
+	void forget_key(const QueuedTask &task)
+	{
+		if(task.options.supersede_key.empty())
+			return;
+		auto it = m_handles_by_key.find(task.options.supersede_key);
+		if(it == m_handles_by_key.end())
+			return;
+		// Only if a newer task has not taken the key already
+		if(it->second.lock() == task.handle)
+			m_handles_by_key.erase(it);
 	}
 
 	// Interface
 
-	void add_task(up_<Task> task)
+	sp_<TaskHandle> add_task(up_<Task> task, const TaskOptions &options)
 	{
 		// TODO: Limit task->pre() execution time per frame
-		while(!task->pre());
+		{
+			interface::trace::SpanScope trace_span("task",
+					get_trace_name("pre", *task));
+			while(!task->pre());
+		}
+		QueuedTask queued;
+		queued.task = std::move(task);
+		queued.handle.reset(new CTaskHandle());
+		queued.options = options;
+		sp_<TaskHandle> handle = queued.handle;
+		// Locked throughout so that the workers can't go away meanwhile
 		interface::MutexScope ms(m_mutex);
-		m_input_queue.push_back(std::move(task));
-		m_tasks_sem.post();
+		m_stats.num_added++;
+		if(!options.supersede_key.empty()){
+			wp_<CTaskHandle> &slot = m_handles_by_key[options.supersede_key];
+			sp_<CTaskHandle> old = slot.lock();
+			if(old)
+				old->supersede();
+			slot = queued.handle;
+		}
+		Worker *worker = get_input_worker();
+		if(!worker){
+			// Not running; queued until start()
+			insert_task(m_orphan_tasks, std::move(queued));
+			return handle;
+		}
+		{
+			interface::MutexScope ms(worker->mutex);
+			insert_task(worker->tasks, std::move(queued));
+		}
+		m_work_sem.post();
+		return handle;
+	}
+
+	void cancel_task(const ss_ &supersede_key)
+	{
+		interface::MutexScope ms(m_mutex);
+		auto it = m_handles_by_key.find(supersede_key);
+		if(it == m_handles_by_key.end())
+			return;
+		sp_<CTaskHandle> handle = it->second.lock();
+		if(handle)
+			handle->cancel();
+		m_handles_by_key.erase(it);
 	}
 
 	void start(size_t num_threads)
 	{
 		interface::MutexScope ms(m_mutex);
-		if(!m_threads.empty()){
+		if(!m_workers.empty()){
 			log_w(MODULE, "CThreadPool::start(): Already running");
 			return;
 		}
-		m_threads.resize(num_threads);
+		if(num_threads == 0)
+			num_threads = interface::os::get_num_cpus();
+		log_v(MODULE, "Starting %zu worker threads", num_threads);
 		for(size_t i = 0; i < num_threads; i++){
-			Thread &thread = m_threads[i];
-			thread.pool = this;
-			thread.stop_requested = false;
-			if(pthread_create(&thread.thread, NULL, run_thread, (void*)&thread)){
+			m_workers.push_back(up_<Worker>(new Worker()));
+			Worker &worker = *m_workers.back();
+			worker.index = i;
+			worker.pool = this;
+			worker.stop_requested = false;
+		}
+		// Hand out the tasks added before starting
+		for(size_t i = 0; !m_orphan_tasks.empty(); i++){
+			insert_task(m_workers[i % num_threads]->tasks,
+					std::move(m_orphan_tasks.front()));
+			m_orphan_tasks.pop_front();
+			m_work_sem.post();
+		}
+		// Workers steal from each other, so all of them have to exist before
+		// any of them run
+		for(size_t i = 0; i < num_threads; i++){
+			Worker &worker = *m_workers[i];
+			interface::MutexScope ms(worker.mutex);
+			if(pthread_create(&worker.thread, NULL, run_thread, (void*)&worker)){
 				throw Exception("pthread_create() failed");
 			}
-			thread.running = true;
+			worker.running = true;
 		}
 	}
 
 	void request_stop()
 	{
 		interface::MutexScope ms(m_mutex);
-		// Remove everything from task queue
-		m_input_queue.clear();
-		// Ask threads to stop
-		for(Thread &thread : m_threads){
-			interface::MutexScope ms(thread.mutex);
-			thread.stop_requested = true;
+		sv_<Job> dropped_jobs;
+		for(up_<Worker> &worker : m_workers){
+			interface::MutexScope ms(worker->mutex);
+			// Remove everything from work queues
+			for(Job &job : worker->jobs)
+				dropped_jobs.push_back(std::move(job));
+			worker->jobs.clear();
+			worker->tasks.clear();
+			// Ask thread to stop
+			worker->stop_requested = true;
 		}
-		// Poke the threads awake
-		for(Thread &thread : m_threads){
-			(void)thread;
-			m_tasks_sem.post();
+		m_orphan_tasks.clear();
+		// Let anyone waiting for a dropped job continue
+		for(Job &job : dropped_jobs){
+			job.group->finish_job(std::make_exception_ptr(
+					Exception("Thread pool is stopping")));
 		}
+		// Poke the threads awake
+		for(size_t i = 0; i < m_workers.size(); i++)
+			m_work_sem.post();
 	}
 
 	void join()
 	{
-		for(Thread &thread : m_threads){
+		for(up_<Worker> &worker : m_workers){
 			{
-				interface::MutexScope ms(thread.mutex);
-				if(!thread.stop_requested){
+				interface::MutexScope ms(worker->mutex);
+				if(!worker->stop_requested){
 					log_w(MODULE, "Joining a thread that was not requested "
 							"to stop");
 				}
 			}
-			pthread_join(thread.thread, NULL);
+			pthread_join(worker->thread, NULL);
 		}
-		m_threads.clear();
+		interface::MutexScope ms(m_mutex);
+		m_workers.clear();
+		m_unfinished_post_task = QueuedTask();
+		m_handles_by_key.clear();
 	}
 
-	void run_post()
+	void run_post(int64_t max_time_us)
 	{
 		int64_t t1 = get_timeofday_us();
 		size_t queue_size = 0;
@@ -165,28 +552,31 @@ struct CThreadPool: public ThreadPool
 		bool last_was_partly_procesed = false;
 		for(;;){
 			// Pop an output task
-			up_<Task> task;
-			{
-				interface::MutexScope ms(m_mutex);
-				if(!m_output_queue.empty()){
-					queue_size = m_output_queue.size();
-					task = std::move(m_output_queue.front());
-					m_output_queue.pop_front();
+			QueuedTask task;
+			if(m_unfinished_post_task.task){
+				task = std::move(m_unfinished_post_task);
+			} else {
+				task = pop_output_task(&queue_size);
+				if(!task.task)
+					break;
+				// Results of cancelled tasks are not applied
+				if(!task.handle->start_post()){
+					drop_task(task);
+					continue;
 				}
 			}
-			if(!task)
-				break;
 			// run post() until too long has passed
 			bool overtime = false;
 			bool done = false;
 			for(;;){
 				post_count++;
-				done = task->post();
+				{
+					interface::trace::SpanScope trace_span("task",
+							get_trace_name("post", *task.task));
+					done = task.task->post();
+				}
 				int64_t t2 = get_timeofday_us();
-				int64_t max_t = 2000;
-				if(queue_size > 4)
-					max_t += (queue_size - 4) * 5000;
-				if(t2 - t1 >= max_t){
+				if(t2 - t1 >= max_time_us){
 					overtime = true;
 					break;
 				}
@@ -194,11 +584,14 @@ struct CThreadPool: public ThreadPool
 				if(done)
 					break;
 			}
-			// If still not done, push task to back to front of queue
+			// If still not done, continue with the task next time
 			if(!done){
-				interface::MutexScope ms(m_mutex);
-				m_output_queue.push_front(std::move(task));
+				m_unfinished_post_task = std::move(task);
 				last_was_partly_procesed = true;
+			} else {
+				interface::MutexScope ms(m_mutex);
+				m_stats.num_finished++;
+				forget_key(task);
 			}
 			// If overtime, stop processing
 			if(overtime){
@@ -214,8 +607,69 @@ struct CThreadPool: public ThreadPool
 		(void)last_was_partly_procesed; // Unused
 #endif
 	}
+
+	size_t get_num_threads()
+	{
+		interface::MutexScope ms(m_mutex);
+		return m_workers.size();
+	}
+
+	TaskGroup* create_group()
+	{
+		return new CTaskGroup(this);
+	}
+
+	ThreadPoolStats get_stats()
+	{
+		interface::MutexScope ms(m_mutex);
+		return m_stats;
+	}
 };
 
+CTaskGroup::~CTaskGroup()
+{
+	// Jobs refer to the group; they have to be finished before it goes away
+	try {
+		wait();
+	} catch(std::exception &e){
+		log_w(MODULE, "Task group job failed: %s", e.what());
+	}
+}
+
+void CTaskGroup::add(std::function<void()> job_function)
+{
+	{
+		interface::MutexScope ms(m_mutex);
+		m_num_pending++;
+	}
+	Job job;
+	job.group = this;
+	job.function = std::move(job_function);
+	m_pool->push_job(std::move(job));
+}
+
+void CTaskGroup::wait()
+{
+	for(;;){
+		{
+			interface::MutexScope ms(m_mutex);
+			if(m_num_pending == 0)
+				break;
+		}
+		// Help out instead of idling; this may run jobs of other groups too
+		if(!m_pool->help_run_job())
+			m_job_done_sem.wait();
+	}
+	std::exception_ptr e;
+	{
+		interface::MutexScope ms(m_mutex);
+		e = m_exception;
+		m_exception = nullptr;
+	}
+	if(e)
+		std::rethrow_exception(e);
+}
+
 ThreadPool* createThreadPool()
 {
 	return new CThreadPool();
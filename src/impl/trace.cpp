@@ -0,0 +1,177 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+#include "interface/trace.h"
+#include "interface/thread.h"
+#include "interface/mutex.h"
+#include "core/log.h"
+#include <atomic>
+#include <fstream>
+#include <cstdio>
+#define MODULE "trace"
+
+namespace interface {
+namespace trace {
+
+static ss_ json_escape(const ss_ &s)
+{
+	ss_ result;
+	result.reserve(s.size());
+	for(char c : s){
+		if(c == '"' || c == '\\'){
+			result += '\\';
+			result += c;
+		} else if((unsigned char)c < 0x20){
+			char buf[8];
+			snprintf(buf, sizeof buf, "\\u%04x", (unsigned char)c);
+			result += buf;
+		} else {
+			result += c;
+		}
+	}
+	return result;
+}
+
+struct Tracer
+{
+	std::atomic_bool m_enabled;
+	std::ofstream m_file;
+	ss_ m_path;
+	size_t m_num_spans = 0;
+	size_t m_num_entries = 0;
+	size_t m_next_tid = 1;
+	// Thread names are written again into each capture
+	sm_<size_t, ss_> m_thread_names;
+	set_<size_t> m_named_in_file;
+	interface::Mutex m_mutex; // Protects each of the former variables
+	interface::ThreadLocalKey m_tid_key; // Stores tid of calling thread
+
+	Tracer():
+		m_enabled(false)
+	{}
+
+	// Call with m_mutex locked
+	size_t get_tid_u()
+	{
+		size_t tid = (size_t)m_tid_key.get();
+		if(tid != 0)
+			return tid;
+		tid = m_next_tid++;
+		m_tid_key.set((void*)tid);
+		interface::Thread *thread = interface::Thread::get_current_thread();
+		if(thread)
+			m_thread_names[tid] = thread->get_name();
+		else
+			m_thread_names[tid] = "thread "+itos(tid);
+		return tid;
+	}
+
+	// Call with m_mutex locked
+	void begin_entry_u()
+	{
+		if(m_num_entries++ != 0)
+			m_file<<",\n";
+	}
+
+	// Call with m_mutex locked
+	void write_thread_name_u(size_t tid)
+	{
+		if(m_named_in_file.count(tid))
+			return;
+		m_named_in_file.insert(tid);
+		begin_entry_u();
+		m_file<<"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"<<
+				tid<<",\"args\":{\"name\":\""<<
+				json_escape(m_thread_names[tid])<<"\"}}";
+	}
+
+	bool start(const ss_ &path)
+	{
+		stop();
+		interface::MutexScope ms(m_mutex);
+		m_file.open(path.c_str(), std::ios::binary | std::ios::trunc);
+		if(!m_file.good()){
+			log_w(MODULE, "Could not open \"%s\"", cs(path));
+			m_file.close();
+			return false;
+		}
+		m_path = path;
+		m_num_spans = 0;
+		m_num_entries = 0;
+		m_named_in_file.clear();
+		m_file<<"[\n";
+		m_enabled = true;
+		log_i(MODULE, "Tracing into \"%s\"", cs(path));
+		return true;
+	}
+
+	void stop()
+	{
+		interface::MutexScope ms(m_mutex);
+		if(!m_enabled)
+			return;
+		m_enabled = false;
+		m_file<<"\n]\n";
+		m_file.close();
+		log_i(MODULE, "Wrote %zu spans into \"%s\"", m_num_spans, cs(m_path));
+	}
+
+	void set_thread_name(const ss_ &name)
+	{
+		interface::MutexScope ms(m_mutex);
+		size_t tid = get_tid_u();
+		m_thread_names[tid] = name;
+	}
+
+	void record(const char *category, const ss_ &name,
+			int64_t start_us, int64_t duration_us)
+	{
+		interface::MutexScope ms(m_mutex);
+		if(!m_enabled)
+			return;
+		size_t tid = get_tid_u();
+		write_thread_name_u(tid);
+		begin_entry_u();
+		m_file<<"{\"name\":\""<<json_escape(name)<<"\",\"cat\":\""<<category<<
+				"\",\"ph\":\"X\",\"ts\":"<<start_us<<",\"dur\":"<<duration_us<<
+				",\"pid\":1,\"tid\":"<<tid<<"}";
+		m_num_spans++;
+	}
+};
+
+// Never destructed because spans can be recorded by threads that outlive
+// static destructors
+static Tracer* get_tracer()
+{
+	static Tracer *tracer = new Tracer();
+	return tracer;
+}
+
+bool start(const ss_ &path)
+{
+	return get_tracer()->start(path);
+}
+
+void stop()
+{
+	get_tracer()->stop();
+}
+
+bool is_enabled()
+{
+	return get_tracer()->m_enabled;
+}
+
+void set_thread_name(const ss_ &name)
+{
+	get_tracer()->set_thread_name(name);
+}
+
+void record(const char *category, const ss_ &name,
+		int64_t start_us, int64_t duration_us)
+{
+	get_tracer()->record(category, name, start_us, duration_us);
+}
+
+}
+}
+// vim: set noet ts=4 sw=4:
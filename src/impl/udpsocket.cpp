@@ -0,0 +1,215 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+#include "interface/udpsocket.h"
+#include "core/log.h"
+#ifdef _WIN32
+	#include "ports/windows_sockets.h"
+#else
+	#include <unistd.h>
+	#include <sys/types.h>
+	#include <sys/socket.h>
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <netinet/in.h>
+	#include <netdb.h>
+	#define closesocket close
+#endif
+#include <string.h> // strerror()
+#include <functional>
+#define MODULE "udpsocket"
+
+namespace interface {
+
+// Defined in tcpsocket.cpp
+bool sockaddr_to_bytes(const sockaddr_storage *ptr, sv_<uchar> &to);
+std::string address_bytes_to_string(const sv_<uchar> &ip);
+
+struct CUDPSocket: public UDPSocket
+{
+	int m_fd = -1;
+
+	~CUDPSocket()
+	{
+		close_fd();
+	}
+
+	// Creates a non-blocking socket for one of the results of getaddrinfo()
+	// and passes it to cb; the first one cb returns true for is kept
+	bool open_fd(const ss_ &address, const ss_ &port, bool passive,
+			std::function<bool(int fd, const addrinfo *res)> cb)
+	{
+		close_fd();
+
+		struct addrinfo hints;
+		struct addrinfo *res0 = NULL;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_DGRAM;
+		hints.ai_protocol = IPPROTO_UDP;
+		ss_ address1 = address;
+		if(address1 == "any4"){
+			address1 = "any";
+			hints.ai_family = AF_INET;
+		}
+		if(address1 == "any6"){
+			address1 = "any";
+			hints.ai_family = AF_INET6;
+		}
+		if(address1 == "any" && passive)
+			hints.ai_flags = AI_PASSIVE; // Wildcard address
+		const char *address_c = (address1 == "any" ? NULL : address1.c_str());
+		const char *port_c = (port == "any" ? NULL : port.c_str());
+		int err = getaddrinfo(address_c, port_c, &hints, &res0);
+		if(err){
+			log_w(MODULE, "getaddrinfo: %s", gai_strerror(err));
+			return false;
+		}
+
+		int fd = -1;
+		for(struct addrinfo *res = res0; res != NULL; res = res->ai_next){
+			int try_fd = socket(res->ai_family, res->ai_socktype,
+					res->ai_protocol);
+			if(try_fd == -1)
+				continue;
+#ifdef _WIN32
+			u_long mode = 1;
+			bool nonblocking = ioctlsocket(try_fd, FIONBIO, &mode) == 0;
+#else
+			// Keep forked child processes from holding on to the port
+			fcntl(try_fd, F_SETFD, FD_CLOEXEC);
+			int flags = fcntl(try_fd, F_GETFL, 0);
+			bool nonblocking = flags != -1 &&
+					fcntl(try_fd, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+			if(!nonblocking || !cb(try_fd, res)){
+				closesocket(try_fd);
+				continue;
+			}
+			fd = try_fd;
+			break;
+		}
+		freeaddrinfo(res0);
+
+		if(fd == -1){
+			log_w(MODULE, "Failed to create socket for %s:%s",
+					cs(address), cs(port));
+			return false;
+		}
+		m_fd = fd;
+		return true;
+	}
+
+	// Interface
+
+	int fd() const
+	{
+		return m_fd;
+	}
+	bool good() const
+	{
+		return (m_fd != -1);
+	}
+	void close_fd()
+	{
+		if(m_fd != -1)
+			closesocket(m_fd);
+		m_fd = -1;
+	}
+	bool bind_fd(const ss_ &address, const ss_ &port)
+	{
+		return open_fd(address, port, true, [](int fd, const addrinfo *res){
+			int val = 1;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&val,
+					sizeof(val));
+			if(res->ai_family == AF_INET6){
+				setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&val,
+						sizeof(val));
+			}
+			return bind(fd, res->ai_addr, res->ai_addrlen) == 0;
+		});
+	}
+	bool connect_fd(const ss_ &address, const ss_ &port)
+	{
+		return open_fd(address, port, false, [](int fd, const addrinfo *res){
+			return connect(fd, res->ai_addr, res->ai_addrlen) == 0;
+		});
+	}
+	bool send_to(const char *data, size_t size, const ss_ &address)
+	{
+		if(m_fd == -1)
+			return false;
+		for(;;){
+			int r;
+			if(address.empty()){
+				r = send(m_fd, data, size, 0);
+			} else {
+				r = sendto(m_fd, data, size, 0,
+						(const sockaddr*)address.c_str(), address.size());
+			}
+			if(r != -1)
+				return true;
+#ifdef _WIN32
+			if(WSAGetLastError() == WSAEWOULDBLOCK)
+				return true;
+			log_v(MODULE, "sendto failed");
+#else
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+			if(errno == EINTR)
+				continue;
+			// Caused by an ICMP error for an earlier datagram
+			if(errno == ECONNREFUSED)
+				return true;
+			log_v(MODULE, "sendto: %s", strerror(errno));
+#endif
+			return false;
+		}
+	}
+	ssize_t receive_from(char *buf, size_t size, ss_ *address)
+	{
+		if(m_fd == -1)
+			return -1;
+		for(;;){
+			struct sockaddr_storage sa;
+			socklen_t sa_len = sizeof(sa);
+			int r = recvfrom(m_fd, buf, size, 0, (sockaddr*)&sa, &sa_len);
+			if(r != -1){
+				if(address)
+					address->assign((const char*)&sa, sa_len);
+				return r;
+			}
+#ifndef _WIN32
+			if(errno == EINTR)
+				continue;
+#endif
+			// Would block, or an ICMP error for an earlier datagram; neither
+			// matter to the caller
+			return -1;
+		}
+	}
+	ss_ format_address(const ss_ &address) const
+	{
+		struct sockaddr_storage sa;
+		if(address.size() > sizeof(sa))
+			return "";
+		memset(&sa, 0, sizeof(sa));
+		memcpy(&sa, address.c_str(), address.size());
+		sv_<uchar> a;
+		if(!sockaddr_to_bytes(&sa, a))
+			return "";
+		int port = 0;
+		if(sa.ss_family == AF_INET)
+			port = ntohs(((struct sockaddr_in*)&sa)->sin_port);
+		else if(sa.ss_family == AF_INET6)
+			port = ntohs(((struct sockaddr_in6*)&sa)->sin6_port);
+		return address_bytes_to_string(a)+":"+itos(port);
+	}
+};
+
+UDPSocket* createUDPSocket()
+{
+	return new CUDPSocket();
+}
+
+}
+// vim: set noet ts=4 sw=4:
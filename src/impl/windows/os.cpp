@@ -23,6 +23,25 @@ void sleep_us(int us)
 	usleep(us);
 }
 
+int64_t monotonic_us()
+{
+	static LARGE_INTEGER frequency;
+	if(frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (int64_t)(counter.QuadPart / frequency.QuadPart * 1000000 +
+			counter.QuadPart % frequency.QuadPart * 1000000 /
+			frequency.QuadPart);
+}
+
+void sleep_until_monotonic_us(int64_t deadline_us)
+{
+	int64_t delay_us = deadline_us - monotonic_us();
+	if(delay_us > 0)
+		usleep(delay_us);
+}
+
 struct HandleScope {
 	HANDLE h;
 	HandleScope(HANDLE h): h(h){}
@@ -57,6 +76,15 @@ ss_ get_current_exe_path()
 	throw Exception("get_current_exe_path(): .exe module not found");
 }
 
+size_t get_num_cpus()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	if(info.dwNumberOfProcessors < 1)
+		return 1;
+	return info.dwNumberOfProcessors;
+}
+
 }
 }
 // vim: set noet ts=4 sw=4:
@@ -0,0 +1,127 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+#include "interface/poller.h"
+#include "interface/mutex.h"
+#include "core/log.h"
+#include "ports/windows_sockets.h"
+#include "ports/windows_compat.h" // usleep()
+#define MODULE "__poller"
+
+namespace interface {
+
+// select() cannot be interrupted by wake() without a socket of our own, so
+// waits are split into slices between which pending wakeups are checked
+static const int MAX_SLICE_US = 10000;
+
+struct CPoller: public Poller
+{
+	set_<int> m_fds;
+	set_<int> m_write_fds;
+	bool m_wake_requested = false;
+	PollerStats m_stats;
+	interface::Mutex m_mutex; // Protects each of the former variables
+
+	void add(int fd, bool edge_triggered)
+	{
+		interface::MutexScope ms(m_mutex);
+		m_fds.insert(fd);
+	}
+
+	void remove(int fd)
+	{
+		interface::MutexScope ms(m_mutex);
+		m_fds.erase(fd);
+		m_write_fds.erase(fd);
+	}
+
+	void set_write_interest(int fd, bool enabled)
+	{
+		interface::MutexScope ms(m_mutex);
+		if(enabled)
+			m_write_fds.insert(fd);
+		else
+			m_write_fds.erase(fd);
+	}
+
+	void wake()
+	{
+		interface::MutexScope ms(m_mutex);
+		m_wake_requested = true;
+		m_stats.num_wake_requests++;
+	}
+
+	bool wait(int timeout_us, sv_<int> &readable_fds, sv_<int> &writable_fds)
+	{
+		for(;;){
+			fd_set rfds;
+			fd_set wfds;
+			FD_ZERO(&rfds);
+			FD_ZERO(&wfds);
+			{
+				interface::MutexScope ms(m_mutex);
+				if(m_wake_requested){
+					m_wake_requested = false;
+					m_stats.num_wakeups++;
+					return true;
+				}
+				for(int fd : m_fds)
+					FD_SET(fd, &rfds);
+				for(int fd : m_write_fds)
+					FD_SET(fd, &wfds);
+			}
+			int slice_us = timeout_us < MAX_SLICE_US ? timeout_us : MAX_SLICE_US;
+			timeout_us -= slice_us;
+			int r = 0;
+			if(rfds.fd_count == 0 && wfds.fd_count == 0){
+				// select() returns an error if no sockets are supplied
+				usleep(slice_us);
+			} else {
+				struct timeval tv;
+				tv.tv_sec = 0;
+				tv.tv_usec = slice_us;
+				r = select(0, &rfds, &wfds, NULL, &tv);
+				if(r == -1){
+					log_w(MODULE, "select() failed: %i", WSAGetLastError());
+					// Don't consume 100% CPU and flood logs
+					usleep(1000 * 100);
+					return false;
+				}
+			}
+			interface::MutexScope ms(m_mutex);
+			if(r > 0){
+				for(u_int i = 0; i < rfds.fd_count; i++)
+					readable_fds.push_back(rfds.fd_array[i]);
+				for(u_int i = 0; i < wfds.fd_count; i++)
+					writable_fds.push_back(wfds.fd_array[i]);
+				m_stats.num_wakeups++;
+				m_stats.num_ready += r;
+				if((size_t)r > m_stats.max_ready_per_wakeup)
+					m_stats.max_ready_per_wakeup = r;
+				return true;
+			}
+			if(timeout_us <= 0){
+				m_stats.num_timeouts++;
+				return true;
+			}
+		}
+	}
+
+	bool is_edge_triggered_supported()
+	{
+		return false;
+	}
+
+	PollerStats get_stats()
+	{
+		interface::MutexScope ms(m_mutex);
+		return m_stats;
+	}
+};
+
+Poller* createPoller()
+{
+	return new CPoller();
+}
+
+}
+// vim: set noet ts=4 sw=4:
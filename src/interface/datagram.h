@@ -0,0 +1,72 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+#pragma once
+#include "core/types.h"
+
+namespace interface
+{
+	// Format of the unreliable side channel that runs over UDP next to a
+	// TCP connection. Each datagram starts with a kind (u8) and the token
+	// the server gave the client over TCP; the token is how the server tells
+	// who sent a datagram, and how the client tells datagrams from a server
+	// it has reconnected to apart from stale ones.
+	namespace datagram
+	{
+		enum Kind
+		{
+			// Client -> server until welcomed, and then now and then to keep
+			// the address valid through NATs
+			HELLO = 0,
+			// Server -> client: The hello was received from this address
+			WELCOME = 1,
+			// Server -> client: Update, as written by write_update()
+			UPDATE = 2,
+		};
+
+		static const size_t TOKEN_SIZE = 8;
+		static const size_t HEADER_SIZE = 1 + TOKEN_SIZE;
+		// Larger updates go over TCP instead so that they are not lost to IP
+		// fragmentation
+		static const size_t MAX_SIZE = 1200;
+
+		// Only the newest update of each name and key is applied; the rest
+		// are dropped as they arrive
+		struct Update
+		{
+			uint32_t sequence = 0; // Counts up by one per sent update
+			uint32_t key = 0; // eg. node id
+			ss_ name; // Packet type name
+			ss_ data;
+		};
+
+		// Random, for each connection
+		ss_ create_token();
+
+		void write_header(Kind kind, const ss_ &token, ss_ &out);
+		// Returns false if the datagram is too short or of an unknown kind
+		bool read_header(const char *data, size_t size, Kind *kind,
+				ss_ *token);
+
+		// (sequence u32, key u32, name length u16, name, data)
+		void write_update(const Update &update, ss_ &out);
+		// Returns false if malformed
+		bool read_update(const char *data, size_t size, Update *update);
+
+		struct LatestFilter
+		{
+			// name -> key -> newest sequence
+			sm_<ss_, sm_<uint32_t, uint32_t>> m_latest;
+			size_t num_accepted = 0;
+			size_t num_dropped = 0;
+
+			// Returns false if a newer update of the same name and key has
+			// been accepted already
+			bool accept(const Update &update);
+			// Call when the sender says it has restarted
+			void clear();
+			// Call when the key goes away, eg. a removed node
+			void forget(const ss_ &name, uint32_t key);
+		};
+	}
+}
+// vim: set noet ts=4 sw=4:
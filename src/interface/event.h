@@ -32,6 +32,13 @@ namespace interface
 		struct Private {
 			virtual ~Private(){}
 		};
+		// If an event of the same type is the last one waiting in a module's
+		// queue when a newer one is emitted, the two are merged into one
+		// instead of queueing both
+		struct CoalescablePrivate: public Private {
+			// Returns a new Private that combines this and a newer one
+			virtual Private* coalesce(const Private &newer) const = 0;
+		};
 		Type type;
 		sp_<const Private> p;
 
@@ -43,10 +50,14 @@ namespace interface
 			type(type), p(p){}
 		Event(const Type &type, up_<Private> p):
 			type(type), p(std::move(p)){}
+		Event(const Type &type, sp_<const Private> p):
+			type(type), p(std::move(p)){}
 		Event(const ss_ &name):
 			type(t(name)){}
 		Event(const ss_ &name, up_<Private> p):
 			type(t(name)), p(std::move(p)){}
+		Event(const ss_ &name, sp_<const Private> p):
+			type(t(name)), p(std::move(p)){}
 		template<typename PrivateT>
 				Event(const ss_ &name, PrivateT *p):
 			type(t(name)), p(up_<Private>(p))
@@ -0,0 +1,66 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+#pragma once
+#include "core/types.h"
+#include "interface/event.h"
+#include <memory>
+#include <utility>
+
+namespace interface
+{
+	// Recycles the memory of event payloads. Events are emitted at high rates
+	// (one per received packet in network) and their payloads are freed in
+	// whichever module thread drops the last reference, so freed blocks are
+	// kept in per-size free lists shared by all threads.
+	namespace event_pool
+	{
+		struct PoolStats
+		{
+			size_t num_allocs = 0;
+			size_t num_reused = 0; // Taken from a free list
+			size_t num_unpooled = 0; // Too large to be pooled
+			size_t num_free_blocks = 0; // Currently cached
+		};
+
+		// Blocks larger than the largest size class go straight to the heap
+		void* allocate(size_t size);
+		void deallocate(void *p, size_t size);
+		PoolStats get_stats();
+
+		template<typename T>
+		struct Allocator
+		{
+			typedef T value_type;
+
+			Allocator(){}
+			template<typename U>
+			Allocator(const Allocator<U>&){}
+
+			T* allocate(size_t n){
+				return static_cast<T*>(event_pool::allocate(n * sizeof(T)));
+			}
+			void deallocate(T *p, size_t n){
+				event_pool::deallocate(p, n * sizeof(T));
+			}
+		};
+
+		template<typename T, typename U>
+		bool operator==(const Allocator<T>&, const Allocator<U>&){
+			return true;
+		}
+		template<typename T, typename U>
+		bool operator!=(const Allocator<T>&, const Allocator<U>&){
+			return false;
+		}
+
+		// Allocates the payload and its reference count as one pooled block;
+		// use instead of new when emitting frequent events:
+		//   emit_event(type, event_pool::make<Packet>(id, name, data));
+		template<typename PrivateT, typename... Args>
+		sp_<PrivateT> make(Args&&... args){
+			return std::allocate_shared<PrivateT>(Allocator<PrivateT>(),
+					std::forward<Args>(args)...);
+		}
+	}
+}
+// vim: set noet ts=4 sw=4:
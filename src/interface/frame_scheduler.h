@@ -0,0 +1,87 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+#pragma once
+#include "core/types.h"
+#include "interface/os.h"
+
+namespace interface
+{
+	namespace frame_scheduler
+	{
+		typedef size_t ConsumerId;
+
+		struct ConsumerStats
+		{
+			ss_ name;
+			size_t num_slices = 0;
+			// Slices that were cut down to the minimum because the frame's
+			// budget had already been used by others
+			size_t num_starved_slices = 0;
+			size_t num_overruns = 0; // Used more than the given slice
+			int64_t total_us = 0;
+			int64_t last_frame_us = 0;
+		};
+
+		struct FrameStats
+		{
+			size_t num_frames = 0;
+			size_t num_frames_over_budget = 0;
+			int64_t last_frame_us = 0; // Time between begin_frame() calls
+			int64_t average_frame_us = 0;
+			int64_t max_frame_us = 0;
+			int64_t last_work_us = 0; // Used by consumers during last frame
+			sv_<ConsumerStats> consumers;
+		};
+
+		// Divides a per-frame time budget between consumers of main thread
+		// time. Each consumer that runs in a frame gets an equal share of what
+		// is left of the budget, counting the consumers that ran in the
+		// previous frame but not yet in this one. A consumer always gets at
+		// least the minimum slice so that none of them is starved completely.
+		struct Scheduler
+		{
+			virtual ~Scheduler(){}
+			virtual void set_budget_us(int64_t budget_us) = 0;
+			virtual int64_t get_budget_us() = 0;
+			// Returns the existing id if a consumer by the name exists
+			virtual ConsumerId register_consumer(const ss_ &name) = 0;
+			virtual void begin_frame() = 0;
+			// Returns the amount of time the consumer can use now
+			virtual int64_t begin_slice(ConsumerId id) = 0;
+			virtual void end_slice(ConsumerId id) = 0;
+			virtual FrameStats get_stats() = 0;
+		};
+
+		// min_slice_us == 0 uses an eighth of the budget
+		Scheduler* createScheduler(int64_t budget_us, int64_t min_slice_us = 0);
+
+		// Human-readable multi-line summary for logging
+		ss_ format_stats(const FrameStats &stats);
+
+		// Runs a slice for the lifetime of the object. Work should be done in
+		// small steps until has_time() returns false.
+		struct SliceScope
+		{
+			Scheduler *m_scheduler;
+			ConsumerId m_id;
+			int64_t m_end_us;
+
+			SliceScope(Scheduler *scheduler, ConsumerId id):
+				m_scheduler(scheduler), m_id(id)
+			{
+				int64_t slice_us = m_scheduler->begin_slice(m_id);
+				m_end_us = interface::os::time_us() + slice_us;
+			}
+			~SliceScope(){
+				m_scheduler->end_slice(m_id);
+			}
+			int64_t get_remaining_us(){
+				return m_end_us - interface::os::time_us();
+			}
+			bool has_time(){
+				return get_remaining_us() > 0;
+			}
+		};
+	}
+}
+// vim: set noet ts=4 sw=4:
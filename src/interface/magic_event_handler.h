@@ -4,6 +4,7 @@
 #include "core/types.h"
 #include "interface/server.h"
 #include "interface/magic_event.h"
+#include "interface/event_pool.h"
 #include <Object.h>
 
 namespace interface
@@ -33,7 +34,8 @@ namespace interface
 
 		void emit_event(magic::StringHash event_type, magic::VariantMap &event_data)
 		{
-			m_server->emit_event(m_buildat_event_type, new interface::MagicEvent(
+			m_server->emit_event(m_buildat_event_type,
+					interface::event_pool::make<interface::MagicEvent>(
 					event_type, event_data));
 		}
 
@@ -9,7 +9,14 @@ namespace interface
 	{
 		int64_t time_us();
 		void sleep_us(int us);
+		// Monotonic clock with an unspecified epoch; for measuring intervals
+		// and scheduling, unaffected by changes of the wall clock
+		int64_t monotonic_us();
+		// Returns early if interrupted by a signal
+		void sleep_until_monotonic_us(int64_t deadline_us);
 		ss_ get_current_exe_path();
+		// Number of online CPUs; at least 1
+		size_t get_num_cpus();
 	}
 }
 
@@ -3,6 +3,7 @@
 #pragma once
 #include "core/types.h"
 #include <functional>
+#include <cstring>
 #include <deque>
 
 namespace interface
@@ -14,6 +15,73 @@ namespace interface
 		UnknownPacketReceived(const ss_ &msg): Exception(msg){}
 	};
 
+	// The stream cannot be continued after this
+	struct CorruptPacketReceived: public Exception {
+		CorruptPacketReceived(const ss_ &msg): Exception(msg){}
+	};
+
+	// The high bits of the type field of a packet tell how its payload is
+	// compressed; the rest is the actual type
+	static const PacketType PACKET_TYPE_MASK = 0x3fff;
+	static const PacketType PACKET_COMPRESSED = 0x8000;
+	// Compressed in the connection's shared zlib stream instead of alone
+	static const PacketType PACKET_STREAMED = 0x4000;
+
+	// Incoming packets declared larger than this are rejected as corrupt
+	static const size_t DEFAULT_MAX_PACKET_SIZE = 64 * 1024 * 1024;
+	// Output channels; fragments of other channels are rejected as corrupt
+	static const size_t MAX_CHANNELS = 8;
+
+	struct CompressionOptions
+	{
+		bool enabled = false;
+		// Smaller payloads are sent as is
+		size_t min_size = 256;
+		int level = 1; // zlib level; 1 is the fastest
+		// Compresses every packet in one zlib stream per connection so that
+		// packets are compressed using the earlier ones as a dictionary
+		bool streaming = false;
+	};
+
+	struct CompressionStats
+	{
+		size_t num_compressed = 0;
+		size_t compressed_bytes_in = 0;
+		size_t compressed_bytes_out = 0;
+		size_t num_not_smaller = 0; // Were sent as is
+		int64_t compress_us = 0;
+		size_t num_decompressed = 0;
+		size_t decompressed_bytes_in = 0;
+		size_t decompressed_bytes_out = 0;
+		int64_t decompress_us = 0;
+	};
+
+	// Sums the statistics of several streams
+	void add_compression_stats(CompressionStats &to,
+			const CompressionStats &from);
+	// Human-readable summary for logging
+	ss_ format_compression_stats(const CompressionStats &stats);
+
+	struct ZlibContext;
+
+	struct QueuedPacket
+	{
+		ss_ name;
+		ss_ data;
+	};
+
+	struct OutgoingChannel
+	{
+		int weight = 1;
+		std::deque<QueuedPacket> queue;
+		// The frame of a large packet being sent in fragments
+		ss_ fragmenting;
+		size_t fragment_offset = 0;
+		// Includes the unsent part of the fragmented frame
+		size_t queued_bytes = 0;
+		int64_t deficit = 0; // Bytes allowed to be sent on this round
+	};
+
 	struct OutgoingPacketTypeRegistry
 	{
 		sm_<ss_, PacketType> m_types;
@@ -28,6 +96,8 @@ namespace interface
 			auto it = m_types.find(name);
 			if(it != m_types.end())
 				return it->second;
+			if(m_next_type > PACKET_TYPE_MASK)
+				throw Exception("Too many packet types");
 			PacketType type = m_next_type++;
 			m_types[name] = type;
 			m_names[type] = name;
@@ -41,14 +111,25 @@ namespace interface
 		}
 	};
 
+	struct IncomingPacketTypeInfo
+	{
+		sp_<const ss_> name; // Shared by every packet of the type
+		size_t resolved = 0; // Given by the resolver of the registry
+	};
+
 	struct IncomingPacketTypeRegistry
 	{
 		sm_<ss_, PacketType> m_types;
-		sm_<PacketType, ss_> m_names;
+		sm_<PacketType, IncomingPacketTypeInfo> m_infos;
+		// Maps the name of each newly defined type to a value cached with it,
+		// eg. the event type the packets are emitted as
+		std::function<size_t(const ss_ &name)> m_resolver;
 
 		void set(PacketType type, const ss_ &name){
 			m_types[name] = type;
-			m_names[type] = name;
+			IncomingPacketTypeInfo &info = m_infos[type];
+			info.name.reset(new ss_(name));
+			info.resolved = m_resolver ? m_resolver(name) : 0;
 		}
 		PacketType get_type(const ss_ &name){
 			auto it = m_types.find(name);
@@ -56,12 +137,62 @@ namespace interface
 				return it->second;
 			throw UnknownPacketReceived(ss_()+"Packet not known: "+name);
 		}
-		ss_ get_name(PacketType type){
-			auto it = m_names.find(type);
-			if(it != m_names.end())
+		const IncomingPacketTypeInfo& get_info(PacketType type){
+			auto it = m_infos.find(type);
+			if(it != m_infos.end())
 				return it->second;
 			throw UnknownPacketReceived(ss_()+"Packet not known: "+itos(type));
 		}
+		ss_ get_name(PacketType type){
+			return *get_info(type).name;
+		}
+	};
+
+	// Contiguous buffer that is written at the end and read from the
+	// beginning. Unread data is moved to the front only when there is not
+	// enough free space after it, and the storage grows only when the unread
+	// data itself does not fit.
+	struct ReceiveBuffer
+	{
+		sv_<char> m_storage;
+		size_t m_begin = 0;
+		size_t m_end = 0;
+
+		const char* data() const {
+			return m_storage.data() + m_begin;
+		}
+		size_t size() const {
+			return m_end - m_begin;
+		}
+		// Returns space for at least min_size bytes after the unread data
+		char* prepare(size_t min_size){
+			if(m_storage.size() - m_end >= min_size)
+				return &m_storage[m_end];
+			if(m_begin != 0){
+				memmove(&m_storage[0], &m_storage[m_begin], size());
+				m_end -= m_begin;
+				m_begin = 0;
+			}
+			if(m_storage.size() - m_end < min_size)
+				m_storage.resize(m_end + min_size);
+			return &m_storage[m_end];
+		}
+		// Makes n bytes written into prepare()'d space readable
+		void commit(size_t n){
+			m_end += n;
+		}
+		void consume(size_t n){
+			m_begin += n;
+			if(m_begin == m_end)
+				m_begin = m_end = 0;
+		}
+	};
+
+	struct IncomingPacket
+	{
+		PacketType type = 0;
+		const IncomingPacketTypeInfo *info = nullptr;
+		sp_<const ss_> data; // Can be kept after the callback returns
 	};
 
 	struct PacketStream
@@ -69,17 +200,116 @@ namespace interface
 		OutgoingPacketTypeRegistry m_outgoing_types;
 		IncomingPacketTypeRegistry m_incoming_types;
 		PacketType m_highest_known_type = 99;
+		// Headers and small payloads
+		ReceiveBuffer m_input;
+		// The payload of a large packet is received straight into its final
+		// buffer instead of m_input. The buffer is grown as the payload
+		// arrives up to the size declared in the header.
+		sp_<ss_> m_large_payload;
+		size_t m_large_payload_received = 0;
+		size_t m_large_payload_size = 0;
+		PacketType m_large_payload_type = 0;
+		size_t m_max_packet_size = DEFAULT_MAX_PACKET_SIZE;
+		// Compression is used only after the peer has told it can decompress
+		CompressionOptions m_compression;
+		bool m_stream_options_sent = false;
+		// A peer sending core:stream_options again has started its streams
+		// over (eg. the server's network module was reloaded), and so does
+		// this end, including defining its packet types again
+		bool m_peer_stream_options_received = false;
+		uint32_t m_peer_stream_flags = 0;
+		CompressionStats m_compression_stats;
+		sp_<ZlibContext> m_deflate;
+		sp_<ZlibContext> m_deflate_streamed;
+		sp_<ZlibContext> m_inflate;
+		sp_<ZlibContext> m_inflate_streamed;
+		// Output can be queued in channels that are interleaved by weight
+		sv_<OutgoingChannel> m_channels;
+		size_t m_fragment_size = 16384;
+		size_t m_next_channel = 0;
+		// Fragmented packets being received; channel -> frame
+		sm_<size_t, ss_> m_incoming_fragments;
 
 		PacketStream(){
 			m_outgoing_types.set(0, "core:define_packet_type");
 			m_incoming_types.set(0, "core:define_packet_type");
+			m_outgoing_types.set(1, "core:stream_options");
+			m_incoming_types.set(1, "core:stream_options");
+			m_outgoing_types.set(2, "core:fragment");
+			m_incoming_types.set(2, "core:fragment");
 		}
 
-		void input(std::deque<char> &socket_buffer,
-				std::function<void(const ss_&name, const ss_&data)> cb);
+		void set_compression(const CompressionOptions &options){
+			m_compression = options;
+		}
+		void set_max_packet_size(size_t size){
+			m_max_packet_size = size;
+		}
+		const CompressionStats& get_compression_stats() const {
+			return m_compression_stats;
+		}
+		// What the peer can decompress; for when a connection is handled by
+		// separate input and output streams
+		uint32_t get_peer_stream_flags() const {
+			return m_peer_stream_flags;
+		}
+		void set_peer_stream_flags(uint32_t flags){
+			m_peer_stream_flags = flags;
+		}
+		// Tells the peer what this end can decompress; done by the first
+		// output() if not called right after connecting
+		void output_stream_options(ss_ &out);
+
+		// Sets the resolver of incoming packet types; call before input()
+		void set_incoming_type_resolver(
+				std::function<size_t(const ss_ &name)> resolver){
+			m_incoming_types.m_resolver = resolver;
+		}
 
+		// Received data is written directly into the space returned by this
+		// (eg. by recv()), after which input_received() is called
+		char* get_input_space(size_t *size);
+		// Passes the completed packets to cb without copying their name or
+		// data again
+		void input_received(size_t size,
+				std::function<void(const IncomingPacket &packet)> cb);
+
+		// Copies data in; for when it has not been received into
+		// get_input_space()
+		void input(const char *data, size_t size,
+				std::function<void(const IncomingPacket &packet)> cb);
+
+		void handle_packet(PacketType type, sp_<const ss_> data,
+				std::function<void(const IncomingPacket &packet)> cb);
+
+		// Passes the framed packet, preceded by any needed type definitions,
+		// to cb in one string
 		void output(const ss_ &name, const ss_ &data,
 				std::function<void(const ss_&packet_data)> cb);
+		// Appends the same to a buffer so that many packets can be sent at
+		// once
+		void output(const ss_ &name, const ss_ &data, ss_ &out);
+
+		// Channels let large packets of one channel be sent in fragments
+		// that are interleaved with the packets of other channels. Packets
+		// keep their order within a channel but not between channels. Each
+		// channel gets a share of the output by its weight.
+		void set_output_channels(const sv_<int> &weights,
+				size_t fragment_size);
+		void queue_output(size_t channel, const ss_ &name, const ss_ &data);
+		bool has_queued_output() const;
+		size_t get_queued_output_bytes(size_t channel) const;
+		// Appends about max_size bytes of queued output (ending at a packet
+		// or fragment boundary)
+		void pull_output(ss_ &out, size_t max_size);
+
+		// Writes stream options and new type definitions for the packet
+		PacketType output_type(const ss_ &name, ss_ &out);
+		void output_frame(PacketType type, const ss_ &data,
+				bool allow_streamed, ss_ &out);
+
+		sp_<const ss_> compress(const ss_ &data, bool streamed);
+		sp_<const ss_> decompress(const ss_ &data, bool streamed);
 	};
 }
 // vim: set noet ts=4 sw=4:
@@ -0,0 +1,46 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+#pragma once
+#include "core/types.h"
+
+namespace interface
+{
+	struct PollerStats
+	{
+		size_t num_wakeups = 0; // Returns from wait() other than timeouts
+		size_t num_timeouts = 0;
+		size_t num_wake_requests = 0; // Calls to wake()
+		size_t num_ready = 0; // Readable and writable fds reported in total
+		size_t max_ready_per_wakeup = 0;
+	};
+
+	// Waits for sockets to become readable or writable. Unlike with SelectHandler, the
+	// set of sockets is kept between waits and costs nothing when idle.
+	// Uses epoll on Linux and select() elsewhere.
+	struct Poller
+	{
+		virtual ~Poller(){}
+		// An edge-triggered fd is reported once each time new data arrives
+		// and has to be read until it would block. A level-triggered one is
+		// reported for as long as it has data (use for listening sockets).
+		// Edge-triggering is not available with select(), where every fd is
+		// level-triggered.
+		virtual void add(int fd, bool edge_triggered) = 0;
+		virtual void remove(int fd) = 0;
+		// While enabled, the fd is also reported when it becomes writable
+		// (edge-triggered) or while it is writable (level-triggered).
+		// Enabling it again reports an edge-triggered fd that is writable
+		// already.
+		virtual void set_write_interest(int fd, bool enabled) = 0;
+		// Makes an ongoing or the next wait() return; callable from any thread
+		virtual void wake() = 0;
+		// Fills in the ready fds; returns false on error (none are fatal)
+		virtual bool wait(int timeout_us, sv_<int> &readable_fds,
+				sv_<int> &writable_fds) = 0;
+		virtual bool is_edge_triggered_supported() = 0;
+		virtual PollerStats get_stats() = 0;
+	};
+
+	Poller* createPoller();
+}
+// vim: set noet ts=4 sw=4:
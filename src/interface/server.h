@@ -28,9 +28,21 @@ namespace interface
 		struct ThreadPool;
 	}
 
-	struct TickEvent: public interface::Event::Private {
+	// Ticks coalesce; a module that falls behind gets one tick with the dtimes
+	// of the missed ones added up
+	struct TickEvent: public interface::Event::CoalescablePrivate {
 		float dtime;
-		TickEvent(float dtime): dtime(dtime){}
+		size_t num_ticks = 1; // Number of ticks merged into this one
+		int64_t emitted_us = 0; // Emission time of the oldest merged tick
+		TickEvent(float dtime, int64_t emitted_us = 0):
+			dtime(dtime), emitted_us(emitted_us){}
+		Event::Private* coalesce(const Event::Private &newer) const {
+			const TickEvent &newer_tick = dynamic_cast<const TickEvent&>(newer);
+			TickEvent *merged = new TickEvent(
+					dtime + newer_tick.dtime, emitted_us);
+			merged->num_ticks = num_ticks + newer_tick.num_ticks;
+			return merged;
+		}
 	};
 
 	struct ModuleModifiedEvent: public interface::Event::Private {
@@ -50,6 +62,38 @@ namespace interface
 		ModuleUnloadedEvent(const ss_ &name): name(name){}
 	};
 
+	struct EventTypeStats {
+		size_t count = 0;
+		int64_t total_us = 0;
+		int64_t max_us = 0;
+	};
+
+	// Direct callbacks are executed using access_module()
+	struct DirectCbStats {
+		size_t count = 0;
+		int64_t wait_us = 0; // Waiting for the module thread to get to it
+		int64_t exec_us = 0; // Executing it in the module thread
+	};
+
+	// Counters are totals since the module was loaded
+	struct ModuleStats {
+		ss_ name;
+		sm_<ss_, EventTypeStats> events; // By event name
+		sm_<ss_, DirectCbStats> direct_cbs; // By caller module name
+		size_t num_events = 0;
+		double events_per_second = 0; // During the last stats interval
+		size_t queue_length = 0;
+		size_t max_queue_length = 0;
+		size_t num_coalesced_events = 0;
+		int64_t last_tick_lag_us = 0;
+	};
+
+	// core:stats is emitted periodically
+	struct StatsEvent: public interface::Event::Private {
+		sv_<ModuleStats> modules;
+		StatsEvent(const sv_<ModuleStats> &modules): modules(modules){}
+	};
+
 	// Occurs when trying to access a module using access_module(), but it has
 	// been stopped (and possibly deleted)
 	struct TargetModuleNotAvailable: public Exception {
@@ -63,6 +107,9 @@ namespace interface
 		virtual void shutdown(int exit_status = 0, const ss_ &reason = "") = 0;
 
 		virtual bool load_module(const interface::ModuleInfo &info) = 0;
+		// Compiles the modules in parallel without loading them, so that
+		// load_module() only has to construct and init them afterwards
+		virtual bool build_modules(const sv_<interface::ModuleInfo> &infos) = 0;
 		virtual void unload_module(const ss_ &module_name) = 0;
 		virtual void reload_module(const interface::ModuleInfo &info) = 0;
 		virtual void reload_module(const ss_ &module_name) = 0;
@@ -78,6 +125,8 @@ namespace interface
 
 		virtual void sub_event(struct Module *module, const Event::Type &type) = 0;
 		virtual void emit_event(Event event) = 0;
+		// Emits each in order with less overhead per event; clears events
+		virtual void emit_events(sv_<Event> &events) = 0;
 		template<typename TypeT>
 		void emit_event(const TypeT &type){
 			emit_event(std::move(Event(type)));
@@ -86,6 +135,12 @@ namespace interface
 		void emit_event(const TypeT &type, PrivateT *p){
 			emit_event(std::move(Event(type, up_<Event::Private>(p))));
 		}
+		// For payloads made by event_pool::make()
+		template<typename TypeT, typename PrivateT>
+		void emit_event(const TypeT &type, sp_<PrivateT> p){
+			emit_event(std::move(Event(type, sp_<const Event::Private>(
+					std::move(p)))));
+		}
 
 		virtual void tmp_store_data(const ss_ &name, const ss_ &data) = 0;
 		virtual ss_ tmp_restore_data(const ss_ &name) = 0;
@@ -99,6 +154,8 @@ namespace interface
 
 		virtual void access_thread_pool(std::function<void(
 				interface::thread_pool::ThreadPool*pool)> cb) = 0;
+
+		virtual sv_<ModuleStats> get_module_stats() = 0;
 	};
 }
 // vim: set noet ts=4 sw=4:
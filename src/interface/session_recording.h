@@ -0,0 +1,104 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+#pragma once
+#include "core/types.h"
+#include "interface/packet_stream.h"
+#include <functional>
+
+namespace interface
+{
+	// Recordings of the packets of network sessions, for benchmarking
+	// parsing, dispatch and replication with realistic traffic but without
+	// live clients.
+	//
+	// File format: "BSR" and a version byte (1), followed by records of a
+	// kind byte and unsigned LEB128 varints:
+	// - NAME: (length, name); the nth of these defines packet name id n
+	// - CONNECT, DISCONNECT: (time, peer)
+	// - INCOMING, OUTGOING: (time, peer, name id, data length, data)
+	// Times are microseconds since the previous timed record.
+	namespace session_recording
+	{
+		enum RecordKind
+		{
+			NAME = 0,
+			CONNECT = 1,
+			DISCONNECT = 2,
+			INCOMING = 3, // Received by the recording end
+			OUTGOING = 4, // Sent by the recording end
+		};
+
+		struct Record
+		{
+			RecordKind kind = CONNECT;
+			int64_t time_us = 0; // Since the recording was started
+			uint32_t peer = 0;
+			ss_ name;
+			ss_ data;
+		};
+
+		struct RecorderStats
+		{
+			size_t num_packets = 0;
+			size_t num_bytes = 0; // Written to the file
+		};
+
+		// Thread-safe. The file is written as packets are given, through a
+		// buffer that is flushed at least when the recorder is destroyed.
+		struct Recorder
+		{
+			virtual ~Recorder(){}
+			virtual void peer_connected(uint32_t peer) = 0;
+			virtual void peer_disconnected(uint32_t peer) = 0;
+			virtual void packet(RecordKind kind, uint32_t peer,
+					const ss_ &name, const ss_ &data) = 0;
+			virtual void flush() = 0;
+			virtual RecorderStats get_stats() = 0;
+		};
+
+		// Truncates the file; throws Exception if it cannot be opened
+		Recorder* createRecorder(const ss_ &path);
+		// The recorder of the path, created on first use and kept until the
+		// process exits, so that the recording continues across reloads of
+		// the module that uses it
+		sp_<Recorder> getGlobalRecorder(const ss_ &path);
+
+		struct ReplayStats
+		{
+			size_t num_records = 0;
+			size_t num_packets = 0;
+			size_t num_bytes = 0; // Of packet data
+			int64_t max_behind_us = 0; // Latest a record was given
+		};
+
+		// Gives the records of a recording when they are due. speed = 2
+		// replays twice as fast as recorded; 0 replays as fast as possible.
+		struct Replayer
+		{
+			virtual ~Replayer(){}
+			// Passes the records that are due to cb. Returns the time until
+			// the next one is due, or -1 when the recording has ended. Throws
+			// Exception if the file is corrupt.
+			virtual int64_t update(
+					std::function<void(const Record &record)> cb) = 0;
+			virtual ReplayStats get_stats() = 0;
+		};
+
+		// Throws Exception if the file cannot be opened or is not a
+		// recording
+		Replayer* createReplayer(const ss_ &path, double speed);
+
+		// Turns recorded packets back into the bytes a connection would
+		// carry, so that feeding them to a PacketStream costs what receiving
+		// them did, including decompression
+		struct Encoder
+		{
+			PacketStream m_stream;
+
+			// compression: Of the receiving end, as if negotiated with it
+			Encoder(const CompressionOptions &compression);
+			void encode(const ss_ &name, const ss_ &data, ss_ &out);
+		};
+	}
+}
+// vim: set noet ts=4 sw=4:
@@ -5,6 +5,12 @@
 
 namespace interface
 {
+	struct SendBuffer
+	{
+		const char *data;
+		size_t size;
+	};
+
 	struct TCPSocket
 	{
 		virtual ~TCPSocket(){}
@@ -17,7 +23,18 @@ namespace interface
 		// Special values "any4", "any6" and "any"
 		virtual bool bind_fd(const ss_ &address, const ss_ &port) = 0;
 		virtual bool accept_fd(const TCPSocket &listener) = 0;
+		// Sends everything; blocks if the socket is blocking
 		virtual bool send_fd(const ss_ &data) = 0;
+		// Returns the number of bytes sent (0 if the socket would block) or -1
+		// on error
+		virtual ssize_t send_some(const char *data, size_t size) = 0;
+		// Sends from several buffers in order with a single system call;
+		// returns like the former
+		virtual ssize_t send_some(const SendBuffer *buffers, size_t count) = 0;
+		virtual bool set_nonblocking(bool nonblocking) = 0;
+		// Makes the socket be reported writable only while it has less than
+		// this many bytes not yet sent by the kernel; false if not supported
+		virtual bool set_unsent_low_water(size_t bytes) = 0;
 		virtual bool wait_data(int timeout_us) = 0;
 		virtual ss_ get_local_address() const = 0;
 		virtual ss_ get_remote_address() const = 0;
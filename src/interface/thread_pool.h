@@ -2,6 +2,7 @@
 // Copyright 2014 Perttu Ahola <celeron55@gmail.com>
 #pragma once
 #include "core/types.h"
+#include <functional>
 
 namespace interface
 {
@@ -18,14 +19,63 @@ namespace interface
 			virtual bool post() = 0;
 		};
 
+		struct TaskOptions
+		{
+			// Higher priority tasks have their threaded part run first
+			int priority = 0;
+			// If not empty, a task added later with the same key supersedes
+			// this one, unless post() of this one has already been called
+			ss_ supersede_key;
+		};
+
+		// A cancelled task is dropped without calling any more of its parts.
+		// Cancelling has no effect once post() has been called.
+		struct TaskHandle
+		{
+			virtual ~TaskHandle(){}
+			virtual void cancel() = 0;
+			// Also true if superseded
+			virtual bool is_cancelled() = 0;
+		};
+
+		struct ThreadPoolStats
+		{
+			size_t num_added = 0;
+			size_t num_finished = 0; // post() returned true
+			size_t num_skipped = 0; // Cancelled before finishing
+			size_t num_superseded = 0; // Superseded before finishing
+		};
+
+		// A fork-join group of small jobs that have no main thread part.
+		// wait() returns when every added job has finished; the waiting thread
+		// runs queued jobs itself meanwhile, so waiting on a group from inside
+		// a worker thread or in a pool with no threads does not deadlock.
+		// The first exception thrown by a job is rethrown by wait().
+		// A group must not outlive the pool that created it.
+		struct TaskGroup
+		{
+			virtual ~TaskGroup(){}
+			virtual void add(std::function<void()> job) = 0;
+			virtual void wait() = 0;
+		};
+
 		struct ThreadPool
 		{
 			virtual ~ThreadPool(){}
-			virtual void add_task(up_<Task> task) = 0;
+			virtual sp_<TaskHandle> add_task(up_<Task> task,
+					const TaskOptions &options = TaskOptions()) = 0;
+			// Cancels the pending task added with this supersede_key
+			virtual void cancel_task(const ss_ &supersede_key) = 0;
+			// num_threads == 0 starts one thread per CPU
 			virtual void start(size_t num_threads) = 0;
 			virtual void request_stop() = 0;
 			virtual void join() = 0;
-			virtual void run_post() = 0;
+			// Calls post() of finished tasks until max_time_us has passed; at
+			// least one call is made if there is anything to do
+			virtual void run_post(int64_t max_time_us) = 0;
+			virtual size_t get_num_threads() = 0;
+			virtual TaskGroup* create_group() = 0;
+			virtual ThreadPoolStats get_stats() = 0;
 		};
 
 		ThreadPool* createThreadPool();
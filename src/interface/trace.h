@@ -0,0 +1,53 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+#pragma once
+#include "core/types.h"
+#include "interface/os.h"
+
+namespace interface
+{
+	// Records timed spans into a file in the Trace Event Format (JSON array)
+	// that can be opened in chrome://tracing or other trace viewers. Each
+	// thread gets its own row. Recording can be started and stopped at any
+	// time from any thread; while stopped, recording costs one atomic load.
+	namespace trace
+	{
+		// Returns false if the file could not be opened. Stops an ongoing
+		// capture first.
+		bool start(const ss_ &path);
+		void stop();
+		bool is_enabled();
+
+		// Names the row of the calling thread; threads created with
+		// interface::Thread are named by default as they are
+		void set_thread_name(const ss_ &name);
+
+		// Records a span that took place in the calling thread
+		void record(const char *category, const ss_ &name,
+				int64_t start_us, int64_t duration_us);
+
+		// Records a span for the lifetime of the object
+		struct SpanScope
+		{
+			const char *m_category;
+			ss_ m_name;
+			int64_t m_start_us = 0;
+
+			SpanScope(const char *category, const ss_ &name):
+				m_category(category)
+			{
+				if(!is_enabled())
+					return;
+				m_name = name;
+				m_start_us = interface::os::time_us();
+			}
+			~SpanScope(){
+				if(m_start_us == 0)
+					return;
+				record(m_category, m_name, m_start_us,
+						interface::os::time_us() - m_start_us);
+			}
+		};
+	}
+}
+// vim: set noet ts=4 sw=4:
@@ -0,0 +1,35 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+#pragma once
+#include "core/types.h"
+
+namespace interface
+{
+	// A non-blocking datagram socket. Addresses of other ends are passed
+	// around in an opaque binary form as returned by receive_from().
+	struct UDPSocket
+	{
+		virtual ~UDPSocket(){}
+		virtual int fd() const = 0;
+		virtual bool good() const = 0;
+		virtual void close_fd() = 0;
+		// Special values "any4", "any6" and "any"
+		virtual bool bind_fd(const ss_ &address, const ss_ &port) = 0;
+		// Only datagrams from this address are received afterwards
+		virtual bool connect_fd(const ss_ &address, const ss_ &port) = 0;
+		// address == "" sends to the connected address. Returns false on
+		// error; a datagram the socket has no room for is dropped silently,
+		// as it could be on the way anyway.
+		virtual bool send_to(const char *data, size_t size,
+				const ss_ &address) = 0;
+		// Returns the size of the received datagram, or -1 if there is none
+		virtual ssize_t receive_from(char *buf, size_t size,
+				ss_ *address) = 0;
+		// Of an address returned by receive_from(), for logging
+		virtual ss_ format_address(const ss_ &address) const = 0;
+	};
+
+	UDPSocket* createUDPSocket();
+}
+
+// vim: set noet ts=4 sw=4:
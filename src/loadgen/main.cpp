@@ -0,0 +1,622 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+// Headless load generator: Connects simulated clients to a server, goes
+// through the file transfer handshake like buildat_client, consumes whatever
+// the server sends and reports throughput and latency.
+#include "core/types.h"
+#include "core/log.h"
+#include "boot/basic_init.h"
+#include "interface/tcpsocket.h"
+#include "interface/udpsocket.h"
+#include "interface/packet_stream.h"
+#include "interface/datagram.h"
+#include "interface/poller.h"
+#include "interface/os.h"
+#include <c55/getopt.h>
+#include <c55/string_util.h>
+#include <cereal/archives/portable_binary.hpp>
+#include <cereal/types/string.hpp>
+#include <algorithm>
+#include <fstream>
+#include <signal.h>
+#include <string.h> // strerror()
+#ifndef _WIN32
+	#include <sys/socket.h>
+#endif
+#define MODULE "loadgen"
+
+namespace datagram = interface::datagram;
+
+volatile sig_atomic_t g_stop_requested = 0;
+
+void sigint_handler(int sig)
+{
+	if(!g_stop_requested){
+		g_stop_requested = 1;
+	} else {
+		(void)signal(SIGINT, SIG_DFL);
+	}
+}
+
+void signal_handler_init()
+{
+	(void)signal(SIGINT, sigint_handler);
+#ifndef _WIN32
+	(void)signal(SIGPIPE, SIG_IGN);
+#endif
+}
+
+namespace loadgen {
+
+// Packets every client sends repeatedly once it has received all files.
+// Each line of a script file is "<interval_ms> <packet name> <data>"; data
+// starting with "hex:" is given in hexadecimal. Empty lines and lines
+// starting with # are ignored.
+struct ScriptLine
+{
+	int64_t interval_us = 0;
+	ss_ name;
+	ss_ data;
+};
+
+bool load_script(const ss_ &path, sv_<ScriptLine> &lines)
+{
+	std::ifstream f(path);
+	if(!f.good()){
+		log_e(MODULE, "Could not open script: %s", cs(path));
+		return false;
+	}
+	ss_ line;
+	while(std::getline(f, line)){
+		if(line.empty() || line[0] == '#')
+			continue;
+		c55::Strfnd sf(line);
+		ScriptLine sl;
+		sl.interval_us = atoi(sf.next(" ").c_str()) * 1000;
+		sl.name = sf.next(" ");
+		sl.data = sf.next("");
+		if(sl.interval_us <= 0 || sl.name.empty()){
+			log_e(MODULE, "Invalid script line: %s", cs(line));
+			return false;
+		}
+		if(sl.data.substr(0, 4) == "hex:"){
+			ss_ hex = sl.data.substr(4);
+			sl.data.clear();
+			for(size_t i = 0; i + 1 < hex.size(); i += 2)
+				sl.data += (char)strtol(hex.substr(i, 2).c_str(), NULL, 16);
+		}
+		lines.push_back(sl);
+	}
+	return true;
+}
+
+struct Options
+{
+	ss_ host = "localhost";
+	ss_ port = "20000";
+	size_t num_clients = 10;
+	int64_t connect_interval_us = 100000; // Between connecting two clients
+	int64_t duration_us = 60000000;
+	int64_t report_interval_us = 5000000;
+	int64_t ping_interval_us = 100000; // 0 = no pings
+	bool request_files = true; // false = pretend to have them cached
+	bool compression = true;
+	bool udp = false;
+	sv_<ScriptLine> script;
+};
+
+struct TypeStats
+{
+	size_t num_packets = 0;
+	size_t num_bytes = 0; // Of payloads
+};
+
+struct Stats
+{
+	sm_<ss_, TypeStats> types; // By packet name
+	size_t num_bytes_received = 0; // From sockets, including framing
+	size_t num_packets_sent = 0;
+	size_t num_connected = 0;
+	size_t num_ready = 0; // Have received all files
+	size_t num_connect_failures = 0;
+	size_t num_disconnects = 0;
+	size_t num_stale_updates = 0; // Dropped unreliable updates
+	sv_<int64_t> connect_us; // Of the TCP connection
+	sv_<int64_t> ready_us; // From connecting to having all files
+	sv_<int64_t> ping_us; // Round trip of core:ping
+};
+
+struct Client
+{
+	size_t index = 0;
+	up_<interface::TCPSocket> socket;
+	interface::PacketStream stream;
+	int64_t connect_start_us = 0;
+	set_<ss_> waiting_files;
+	bool tell_after_all_files_transferred_requested = false;
+	bool ready = false;
+	int64_t next_ping_us = 0;
+	sv_<int64_t> next_input_us; // For each script line
+	// Unreliable side channel
+	up_<interface::UDPSocket> udp_socket;
+	ss_ udp_token;
+	bool udp_welcomed = false;
+	int64_t last_udp_hello_us = 0;
+	datagram::LatestFilter latest_filter;
+};
+
+struct LoadGenerator
+{
+	Options m_options;
+	up_<interface::Poller> m_poller;
+	sv_<up_<Client>> m_clients;
+	sm_<int, Client*> m_clients_by_fd; // TCP and UDP
+	Stats m_stats;
+	Stats m_last_reported_stats;
+	int64_t m_start_us = 0;
+	int64_t m_last_report_us = 0;
+
+	LoadGenerator(const Options &options):
+		m_options(options),
+		m_poller(interface::createPoller())
+	{}
+
+	void send(Client &client, const ss_ &name, const ss_ &data)
+	{
+		client.stream.output(name, data, [&](const ss_ &packet_data){
+			client.socket->send_fd(packet_data);
+		});
+		m_stats.num_packets_sent++;
+	}
+
+	void count(const ss_ &name, size_t size)
+	{
+		TypeStats &ts = m_stats.types[name];
+		ts.num_packets++;
+		ts.num_bytes += size;
+	}
+
+	bool connect(Client &client)
+	{
+		client.socket.reset(interface::createTCPSocket());
+		client.connect_start_us = interface::os::monotonic_us();
+		if(!client.socket->connect_fd(m_options.host, m_options.port)){
+			m_stats.num_connect_failures++;
+			return false;
+		}
+		int64_t now_us = interface::os::monotonic_us();
+		m_stats.connect_us.push_back(now_us - client.connect_start_us);
+		m_stats.num_connected++;
+		interface::CompressionOptions compression;
+		compression.enabled = m_options.compression;
+		client.stream.set_compression(compression);
+		ss_ stream_options;
+		client.stream.output_stream_options(stream_options);
+		client.socket->send_fd(stream_options);
+		m_clients_by_fd[client.socket->fd()] = &client;
+		m_poller->add(client.socket->fd(), false);
+		return true;
+	}
+
+	void disconnect(Client &client)
+	{
+		m_poller->remove(client.socket->fd());
+		m_clients_by_fd.erase(client.socket->fd());
+		client.socket->close_fd();
+		if(client.udp_socket){
+			m_poller->remove(client.udp_socket->fd());
+			m_clients_by_fd.erase(client.udp_socket->fd());
+			client.udp_socket.reset();
+		}
+		m_stats.num_disconnects++;
+	}
+
+	void set_ready(Client &client)
+	{
+		send(client, "core:all_files_transferred", "");
+		client.tell_after_all_files_transferred_requested = false;
+		client.ready = true;
+		m_stats.num_ready++;
+		int64_t now_us = interface::os::monotonic_us();
+		m_stats.ready_us.push_back(now_us - client.connect_start_us);
+		// Spread the input of different clients over time
+		client.next_ping_us = now_us + rand() % (m_options.ping_interval_us + 1);
+		for(const ScriptLine &line : m_options.script){
+			client.next_input_us.push_back(
+					now_us + rand() % (line.interval_us + 1));
+		}
+	}
+
+	void handle_unreliable(Client &client, const char *data, size_t size)
+	{
+		datagram::Update update;
+		if(!datagram::read_update(data, size, &update))
+			return;
+		if(!client.latest_filter.accept(update)){
+			m_stats.num_stale_updates++;
+			return;
+		}
+		count(update.name, update.data.size());
+	}
+
+	void handle_packet(Client &client, const ss_ &name, const ss_ &data)
+	{
+		count(name, data.size());
+		if(name == "core:announce_file"){
+			ss_ file_name;
+			ss_ file_hash;
+			std::istringstream is(data, std::ios::binary);
+			{
+				cereal::PortableBinaryInputArchive ar(is);
+				ar(file_name);
+				ar(file_hash);
+			}
+			if(!m_options.request_files)
+				return;
+			std::ostringstream os(std::ios::binary);
+			{
+				cereal::PortableBinaryOutputArchive ar(os);
+				ar(file_name);
+				ar(file_hash);
+			}
+			send(client, "core:request_file", os.str());
+			client.waiting_files.insert(file_name);
+		} else if(name == "core:file_content"){
+			ss_ file_name;
+			std::istringstream is(data, std::ios::binary);
+			{
+				cereal::PortableBinaryInputArchive ar(is);
+				ar(file_name);
+			}
+			client.waiting_files.erase(file_name);
+			if(client.tell_after_all_files_transferred_requested &&
+					client.waiting_files.empty())
+				set_ready(client);
+		} else if(name == "core:tell_after_all_files_transferred"){
+			if(client.waiting_files.empty())
+				set_ready(client);
+			else
+				client.tell_after_all_files_transferred_requested = true;
+		} else if(name == "core:pong"){
+			int64_t sent_us = 0;
+			if(data.size() == sizeof sent_us){
+				memcpy(&sent_us, data.c_str(), sizeof sent_us);
+				m_stats.ping_us.push_back(
+						interface::os::monotonic_us() - sent_us);
+			}
+		} else if(name == "core:unreliable"){
+			handle_unreliable(client, data.c_str(), data.size());
+		} else if(name == "core:unreliable_reset"){
+			client.latest_filter.clear();
+		} else if(name == "core:udp_offer" && m_options.udp){
+			uint16_t port;
+			ss_ token;
+			std::istringstream is(data, std::ios::binary);
+			{
+				cereal::PortableBinaryInputArchive ar(is);
+				ar(port);
+				ar(token);
+			}
+			client.udp_socket.reset(interface::createUDPSocket());
+			if(!client.udp_socket->connect_fd(m_options.host, itos(port))){
+				client.udp_socket.reset();
+				return;
+			}
+			client.udp_token = token;
+			m_clients_by_fd[client.udp_socket->fd()] = &client;
+			m_poller->add(client.udp_socket->fd(), false);
+			send_udp_hello(client);
+		}
+	}
+
+	void send_udp_hello(Client &client)
+	{
+		ss_ hello;
+		datagram::write_header(datagram::HELLO, client.udp_token, hello);
+		client.udp_socket->send_to(hello.c_str(), hello.size(), "");
+		client.last_udp_hello_us = interface::os::monotonic_us();
+	}
+
+	void read_socket(Client &client)
+	{
+		size_t space_size = 0;
+		char *space = client.stream.get_input_space(&space_size);
+		ssize_t r = recv(client.socket->fd(), space, space_size, 0);
+		if(r <= 0){
+			log_w(MODULE, "Client %zu: Disconnected by server", client.index);
+			disconnect(client);
+			return;
+		}
+		m_stats.num_bytes_received += r;
+		try {
+			client.stream.input_received(r,
+			[&](const interface::IncomingPacket &packet){
+				handle_packet(client, *packet.info->name, *packet.data);
+			});
+			// The server starts its compression streams over when its
+			// network module is reloaded
+			ss_ stream_options;
+			client.stream.output_stream_options(stream_options);
+			if(!stream_options.empty())
+				client.socket->send_fd(stream_options);
+		} catch(std::exception &e){
+			log_w(MODULE, "Client %zu: %s; disconnecting", client.index,
+					e.what());
+			disconnect(client);
+		}
+	}
+
+	void read_udp_socket(Client &client)
+	{
+		char buf[datagram::MAX_SIZE];
+		for(;;){
+			ssize_t r = client.udp_socket->receive_from(buf, sizeof buf,
+					nullptr);
+			if(r == -1)
+				break;
+			m_stats.num_bytes_received += r;
+			datagram::Kind kind;
+			ss_ token;
+			if(!datagram::read_header(buf, r, &kind, &token) ||
+					token != client.udp_token)
+				continue;
+			if(kind == datagram::WELCOME){
+				client.udp_welcomed = true;
+			} else if(kind == datagram::UPDATE){
+				handle_unreliable(client, buf + datagram::HEADER_SIZE,
+						r - datagram::HEADER_SIZE);
+			}
+		}
+	}
+
+	// Sends what is due by now
+	void update_client(Client &client, int64_t now_us)
+	{
+		if(client.udp_socket){
+			int64_t interval_us = client.udp_welcomed ? 10000000 : 1000000;
+			if(now_us - client.last_udp_hello_us >= interval_us)
+				send_udp_hello(client);
+		}
+		if(!client.ready)
+			return;
+		if(m_options.ping_interval_us > 0 && now_us >= client.next_ping_us){
+			// Echoed back as is
+			ss_ data((const char*)&now_us, sizeof now_us);
+			send(client, "core:ping", data);
+			client.next_ping_us = now_us + m_options.ping_interval_us;
+		}
+		for(size_t i = 0; i < m_options.script.size(); i++){
+			const ScriptLine &line = m_options.script[i];
+			if(now_us < client.next_input_us[i])
+				continue;
+			send(client, line.name, line.data);
+			client.next_input_us[i] = now_us + line.interval_us;
+		}
+	}
+
+	static int64_t percentile(sv_<int64_t> values, double p)
+	{
+		if(values.empty())
+			return 0;
+		size_t i = (size_t)(p * (values.size() - 1));
+		std::nth_element(values.begin(), values.begin() + i, values.end());
+		return values[i];
+	}
+
+	static ss_ format_percentiles(const sv_<int64_t> &values)
+	{
+		char buf[200];
+		snprintf(buf, sizeof buf, "%zu samples; p50 %ius, p90 %ius, "
+				"p99 %ius, max %ius", values.size(),
+				(int)percentile(values, 0.5), (int)percentile(values, 0.9),
+				(int)percentile(values, 0.99), (int)percentile(values, 1.0));
+		return buf;
+	}
+
+	// Rates are since the previous report; latencies are of the whole run
+	ss_ format_report(int64_t interval_us)
+	{
+		const Stats &s = m_stats;
+		const Stats &last = m_last_reported_stats;
+		double seconds = interval_us / 1e6;
+		if(seconds <= 0)
+			seconds = 1;
+		char buf[300];
+		snprintf(buf, sizeof buf, "%zu of %zu clients connected (%zu "
+				"failed, %zu disconnected), %zu ready; %.0f bytes/s received, "
+				"%.0f packets/s sent; %zu stale unreliable updates dropped",
+				s.num_connected - s.num_disconnects, m_options.num_clients,
+				s.num_connect_failures, s.num_disconnects, s.num_ready,
+				(s.num_bytes_received - last.num_bytes_received) / seconds,
+				(s.num_packets_sent - last.num_packets_sent) / seconds,
+				s.num_stale_updates);
+		ss_ report = buf;
+		// Largest share of traffic first
+		sv_<std::pair<size_t, ss_>> types;
+		for(auto &pair : s.types){
+			auto it = last.types.find(pair.first);
+			size_t last_bytes = it == last.types.end() ? 0 :
+					it->second.num_bytes;
+			types.push_back(std::make_pair(
+					pair.second.num_bytes - last_bytes, pair.first));
+		}
+		std::sort(types.rbegin(), types.rend());
+		for(auto &pair : types){
+			const ss_ &name = pair.second;
+			const TypeStats &ts = s.types.at(name);
+			auto it = last.types.find(name);
+			size_t last_packets = it == last.types.end() ? 0 :
+					it->second.num_packets;
+			snprintf(buf, sizeof buf, "\n  %s: %.1f packets/s, %.0f bytes/s "
+					"(total %zu packets, %zu bytes)", cs(name),
+					(ts.num_packets - last_packets) / seconds,
+					pair.first / seconds, ts.num_packets, ts.num_bytes);
+			report += buf;
+		}
+		report += "\n  Connect: "+format_percentiles(s.connect_us);
+		report += "\n  Connect to all files transferred: "+
+				format_percentiles(s.ready_us);
+		report += "\n  Ping round trip: "+format_percentiles(s.ping_us);
+		return report;
+	}
+
+	void run()
+	{
+		for(size_t i = 0; i < m_options.num_clients; i++){
+			up_<Client> client(new Client());
+			client->index = i;
+			m_clients.push_back(std::move(client));
+		}
+		m_start_us = interface::os::monotonic_us();
+		m_last_report_us = m_start_us;
+		size_t num_started = 0;
+
+		while(!g_stop_requested){
+			int64_t now_us = interface::os::monotonic_us();
+			if(now_us - m_start_us >= m_options.duration_us)
+				break;
+			// Connect clients one at a time
+			while(num_started < m_clients.size() && now_us - m_start_us >=
+					(int64_t)num_started * m_options.connect_interval_us){
+				Client &client = *m_clients[num_started++];
+				if(!connect(client))
+					log_w(MODULE, "Client %zu: Connect failed", client.index);
+			}
+
+			sv_<int> readable_fds;
+			sv_<int> writable_fds;
+			m_poller->wait(10000, readable_fds, writable_fds);
+			for(int fd : readable_fds){
+				auto it = m_clients_by_fd.find(fd);
+				if(it == m_clients_by_fd.end())
+					continue;
+				Client &client = *it->second;
+				if(client.udp_socket && fd == client.udp_socket->fd())
+					read_udp_socket(client);
+				else
+					read_socket(client);
+			}
+
+			now_us = interface::os::monotonic_us();
+			for(up_<Client> &client : m_clients){
+				if(client->socket && client->socket->good())
+					update_client(*client, now_us);
+			}
+
+			if(now_us - m_last_report_us >= m_options.report_interval_us){
+				log_i(MODULE, "%s", cs(format_report(
+						now_us - m_last_report_us)));
+				m_last_reported_stats = m_stats;
+				m_last_report_us = now_us;
+			}
+		}
+
+		// Totals over the whole run
+		m_last_reported_stats = Stats();
+		int64_t run_us = interface::os::monotonic_us() - m_start_us;
+		printf("Over %.1fs: %s\n", run_us / 1e6, cs(format_report(run_us)));
+	}
+};
+
+}
+
+int main(int argc, char *argv[])
+{
+	boot::BasicInitScope basic_init_scope;
+	log_set_max_level(CORE_INFO);
+
+	loadgen::Options options;
+
+	const char opts[100] = "ha:n:c:d:r:p:i:kzul:L:";
+	const char usagefmt[1500] =
+			"Usage: %s [OPTION]...\n"
+			"  -h                   Show this help\n"
+			"  -a [address]         Server address (default localhost:20000)\n"
+			"  -n [integer]         Number of clients (default 10)\n"
+			"  -c [milliseconds]    Time between connecting clients (default 100)\n"
+			"  -d [seconds]         Duration of the run (default 60)\n"
+			"  -r [seconds]         Report interval (default 5)\n"
+			"  -p [milliseconds]    Ping interval of each client (default 100,\n"
+			"                       0 = no pings)\n"
+			"  -i [script path]     Send input from script; see src/loadgen/main.cpp\n"
+			"  -k                   Don't request files (as if cached)\n"
+			"  -z                   Disable compression\n"
+			"  -u                   Accept the server's UDP offer\n"
+			"  -l [integer]         Set maximum log level (0...5)\n"
+			"  -L [log file path]   Append log to a specified file\n"
+			;
+
+	int c;
+	while((c = c55_getopt(argc, argv, opts)) != -1)
+	{
+		switch(c)
+		{
+		case 'h':
+			printf(usagefmt, argv[0]);
+			return 1;
+		case 'a':
+			{
+				ss_ address = c55_optarg;
+				c55::Strfnd f(address);
+				if(!address.empty() && address[0] == '['){
+					f.next("[");
+					options.host = f.next("]");
+					f.next(":");
+				} else {
+					options.host = f.next(":");
+				}
+				ss_ port = f.next("");
+				if(port != "")
+					options.port = port;
+			}
+			break;
+		case 'n':
+			options.num_clients = atoi(c55_optarg);
+			break;
+		case 'c':
+			options.connect_interval_us = atoi(c55_optarg) * 1000LL;
+			break;
+		case 'd':
+			options.duration_us = atoi(c55_optarg) * 1000000LL;
+			break;
+		case 'r':
+			options.report_interval_us = atoi(c55_optarg) * 1000000LL;
+			break;
+		case 'p':
+			options.ping_interval_us = atoi(c55_optarg) * 1000LL;
+			break;
+		case 'i':
+			if(!loadgen::load_script(c55_optarg, options.script))
+				return 1;
+			break;
+		case 'k':
+			options.request_files = false;
+			break;
+		case 'z':
+			options.compression = false;
+			break;
+		case 'u':
+			options.udp = true;
+			break;
+		case 'l':
+			log_set_max_level(atoi(c55_optarg));
+			break;
+		case 'L':
+			log_set_file(c55_optarg);
+			break;
+		default:
+			fprintf(stderr, "ERROR: Invalid command-line argument\n");
+			fprintf(stderr, usagefmt, argv[0]);
+			return 1;
+		}
+	}
+
+	log_i(MODULE, "Loading %s:%s with %zu clients", cs(options.host),
+			cs(options.port), options.num_clients);
+
+	loadgen::LoadGenerator generator(options);
+	generator.run();
+	return 0;
+}
+
+// vim: set noet ts=4 sw=4:
@@ -0,0 +1,236 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+// Loopback test of unreliable updates: Updates are sent as datagrams through
+// a shim that drops and reorders them, and the receiver filters them like the
+// client does. Once the sender stops, the newest value of each key is sent
+// once more reliably, as replicate does for data that stopped changing, and
+// the datagrams held back by the shim are delivered after it. Fails if a
+// stale update is applied or a key doesn't end up at its newest value.
+#include "core/types.h"
+#include "core/log.h"
+#include "interface/udpsocket.h"
+#include "interface/datagram.h"
+#include "interface/os.h"
+#include <c55/getopt.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#define MODULE "udp_loss"
+
+namespace datagram = interface::datagram;
+
+struct TestOptions
+{
+	size_t num_updates = 100000;
+	size_t num_keys = 50;
+	int loss_percent = 30;
+	int reorder_percent = 20;
+	uint32_t seed = 1;
+	ss_ shim_port = "20101";
+	ss_ receiver_port = "20102";
+};
+
+struct Receiver
+{
+	datagram::LatestFilter filter;
+	sm_<uint32_t, uint64_t> values; // Applied; key -> value
+	size_t num_applied = 0;
+	size_t num_stale_applied = 0;
+
+	void apply(const datagram::Update &update)
+	{
+		if(!filter.accept(update))
+			return;
+		uint64_t value = strtoull(update.data.c_str(), nullptr, 10);
+		auto it = values.find(update.key);
+		// The settling update repeats the newest value
+		if(it != values.end() && it->second > value)
+			num_stale_applied++;
+		values[update.key] = value;
+		num_applied++;
+	}
+};
+
+// Returns false if the receive failed
+static bool receive_all(interface::UDPSocket &socket, Receiver &receiver)
+{
+	char buf[datagram::MAX_SIZE];
+	ssize_t r;
+	while((r = socket.receive_from(buf, sizeof buf, nullptr)) != -1){
+		datagram::Update update;
+		if(!datagram::read_update(buf, r, &update)){
+			log_e(MODULE, "Malformed update received");
+			return false;
+		}
+		receiver.apply(update);
+	}
+	return true;
+}
+
+static int run_test(const TestOptions &o)
+{
+	up_<interface::UDPSocket> sender(interface::createUDPSocket());
+	up_<interface::UDPSocket> shim_in(interface::createUDPSocket());
+	up_<interface::UDPSocket> shim_out(interface::createUDPSocket());
+	up_<interface::UDPSocket> receiver_socket(interface::createUDPSocket());
+	if(!shim_in->bind_fd("127.0.0.1", o.shim_port) ||
+			!receiver_socket->bind_fd("127.0.0.1", o.receiver_port) ||
+			!sender->connect_fd("127.0.0.1", o.shim_port) ||
+			!shim_out->connect_fd("127.0.0.1", o.receiver_port)){
+		log_e(MODULE, "Could not set up sockets on ports %s and %s",
+				cs(o.shim_port), cs(o.receiver_port));
+		return 1;
+	}
+
+	std::mt19937 rng(o.seed);
+	Receiver receiver;
+	sv_<ss_> held; // Delayed by the shim
+	size_t num_dropped = 0;
+	size_t num_reordered = 0;
+	uint32_t next_sequence = 0;
+	sm_<uint32_t, uint64_t> newest; // Sent; key -> value
+	char buf[datagram::MAX_SIZE];
+
+	int64_t t0 = interface::os::monotonic_us();
+	for(size_t i = 0; i < o.num_updates; i++){
+		datagram::Update update;
+		update.sequence = next_sequence++;
+		update.key = i % o.num_keys;
+		update.name = "test:position";
+		update.data = itos(i);
+		newest[update.key] = i;
+		ss_ d;
+		datagram::write_update(update, d);
+		sender->send_to(d.c_str(), d.size(), "");
+
+		// The shim passes on, drops or holds back what it has received
+		ssize_t r;
+		while((r = shim_in->receive_from(buf, sizeof buf, nullptr)) != -1){
+			int x = rng() % 100;
+			if(x < o.loss_percent){
+				num_dropped++;
+			} else if(x < o.loss_percent + o.reorder_percent){
+				held.push_back(ss_(buf, r));
+			} else {
+				shim_out->send_to(buf, r, "");
+				if(!held.empty() && rng() % 4 == 0){
+					std::shuffle(held.begin(), held.end(), rng);
+					for(const ss_ &h : held)
+						shim_out->send_to(h.c_str(), h.size(), "");
+					num_reordered += held.size();
+					held.clear();
+				}
+			}
+		}
+		if(!receive_all(*receiver_socket, receiver))
+			return 1;
+	}
+
+	// Settle: the newest value of each key goes reliably (as it would over
+	// TCP), after which the late datagrams still have to be dropped
+	for(auto &pair : newest){
+		datagram::Update update;
+		update.sequence = next_sequence++;
+		update.key = pair.first;
+		update.name = "test:position";
+		update.data = itos(pair.second);
+		ss_ d;
+		datagram::write_update(update, d);
+		datagram::Update parsed;
+		if(!datagram::read_update(d.c_str(), d.size(), &parsed)){
+			log_e(MODULE, "Could not parse a written update");
+			return 1;
+		}
+		receiver.apply(parsed);
+	}
+	for(const ss_ &h : held)
+		shim_out->send_to(h.c_str(), h.size(), "");
+	num_reordered += held.size();
+	held.clear();
+	// Loopback delivers right away but give it a moment anyway
+	interface::os::sleep_until_monotonic_us(
+			interface::os::monotonic_us() + 100000);
+	if(!receive_all(*receiver_socket, receiver))
+		return 1;
+	int64_t t1 = interface::os::monotonic_us();
+
+	size_t num_wrong = 0;
+	for(auto &pair : newest){
+		auto it = receiver.values.find(pair.first);
+		if(it == receiver.values.end() || it->second != pair.second)
+			num_wrong++;
+	}
+	printf("%zu updates of %zu keys in %ims: %zu dropped and %zu reordered "
+			"by the shim; %zu applied, %zu dropped as stale; %zu stale "
+			"applied, %zu keys not at their newest value\n",
+			o.num_updates, o.num_keys, (int)((t1 - t0) / 1000), num_dropped,
+			num_reordered, receiver.num_applied, receiver.filter.num_dropped,
+			receiver.num_stale_applied, num_wrong);
+	if(receiver.num_stale_applied != 0 || num_wrong != 0){
+		printf("FAILED\n");
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	TestOptions o;
+
+	const char opts[100] = "hn:k:l:r:s:p:";
+	const char usagefmt[1000] =
+			"Usage: %s [OPTION]...\n"
+			"  -h                   Show this help\n"
+			"  -n [integer]         Number of updates (default 100000)\n"
+			"  -k [integer]         Number of keys (default 50)\n"
+			"  -l [percent]         Datagrams dropped (default 30)\n"
+			"  -r [percent]         Datagrams reordered (default 20)\n"
+			"  -s [integer]         Random seed (default 1)\n"
+			"  -p [port]            First of the two loopback ports used\n"
+			"                       (default 20101)\n"
+			;
+
+	int c;
+	while((c = c55_getopt(argc, argv, opts)) != -1)
+	{
+		switch(c)
+		{
+		case 'h':
+			printf(usagefmt, argv[0]);
+			return 1;
+		case 'n':
+			o.num_updates = atoi(c55_optarg);
+			break;
+		case 'k':
+			o.num_keys = atoi(c55_optarg);
+			break;
+		case 'l':
+			o.loss_percent = atoi(c55_optarg);
+			break;
+		case 'r':
+			o.reorder_percent = atoi(c55_optarg);
+			break;
+		case 's':
+			o.seed = atoi(c55_optarg);
+			break;
+		case 'p':
+			o.shim_port = c55_optarg;
+			o.receiver_port = itos(atoi(c55_optarg) + 1);
+			break;
+		default:
+			fprintf(stderr, "ERROR: Invalid command-line argument\n");
+			fprintf(stderr, usagefmt, argv[0]);
+			return 1;
+		}
+	}
+	if(o.num_keys == 0 || o.loss_percent < 0 || o.reorder_percent < 0 ||
+			o.loss_percent + o.reorder_percent > 100){
+		fprintf(stderr, "ERROR: Invalid -k, -l or -r\n");
+		return 1;
+	}
+
+	return run_test(o);
+}
+// vim: set noet ts=4 sw=4:
@@ -17,6 +17,9 @@
 #include <CustomGeometry.h>
 #include <CollisionShape.h>
 #include <RigidBody.h>
+#include <Renderer.h>
+#include <Viewport.h>
+#include <Camera.h>
 #define MODULE "lua_bindings"
 
 namespace magic = Urho3D;
@@ -137,6 +140,32 @@ struct ScopeTimer {
 };
 #endif
 
+// Nodes nearer to the camera get their tasks run first
+static int get_task_priority(Node *node)
+{
+	Renderer *renderer = node->GetContext()->GetSubsystem<Renderer>();
+	if(!renderer)
+		return 0;
+	Viewport *viewport = renderer->GetViewport(0);
+	if(!viewport || !viewport->GetCamera())
+		return 0;
+	Node *camera_node = viewport->GetCamera()->GetNode();
+	Vector3 d = node->GetWorldPosition() - camera_node->GetWorldPosition();
+	return -(int)d.Length();
+}
+
+// Geometry and LOD geometry supersede each other as they replace the same
+// component
+static ss_ get_geometry_task_key(Node *node)
+{
+	return "geometry:"+itos(node->GetID());
+}
+
+static ss_ get_physics_task_key(Node *node)
+{
+	return "physics:"+itos(node->GetID());
+}
+
 struct SetVoxelGeometryTask: public interface::thread_pool::Task
 {
 	Node *node;
@@ -347,7 +376,10 @@ void set_voxel_geometry(const luabind::object &node_o,
 
 	auto *thread_pool = buildat_app->get_thread_pool();
 
-	thread_pool->add_task(std::move(task));
+	interface::thread_pool::TaskOptions options;
+	options.priority = get_task_priority(node);
+	options.supersede_key = get_geometry_task_key(node);
+	thread_pool->add_task(std::move(task), options);
 }
 
 void set_voxel_lod_geometry(int lod, const luabind::object &node_o,
@@ -379,7 +411,10 @@ void set_voxel_lod_geometry(int lod, const luabind::object &node_o,
 
 	auto *thread_pool = buildat_app->get_thread_pool();
 
-	thread_pool->add_task(std::move(task));
+	interface::thread_pool::TaskOptions options;
+	options.priority = get_task_priority(node);
+	options.supersede_key = get_geometry_task_key(node);
+	thread_pool->add_task(std::move(task), options);
 }
 
 void clear_voxel_geometry(const luabind::object &node_o)
@@ -390,6 +425,12 @@ void clear_voxel_geometry(const luabind::object &node_o)
 
 	log_d(MODULE, "clear_voxel_geometry(): node=%p", node);
 
+	// Don't let a pending task put the geometry back
+	lua_getfield(L, LUA_REGISTRYINDEX, "__buildat_app");
+	app::App *buildat_app = (app::App*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	buildat_app->get_thread_pool()->cancel_task(get_geometry_task_key(node));
+
 	CustomGeometry *cg = node->GetComponent<CustomGeometry>();
 	if(cg)
 		node->RemoveComponent(cg);
@@ -422,7 +463,10 @@ void set_voxel_physics_boxes(const luabind::object &node_o,
 
 	auto *thread_pool = buildat_app->get_thread_pool();
 
-	thread_pool->add_task(std::move(task));
+	interface::thread_pool::TaskOptions options;
+	options.priority = get_task_priority(node);
+	options.supersede_key = get_physics_task_key(node);
+	thread_pool->add_task(std::move(task), options);
 }
 
 void clear_voxel_physics_boxes(const luabind::object &node_o)
@@ -433,6 +477,12 @@ void clear_voxel_physics_boxes(const luabind::object &node_o)
 
 	log_d(MODULE, "clear_voxel_physics_boxes(): node=%p", node);
 
+	// Don't let a pending task put the boxes back
+	lua_getfield(L, LUA_REGISTRYINDEX, "__buildat_app");
+	app::App *buildat_app = (app::App*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	buildat_app->get_thread_pool()->cancel_task(get_physics_task_key(node));
+
 	RigidBody *body = node->GetComponent<RigidBody>();
 	if(body)
 		node->RemoveComponent(body);
@@ -2,7 +2,9 @@
 // Copyright 2014 Perttu Ahola <celeron55@gmail.com>
 #include "lua_bindings/util.h"
 #include "core/log.h"
+#include "client/app.h"
 #include "interface/fs.h"
+#include "interface/frame_scheduler.h"
 #include <c55/os.h>
 #define MODULE "lua_bindings"
 
@@ -87,6 +89,36 @@ static int l_get_time_us(lua_State *L)
 	return 1;
 }
 
+static interface::frame_scheduler::Scheduler* get_frame_scheduler(
+		lua_State *L)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, "__buildat_app");
+	app::App *buildat_app = (app::App*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return buildat_app->get_frame_scheduler();
+}
+
+// Takes a slice of the frame's main thread work budget; the returned amount
+// of time should be used in small steps, always doing at least one.
+// begin_work_slice(consumer_name: string) -> time_us: number
+static int l_begin_work_slice(lua_State *L)
+{
+	ss_ name = lua_tocppstring(L, 1);
+	auto *scheduler = get_frame_scheduler(L);
+	auto id = scheduler->register_consumer(name);
+	lua_pushnumber(L, (double)scheduler->begin_slice(id));
+	return 1;
+}
+
+// end_work_slice(consumer_name: string)
+static int l_end_work_slice(lua_State *L)
+{
+	ss_ name = lua_tocppstring(L, 1);
+	auto *scheduler = get_frame_scheduler(L);
+	scheduler->end_slice(scheduler->register_consumer(name));
+	return 0;
+}
+
 void init_misc(lua_State *L)
 {
 #define DEF_BUILDAT_FUNC(name){ \
@@ -98,6 +130,8 @@ void init_misc(lua_State *L)
 	DEF_BUILDAT_FUNC(pcall)
 	DEF_BUILDAT_FUNC(fatal_error)
 	DEF_BUILDAT_FUNC(get_time_us)
+	DEF_BUILDAT_FUNC(begin_work_slice)
+	DEF_BUILDAT_FUNC(end_work_slice)
 }
 
 } // namespace lua_bindingss
@@ -18,13 +18,83 @@ Config::Config()
 	set_default("compiler_command", "");
 
 	set_default("skip_compiling_modules", json::object());
+
+	// Optimization of runtime compiled modules: "debug", "release" or
+	// "release_lto". Changing this causes modules to be rebuilt.
+	set_default("rccpp_build_profile", "debug");
+	// Precompile headers used by most modules
+	set_default("rccpp_precompiled_header", true);
+	// Profile-guided optimization: "" (none), "generate" or "use"
+	set_default("rccpp_pgo", "");
+	// Profile data directory; empty = <rccpp_build_path>/pgo
+	set_default("rccpp_pgo_path", "");
+
+	// 0 = one worker thread per CPU
+	set_default("thread_pool_size", 0);
+	// Number of modules compiled in parallel at startup (0 = one per CPU)
+	set_default("module_compile_jobs", 0);
+	// Rates of the main loop: core:tick (simulation; also the physics rate),
+	// core:replication_tick and polling for modified modules
+	set_default("tick_rate_hz", 30);
+	set_default("replication_rate_hz", 30);
+	set_default("file_poll_rate_hz", 10);
+	// Time per tick given to background work done in main_context
+	set_default("main_thread_budget_us", 10000);
+
+	// Output queued for a client above which builtin/network drops packets
+	// sent with send_droppable(), and above which it disconnects the client
+	set_default("network_peer_high_water_bytes", 4 * 1024 * 1024);
+	set_default("network_peer_max_queue_bytes", 64 * 1024 * 1024);
+	// Packets sent to a client are collected for this long and then sent
+	// together, or once this many bytes have been collected (0 = send every
+	// packet right away). Packets on the realtime channel are never held.
+	set_default("network_coalesce_us", 1000);
+	set_default("network_coalesce_bytes", 64 * 1024);
+	// Larger packets are sent in fragments of this size so that packets of
+	// other channels can be sent in between
+	set_default("network_fragment_bytes", 16 * 1024);
+	// Output handed to the socket at a time; the rest waits in channels
+	set_default("network_send_window_bytes", 64 * 1024);
+	// Clients sending packets declared larger than this are disconnected
+	set_default("network_max_packet_bytes", 16 * 1024 * 1024);
+	// Threads that receive from clients, each handling a share of them
+	// (0 = one per CPU)
+	set_default("network_io_threads", 0);
+	// Packets at least this large are compressed with zlib if the client
+	// supports it. Streaming compresses all packets to a client in one zlib
+	// stream, which helps small packets but costs memory per client.
+	set_default("network_compression", true);
+	set_default("network_compression_min_bytes", 256);
+	set_default("network_compression_level", 1);
+	set_default("network_compression_streaming", false);
+	// Offer clients a UDP channel on the same port for updates sent with
+	// send_unreliable(); without it they are sent over TCP
+	set_default("network_udp", true);
+	// Every packet to and from clients is recorded into this file if set.
+	// The file is started over when the server starts; reloading the
+	// network module continues the recording.
+	set_default("network_record_path", "");
+	// A recording is replayed as clients of the server if set; speed 2
+	// replays twice as fast as recorded and 0 as fast as possible
+	set_default("network_replay_path", "");
+	set_default("network_replay_speed", 1.0);
+
+	// Module runtime statistics are logged and emitted as core:stats at this
+	// interval (0 = never), and written to the JSON file if a path is set
+	set_default("module_stats_interval_s", 10);
+	set_default("module_stats_json_path", "");
+
+	// Trace of event handling, direct callbacks, thread pool tasks and ticks
+	// in the Trace Event Format. Toggled at runtime by SIGUSR1.
+	set_default("trace_path", "buildat_trace.json");
+	set_default("trace_on_start", false);
 }
 
-bool Config::check_paths()
+bool Config::check_paths(bool need_compiler)
 {
-	bool ok = boot::autodetect::check_server_paths(*this, false);
+	bool ok = boot::autodetect::check_server_paths(*this, false, need_compiler);
 	if(!ok)
-		boot::autodetect::check_server_paths(*this, true);
+		boot::autodetect::check_server_paths(*this, true, need_compiler);
 	return ok;
 }
 
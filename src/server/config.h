@@ -10,7 +10,7 @@ namespace server
 	{
 		Config();
 
-		bool check_paths();
+		bool check_paths(bool need_compiler = true);
 	};
 }
 
@@ -7,10 +7,14 @@
 #include "boot/autodetect.h"
 #include "server/config.h"
 #include "server/state.h"
+#include "server/rccpp.h"
+#include "server/static_modules.h"
+#include "server/tick_scheduler.h"
 #include "interface/server.h"
 #include "interface/debug.h"
 #include "interface/mutex.h"
 #include "interface/os.h"
+#include "interface/trace.h"
 #include <c55/getopt.h>
 #include <c55/os.h>
 #include <iostream>
@@ -38,11 +42,21 @@ void sigint_handler(int sig)
 	}
 }
 
+volatile sig_atomic_t g_trace_toggle_requested = 0;
+
+#ifndef _WIN32
+void sigusr1_handler(int sig)
+{
+	g_trace_toggle_requested = 1;
+}
+#endif
+
 void signal_handler_init()
 {
 	(void)signal(SIGINT, sigint_handler);
 #ifndef _WIN32
 	(void)signal(SIGPIPE, SIG_IGN);
+	(void)signal(SIGUSR1, sigusr1_handler);
 #endif
 }
 
@@ -54,8 +68,8 @@ int main(int argc, char *argv[])
 
 	std::string module_path;
 
-	const char opts[100] = "hm:r:i:S:U:c:l:L:C:";
-	const char usagefmt[1000] =
+	const char opts[100] = "hm:r:i:S:U:c:l:L:C:t:j:b:P:T:R:Y:y:";
+	const char usagefmt[1500] =
 			"Usage: %s [OPTION]...\n"
 			"  -h                   Show this help\n"
 			"  -m [module_path]     Specify module path\n"
@@ -67,6 +81,16 @@ int main(int argc, char *argv[])
 			"  -l [integer]         Set maximum log level (0...5)\n"
 			"  -L [log file path]   Append log to a specified file\n"
 			"  -C [module_name]     Skip compiling specified module\n"
+			"  -t [integer]         Set number of worker threads (0 = auto)\n"
+			"  -j [integer]         Set number of parallel module compiles (0 = auto)\n"
+			"  -b [profile]         Set module build profile (debug, release,\n"
+			"                       release_lto)\n"
+			"  -P [mode]            Set module PGO mode (generate, use)\n"
+			"  -T [trace file path] Write a trace from startup (SIGUSR1 toggles\n"
+			"                       tracing at runtime)\n"
+			"  -R [path]            Record network sessions into a file\n"
+			"  -Y [path]            Replay a recording as clients\n"
+			"  -y [speed]           Set replay speed (0 = as fast as possible)\n"
 			;
 
 	int c;
@@ -116,6 +140,39 @@ int main(int argc, char *argv[])
 				config.set("skip_compiling_modules", v);
 			}
 			break;
+		case 't':
+			log_i(MODULE, "config.thread_pool_size: %s", c55_optarg);
+			config.set("thread_pool_size", atoi(c55_optarg));
+			break;
+		case 'j':
+			log_i(MODULE, "config.module_compile_jobs: %s", c55_optarg);
+			config.set("module_compile_jobs", atoi(c55_optarg));
+			break;
+		case 'b':
+			log_i(MODULE, "config.rccpp_build_profile: %s", c55_optarg);
+			config.set("rccpp_build_profile", c55_optarg);
+			break;
+		case 'P':
+			log_i(MODULE, "config.rccpp_pgo: %s", c55_optarg);
+			config.set("rccpp_pgo", c55_optarg);
+			break;
+		case 'T':
+			log_i(MODULE, "config.trace_path: %s", c55_optarg);
+			config.set("trace_path", c55_optarg);
+			config.set("trace_on_start", true);
+			break;
+		case 'R':
+			log_i(MODULE, "config.network_record_path: %s", c55_optarg);
+			config.set("network_record_path", c55_optarg);
+			break;
+		case 'Y':
+			log_i(MODULE, "config.network_replay_path: %s", c55_optarg);
+			config.set("network_replay_path", c55_optarg);
+			break;
+		case 'y':
+			log_i(MODULE, "config.network_replay_speed: %s", c55_optarg);
+			config.set("network_replay_speed", atof(c55_optarg));
+			break;
 		default:
 			fprintf(stderr, "ERROR: Invalid command-line argument\n");
 			fprintf(stderr, usagefmt, argv[0]);
@@ -125,10 +182,15 @@ int main(int argc, char *argv[])
 
 	std::cerr<<"Buildat server"<<std::endl;
 
-	if(!boot::autodetect::detect_server_paths(config))
+	// A precompiled server has its modules linked in
+	bool need_compiler = server::get_static_modules().empty();
+	if(!need_compiler)
+		log_i(MODULE, "Precompiled server; modules are not compiled at runtime");
+
+	if(!boot::autodetect::detect_server_paths(config, need_compiler))
 		return 1;
 
-	if(!config.check_paths()){
+	if(!config.check_paths(need_compiler)){
 		return 1;
 	}
 
@@ -137,17 +199,61 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	{
+		rccpp::BuildProfile profile;
+		if(!rccpp::get_build_profile(config.get<ss_>("rccpp_build_profile"),
+				config.get<ss_>("rccpp_pgo"), "", &profile)){
+			std::cerr<<"Invalid module build profile (-b) or PGO mode (-P)"
+					<<std::endl;
+			return 1;
+		}
+	}
+
 	int exit_status = 0;
 	ss_ shutdown_reason;
 
+	interface::trace::set_thread_name("main");
+	if(config.get<bool>("trace_on_start"))
+		interface::trace::start(config.get<ss_>("trace_path"));
+
 	try {
+		// Outlives the state as module threads report the times they take to
+		// handle ticks into it
+		up_<server::TickScheduler> scheduler(server::createTickScheduler());
 		up_<server::State> state(server::createState());
 
 		state->load_modules(module_path);
 
 		// Main loop
-		uint64_t next_tick_us = get_timeofday_us();
-		uint64_t t_per_tick = 1000000 / 30; // Same as physics FPS
+		int64_t tick_period_us = 1000000 / config.get<int64_t>("tick_rate_hz");
+		int64_t replication_period_us =
+				1000000 / config.get<int64_t>("replication_rate_hz");
+		int64_t file_poll_period_us =
+				1000000 / config.get<int64_t>("file_poll_rate_hz");
+		server::TickTimerId tick_timer =
+				scheduler->add_timer("simulation", tick_period_us);
+		server::TickTimerId replication_timer =
+				scheduler->add_timer("replication", replication_period_us);
+		server::TickTimerId file_poll_timer =
+				scheduler->add_timer("file_polling", file_poll_period_us);
+		// Ticks are handled by the module threads
+		state->set_tick_handled_cb([&scheduler, tick_timer, replication_timer](
+				const interface::Event::Type &type, int64_t emitted_us,
+				int64_t tick_us){
+			static const interface::Event::Type tick_type =
+					interface::Event::t("core:tick");
+			scheduler->add_tick_time(type == tick_type ? tick_timer :
+					replication_timer, emitted_us, tick_us);
+		});
+		auto emit_tick = [&](const char *name, int64_t period_us){
+			interface::trace::SpanScope trace_span("tick", name);
+			state->emit_event(interface::Event(name,
+					new interface::TickEvent(period_us / 1e6,
+					interface::os::time_us())));
+		};
+		int64_t stats_interval_us =
+				config.get<int64_t>("module_stats_interval_s") * 1000000;
+		int64_t last_stats_us = interface::os::monotonic_us();
 
 		for(;;){
 			{
@@ -155,24 +261,35 @@ int main(int argc, char *argv[])
 				if(g_sigint_received)
 					break;
 			}
-			uint64_t current_us = get_timeofday_us();
-			int64_t delay_us = next_tick_us - current_us;
-			if(delay_us < 0)
-				delay_us = 0;
-
-			usleep(delay_us);
+			if(g_trace_toggle_requested){
+				g_trace_toggle_requested = 0;
+				if(interface::trace::is_enabled())
+					interface::trace::stop();
+				else
+					interface::trace::start(config.get<ss_>("trace_path"));
+			}
 
-			state->handle_events();
+			scheduler->sleep_until_next(100000);
 
-			if(current_us >= next_tick_us){
-				next_tick_us += t_per_tick;
-				if(next_tick_us < current_us - 1000 * 1000){
-					log_w("main", "Skipping %zuus", current_us - next_tick_us);
-					next_tick_us = current_us;
+			for(server::TickTimerId id : scheduler->take_due()){
+				if(id == tick_timer){
+					emit_tick("core:tick", tick_period_us);
+				} else if(id == replication_timer){
+					emit_tick("core:replication_tick", replication_period_us);
+				} else if(id == file_poll_timer){
+					interface::trace::SpanScope trace_span(
+							"main", "handle_events");
+					state->handle_events();
+					scheduler->end_tick(id);
 				}
-				interface::Event event("core:tick",
-						new interface::TickEvent(t_per_tick / 1e6));
-				state->emit_event(std::move(event));
+			}
+
+			int64_t now_us = interface::os::monotonic_us();
+			if(stats_interval_us > 0 &&
+					now_us - last_stats_us >= stats_interval_us){
+				last_stats_us = now_us;
+				log_v(MODULE, "Main loop:\n%s", cs(server::format_tick_stats(
+						scheduler->get_stats())));
 			}
 
 			if(state->is_shutdown_requested(&exit_status, &shutdown_reason))
@@ -185,6 +302,8 @@ int main(int argc, char *argv[])
 		log_v(MODULE, "ServerShutdownRequest: %s", e.what());
 	}
 
+	interface::trace::stop();
+
 	if(shutdown_reason != ""){
 		if(exit_status != 0)
 			log_w(MODULE, "Shutdown: %s", cs(shutdown_reason));
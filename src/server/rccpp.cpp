@@ -5,6 +5,7 @@
 #include "interface/server.h"
 #include "interface/process.h"
 #include "interface/fs.h"
+#include "interface/sha1.h"
 #include <c55/filesys.h>
 #include <vector>
 #include <string>
@@ -28,6 +29,8 @@
 #include <string>
 #include <unordered_map>
 #include <algorithm>
+#include <fstream>
+#include <cstdio>
 #define MODULE "__rccpp"
 
 namespace rccpp {
@@ -67,10 +70,10 @@ static const char* library_error(){
 }
 #endif
 
-typedef void*(*RCCPP_Constructor)(interface::Server * server);
+typedef ModuleConstructor RCCPP_Constructor;
 
 struct RCCPP_Info {
-	void *module;
+	void *module; // nullptr for static modules
 	RCCPP_Constructor constructor;
 };
 
@@ -78,32 +81,25 @@ struct CCompiler: public Compiler
 {
 	ss_ m_compiler_command;
 	std::unordered_map<std::string, RCCPP_Info> m_module_info;
+	std::unordered_map<std::string, RCCPP_Constructor> m_static_modules;
+	ss_ m_pch_header_path; // Included in every module if not empty
 
 	CCompiler(const ss_ &compiler_command):
 		m_compiler_command(compiler_command)
 	{
 	}
 
-	bool compile(const std::string &in_path, const std::string &out_path,
-			const ss_ &extra_cxxflags, const ss_ &extra_ldflags)
+	// Flags that have to be the same for modules and the precompiled header
+	ss_ get_common_cxxflags()
 	{
-		ss_ command = m_compiler_command;
-		command += " -DRCCPP -g -fPIC -fvisibility=hidden -shared";
-		command += " -std=c++11";
-		if(extra_cxxflags != "")
-			command += ss_()+" "+extra_cxxflags;
-
-		for(const std::string &dir : include_directories) command += " -I"+dir;
-		for(const std::string &dir : library_directories) command += " -L"+dir;
-
-		command += " -o"+out_path;
-		command += " "+in_path;
-
-		if(extra_ldflags != "")
-			command += ss_()+" "+extra_ldflags;
-
-		for(const std::string &lib : libraries) command += " "+lib;
+		ss_ flags = " -DRCCPP -fPIC -fvisibility=hidden -std=c++11";
+		if(profile_cxxflags != "")
+			flags += " "+profile_cxxflags;
+		return flags;
+	}
 
+	bool run_compiler(const ss_ &command)
+	{
 		interface::process::ExecOptions exec_opts;
 #ifdef _WIN32
 		// If compiler_command looks like a path, add the directory part of it to
@@ -124,17 +120,127 @@ struct CCompiler: public Compiler
 		return exit_status == 0;
 	}
 
+	bool compile(const std::string &in_path, const std::string &out_path,
+			const ss_ &extra_cxxflags, const ss_ &extra_ldflags)
+	{
+		std::string out_dir = c55fs::stripFilename(out_path);
+		c55fs::CreateAllDirs(out_dir);
+
+		ss_ command = m_compiler_command;
+		command += get_common_cxxflags();
+		command += " -shared";
+		// The compiler falls back to parsing the header itself if the
+		// precompiled one doesn't fit the flags
+		if(m_pch_header_path != "")
+			command += " -include \""+m_pch_header_path+"\"";
+		if(extra_cxxflags != "")
+			command += ss_()+" "+extra_cxxflags;
+
+		for(const std::string &dir : include_directories) command += " -I"+dir;
+		for(const std::string &dir : library_directories) command += " -L"+dir;
+
+		command += " -o"+out_path;
+		command += " "+in_path;
+
+		if(extra_ldflags != "")
+			command += ss_()+" "+extra_ldflags;
+		if(profile_ldflags != "")
+			command += " "+profile_ldflags;
+
+		for(const std::string &lib : libraries) command += " "+lib;
+
+		return run_compiler(command);
+	}
+
+	bool prepare_pch(const ss_ &header_path, const ss_ &build_path,
+			const ss_ &content_hash)
+	{
+		m_pch_header_path = "";
+
+		ss_ flags = get_common_cxxflags();
+		for(const std::string &dir : include_directories) flags += " -I"+dir;
+		ss_ key = interface::sha1::hex(interface::sha1::calculate(
+				m_compiler_command+"\n"+flags+"\n"+content_hash));
+
+		// The precompiled header has to be next to a header of the same name
+		// that is then included
+		ss_ pch_dir = build_path+"/pch_"+key;
+		ss_ pch_header_path = pch_dir+"/"+
+				header_path.substr(header_path.find_last_of("/\\") + 1);
+		ss_ gch_path = pch_header_path+".gch";
+
+		if(std::ifstream(gch_path).good() &&
+				std::ifstream(pch_header_path).good()){
+			log_v(MODULE, "Using existing precompiled header %s",
+					cs(gch_path));
+			m_pch_header_path = pch_header_path;
+			delete_old_pchs(build_path, pch_dir);
+			return true;
+		}
+
+		c55fs::CreateAllDirs(pch_dir);
+		{
+			std::ifstream src(header_path, std::ios::binary);
+			std::ofstream dst(pch_header_path, std::ios::binary);
+			if(!src.good() || !dst.good()){
+				log_w(MODULE, "Failed to copy %s to %s", cs(header_path),
+						cs(pch_header_path));
+				return false;
+			}
+			dst<<src.rdbuf();
+		}
+
+		log_i(MODULE, "Generating precompiled header %s", cs(gch_path));
+		ss_ command = m_compiler_command;
+		command += flags;
+		command += " -x c++-header";
+		command += " -o"+gch_path;
+		command += " "+pch_header_path;
+		if(!run_compiler(command)){
+			log_w(MODULE, "Failed to generate precompiled header");
+			// Don't leave a partial one lying around
+			remove(gch_path.c_str());
+			return false;
+		}
+		m_pch_header_path = pch_header_path;
+		delete_old_pchs(build_path, pch_dir);
+		return true;
+	}
+
+	// A new directory is made whenever the compiler, its flags or the header
+	// change; the old ones would never be used again
+	void delete_old_pchs(const ss_ &build_path, const ss_ &keep_dir)
+	{
+		for(const interface::fs::Node &node :
+				interface::fs::list_directory(build_path)){
+			if(!node.is_directory || node.name.compare(0, 4, "pch_") != 0)
+				continue;
+			ss_ dir = build_path+"/"+node.name;
+			if(dir == keep_dir)
+				continue;
+			log_v(MODULE, "Deleting old precompiled header %s", cs(dir));
+			if(!c55fs::RecursiveDelete(interface::fs::get_absolute_path(dir)))
+				log_w(MODULE, "Failed to delete %s", cs(dir));
+		}
+	}
+
 	bool build(const std::string &module_name,
 			const std::string &in_path, const std::string &out_path,
 			const ss_ &extra_cxxflags, const ss_ &extra_ldflags,
 			bool skip_compile)
 	{
+		auto static_it = m_static_modules.find(module_name);
+		if(static_it != m_static_modules.end()){
+			log_d(MODULE, "Using precompiled %s", cs(module_name));
+			RCCPP_Info &funcs = m_module_info[module_name];
+			funcs.constructor = static_it->second;
+			funcs.module = nullptr;
+			return true;
+		}
+
 		log_nd(MODULE, "Building %s: %s -> %s... ", cs(module_name), cs(in_path),
 				cs(out_path));
 
-		std::string out_dir = c55fs::stripFilename(out_path);
-		c55fs::CreateAllDirs(out_dir);
-
 		if(skip_compile){
 			log_d(MODULE, "Skipped");
 		} else {
@@ -196,9 +302,21 @@ struct CCompiler: public Compiler
 			return;
 		}
 		void *module = it->second.module;
-		library_unload(module);
+		if(module)
+			library_unload(module);
 		m_module_info.erase(module_name);
 	}
+
+	void add_static_module(const ss_ &module_name,
+			ModuleConstructor constructor)
+	{
+		m_static_modules[module_name] = constructor;
+	}
+
+	bool is_static_module(const ss_ &module_name)
+	{
+		return m_static_modules.count(module_name) != 0;
+	}
 };
 
 Compiler* createCompiler(const ss_ &compiler_command)
@@ -206,5 +324,37 @@ Compiler* createCompiler(const ss_ &compiler_command)
 	return new CCompiler(compiler_command);
 }
 
+bool get_build_profile(const ss_ &name, const ss_ &pgo_mode,
+		const ss_ &pgo_path, BuildProfile *profile)
+{
+	if(name == "debug"){
+		profile->cxxflags = "-g";
+		profile->ldflags = "";
+	} else if(name == "release"){
+		profile->cxxflags = "-O2 -DNDEBUG";
+		profile->ldflags = "";
+	} else if(name == "release_lto"){
+		// The module is compiled and linked by the same command, so -flto has
+		// to be given to both
+		profile->cxxflags = "-O2 -DNDEBUG -flto";
+		profile->ldflags = "-flto";
+	} else {
+		return false;
+	}
+	if(pgo_mode == ""){
+	} else if(pgo_mode == "generate"){
+		profile->cxxflags += " -fprofile-generate=\""+pgo_path+"\"";
+		profile->ldflags += " -fprofile-generate=\""+pgo_path+"\"";
+	} else if(pgo_mode == "use"){
+		// Modules that were not covered by the workload only have partial
+		// or no profile data; that is not an error
+		profile->cxxflags += " -fprofile-use=\""+pgo_path+"\""
+				" -fprofile-correction -Wno-missing-profile";
+	} else {
+		return false;
+	}
+	return true;
+}
+
 } // rccpp
 // vim: set noet ts=4 sw=4:
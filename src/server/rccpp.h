@@ -9,9 +9,18 @@ namespace interface {
 
 namespace rccpp
 {
+	typedef void*(*ModuleConstructor)(interface::Server *server);
+
 	struct Compiler {
 		virtual ~Compiler(){}
 
+		// Only runs the compiler; does not touch loaded modules. Can be called
+		// from multiple threads at once as long as the directory and library
+		// lists are not modified meanwhile.
+		virtual bool compile(const std::string &in_path,
+				const std::string &out_path,
+				const ss_ &extra_cxxflags = "", const ss_ &extra_ldflags = "") = 0;
+
 		virtual bool build(const std::string &module_name,
 				const std::string &in_path, const std::string &out_path,
 				const ss_ &extra_cxxflags = "", const ss_ &extra_ldflags = "",
@@ -19,13 +28,43 @@ namespace rccpp
 
 		virtual void* construct(const char *name, interface::Server *server) = 0;
 
+		// Precompiles the header into build_path, or reuses one generated
+		// earlier with the same compiler, flags and content_hash. Modules
+		// compiled afterwards include it first. On failure modules are
+		// compiled without it.
+		virtual bool prepare_pch(const ss_ &header_path, const ss_ &build_path,
+				const ss_ &content_hash) = 0;
+
 		virtual void unload(const std::string &module_name) = 0;
 
+		// A module that is linked into the executable. build() just makes it
+		// available to construct() without compiling or loading anything.
+		virtual void add_static_module(const ss_ &module_name,
+				ModuleConstructor constructor) = 0;
+		virtual bool is_static_module(const ss_ &module_name) = 0;
+
 		std::vector<std::string> include_directories;
 		std::vector<std::string> library_directories;
 		std::vector<std::string> libraries;
+		// Used for every module; see get_build_profile()
+		ss_ profile_cxxflags = "-g";
+		ss_ profile_ldflags;
 	};
 
 	Compiler* createCompiler(const ss_ &compiler_command);
+
+	struct BuildProfile
+	{
+		ss_ cxxflags;
+		ss_ ldflags;
+	};
+
+	// Profiles: "debug", "release" and "release_lto".
+	// pgo_mode is "" (none), "generate" (build instrumented modules that write
+	// profile data into pgo_path when the server exits) or "use" (optimize
+	// using the profile data in pgo_path).
+	// Returns false if the profile or the PGO mode is unknown.
+	bool get_build_profile(const ss_ &name, const ss_ &pgo_mode,
+			const ss_ &pgo_path, BuildProfile *profile);
 }
 // vim: set noet ts=4 sw=4:
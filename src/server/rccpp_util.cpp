@@ -51,6 +51,26 @@ sv_<ss_> list_includes(const ss_ &path, const sv_<ss_> &include_dirs)
 	return result;
 }
 
+sv_<ss_> list_includes_recursive(const ss_ &path,
+		const sv_<ss_> &include_dirs)
+{
+	sv_<ss_> result;
+	set_<ss_> seen;
+	sv_<ss_> to_check = {path};
+	while(!to_check.empty()){
+		ss_ checked_path = to_check.back();
+		to_check.pop_back();
+		for(const ss_ &include : list_includes(checked_path, include_dirs)){
+			if(seen.count(include))
+				continue;
+			seen.insert(include);
+			result.push_back(include);
+			to_check.push_back(include);
+		}
+	}
+	return result;
+}
+
 ss_ hash_files(const sv_<ss_> &paths)
 {
 	std::ostringstream os(std::ios::binary);
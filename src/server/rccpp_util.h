@@ -6,6 +6,9 @@
 namespace server
 {
 	sv_<ss_> list_includes(const ss_ &path, const sv_<ss_> &include_dirs);
+	// Follows includes of included files too; every file is listed once
+	sv_<ss_> list_includes_recursive(const ss_ &path,
+			const sv_<ss_> &include_dirs);
 	ss_ hash_files(const sv_<ss_> &paths);
 }
 // vim: set noet ts=4 sw=4:
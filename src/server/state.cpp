@@ -4,11 +4,14 @@
 #include "core/log.h"
 #include "rccpp.h"
 #include "rccpp_util.h"
+#include "static_modules.h"
 #include "config.h"
 #include "interface/module.h"
 #include "interface/module_info.h"
 #include "interface/server.h"
 #include "interface/event.h"
+#include "interface/event_pool.h"
+#include "interface/trace.h"
 #include "interface/file_watch.h"
 #include "interface/fs.h"
 #include "interface/sha1.h"
@@ -69,9 +72,17 @@ struct ModuleContainer
 	// Allows directly executing code in the module thread
 	const std::function<void(interface::Module*)> *direct_cb = nullptr;
 	std::exception_ptr direct_cb_exception = nullptr;
+	int64_t direct_cb_exec_us = 0;
 	// The actual event queue
 	std::deque<Event> event_queue; // Push back, pop front
-	// Protects direct_cb and event_queue
+	// Number of events ever popped from event_queue; the event with sequence
+	// number n is at event_queue[n - event_queue_num_popped]
+	size_t event_queue_num_popped = 0;
+	// Sequence numbers of the last queued coalescable event of each type
+	sm_<Event::Type, size_t> coalescable_event_seqs;
+	size_t num_coalesced_events = 0;
+	size_t max_event_queue_length = 0;
+	// Protects direct_cb and the event queue variables above
 	interface::Mutex event_queue_mutex;
 	// Counts queued events, and +1 for direct_cb
 	interface::Semaphore event_queue_sem;
@@ -88,6 +99,16 @@ struct ModuleContainer
 	// Set to true when deleting the module; used for enforcing some limitations
 	bool executing_module_destructor = false;
 
+	// Accessed only by the module thread
+	int64_t last_tick_lag_warning_us = 0;
+
+	// Runtime statistics
+	sm_<Event::Type, interface::EventTypeStats> event_stats;
+	sm_<ss_, interface::DirectCbStats> direct_cb_stats; // By caller name
+	size_t num_events_handled = 0;
+	int64_t last_tick_lag_us = 0;
+	interface::Mutex stats_mutex; // Protects each of the former variables
+
 	ModuleContainer(interface::Server *server = nullptr,
 			interface::ThreadLocalKey *thread_local_key = NULL,
 			interface::Module *module = NULL,
@@ -162,7 +183,34 @@ struct ModuleContainer
 	}
 	void push_event(const Event &event){
 		interface::MutexScope ms(event_queue_mutex);
+		push_event_u(event);
+	}
+	void push_events(const sv_<const Event*> &events){
+		interface::MutexScope ms(event_queue_mutex);
+		for(const Event *event : events)
+			push_event_u(*event);
+	}
+	void push_event_u(const Event &event){
+		if(dynamic_cast<const Event::CoalescablePrivate*>(event.p.get())){
+			// Merge into the last one of the same type if nothing has been
+			// queued after it; merging past other events would reorder them
+			auto it = coalescable_event_seqs.find(event.type);
+			if(it != coalescable_event_seqs.end() && !event_queue.empty() &&
+					it->second == event_queue_num_popped +
+							event_queue.size() - 1){
+				Event &older = event_queue[it->second - event_queue_num_popped];
+				auto *older_p = dynamic_cast<const Event::CoalescablePrivate*>(
+						older.p.get());
+				older.p.reset(older_p->coalesce(*event.p));
+				num_coalesced_events++;
+				return;
+			}
+			coalescable_event_seqs[event.type] =
+					event_queue_num_popped + event_queue.size();
+		}
 		event_queue.push_back(event);
+		if(event_queue.size() > max_event_queue_length)
+			max_event_queue_length = event_queue.size();
 		event_queue_sem.post();
 	}
 	void emit_event_sync(const Event &event){
@@ -178,6 +226,7 @@ struct ModuleContainer
 	{
 		if(caller_mc == this) // Not allowed
 			throw Exception("caller_mc == this");
+		int64_t t0 = interface::os::time_us();
 		log_t(MODULE, "execute_direct_cb[%s]: Waiting for direct_cb to be free",
 				cs(info.name));
 		direct_cb_free_sem.wait(); // Wait for direct_cb to be free
@@ -222,9 +271,24 @@ struct ModuleContainer
 		// Grab execution result
 		std::exception_ptr eptr = direct_cb_exception;
 		direct_cb_exception = nullptr; // Not to be used anymore
+		int64_t exec_us = direct_cb_exec_us;
 		thread->set_caller_thread(nullptr);
 		// Set direct_cb to be free again
 		direct_cb_free_sem.post();
+		// Record time taken
+		{
+			int64_t total_us = interface::os::time_us() - t0;
+			ss_ caller_name = caller_mc ? caller_mc->info.name : "__unknown";
+			if(interface::trace::is_enabled()){
+				interface::trace::record("direct_cb", "wait M["+info.name+"]",
+						t0, total_us - exec_us);
+			}
+			interface::MutexScope ms(stats_mutex);
+			interface::DirectCbStats &stats = direct_cb_stats[caller_name];
+			stats.count++;
+			stats.exec_us += exec_us;
+			stats.wait_us += total_us - exec_us;
+		}
 		// Handle execution result
 		if(eptr){
 			log_t(MODULE, "execute_direct_cb[%s]: Execution finished by"
@@ -260,6 +324,7 @@ void ModuleThread::run(interface::Thread *thread)
 			} else if(!mc->event_queue.empty()){
 				event = mc->event_queue.front();
 				mc->event_queue.pop_front();
+				mc->event_queue_num_popped++;
 				got_event = true;
 			}
 		}
@@ -276,7 +341,12 @@ void ModuleThread::run(interface::Thread *thread)
 				mc->direct_cb_executed_sem.post();
 			}
 			if(got_event){
-				log_t(MODULE, "M[%s]: Discarding event", cs(mc->info.name));
+				// Put it back; a reloaded version of the module takes over
+				// whatever is left in the queue
+				log_t(MODULE, "M[%s]: Leaving event in queue", cs(mc->info.name));
+				interface::MutexScope ms(mc->event_queue_mutex);
+				mc->event_queue.push_front(event);
+				mc->event_queue_num_popped--;
 			}
 			// Stop
 			break;
@@ -318,6 +388,12 @@ void ModuleThread::handle_direct_cb(
 		const std::function<void(interface::Module*)> *direct_cb)
 {
 	std::exception_ptr eptr = nullptr;
+	int64_t t0 = interface::os::time_us();
+	ss_ trace_name;
+	if(interface::trace::is_enabled()){
+		interface::Thread *caller = mc->thread->get_caller_thread();
+		trace_name = "direct_cb from "+(caller ? caller->get_name() : "main");
+	}
 	if(!mc->module){
 		log_w(MODULE, "M[%s]: Module is null; cannot"
 				" call direct callback", cs(mc->info.name));
@@ -359,16 +435,68 @@ void ModuleThread::handle_direct_cb(
 			}
 		}
 	}
+	int64_t exec_us = interface::os::time_us() - t0;
+	if(!trace_name.empty())
+		interface::trace::record("direct_cb", trace_name, t0, exec_us);
 	{
 		interface::MutexScope ms(mc->event_queue_mutex);
 		mc->direct_cb = nullptr;
 		mc->direct_cb_exception = eptr;
+		mc->direct_cb_exec_us = exec_us;
 	}
 	mc->direct_cb_executed_sem.post();
 }
 
+// Warns about modules that are so slow at handling core:tick that ticks are
+// being coalesced and delayed
+static void check_tick_lag(ModuleContainer *mc, const interface::TickEvent &tick)
+{
+	if(tick.emitted_us == 0)
+		return;
+	int64_t now_us = interface::os::time_us();
+	int64_t lag_us = now_us - tick.emitted_us;
+	{
+		interface::MutexScope ms(mc->stats_mutex);
+		mc->last_tick_lag_us = lag_us;
+	}
+	if(tick.num_ticks <= 1 || lag_us < 500000 ||
+			now_us - mc->last_tick_lag_warning_us < 10000000)
+		return;
+	mc->last_tick_lag_warning_us = now_us;
+	size_t num_coalesced = 0;
+	{
+		interface::MutexScope ms(mc->event_queue_mutex);
+		num_coalesced = mc->num_coalesced_events;
+	}
+	log_w(MODULE, "M[%s]: Lagging behind by %ims (%zu ticks in one; "
+			"%zu events coalesced in total)", cs(mc->info.name),
+			(int)(lag_us / 1000), tick.num_ticks, num_coalesced);
+}
+
+static void report_tick_handled(ModuleContainer *mc, const Event::Type &type,
+		const interface::TickEvent &tick);
+
 void ModuleThread::handle_event(Event &event)
 {
+	static const Event::Type tick_type = Event::t("core:tick");
+	static const Event::Type replication_tick_type =
+			Event::t("core:replication_tick");
+	if(event.type == tick_type){
+		auto *tick = dynamic_cast<const interface::TickEvent*>(event.p.get());
+		if(tick){
+			check_tick_lag(mc, *tick);
+			if(tick->emitted_us != 0 && interface::trace::is_enabled()){
+				interface::trace::record("tick", "core:tick (queued)",
+						tick->emitted_us,
+						interface::os::time_us() - tick->emitted_us);
+			}
+		}
+	}
+	ss_ trace_name;
+	if(interface::trace::is_enabled())
+		trace_name = interface::getGlobalEventRegistry()->name(event.type);
+	interface::trace::SpanScope trace_span("event", trace_name);
+	int64_t t0 = interface::os::time_us();
 	if(!mc->module){
 		log_w(MODULE, "M[%s]: Module is null; cannot"
 				" handle event", cs(mc->info.name));
@@ -398,8 +526,113 @@ void ModuleThread::handle_event(Event &event)
 			}
 		}
 	}
+	int64_t handling_us = interface::os::time_us() - t0;
+	if(event.type == tick_type || event.type == replication_tick_type){
+		auto *tick = dynamic_cast<const interface::TickEvent*>(event.p.get());
+		if(tick && tick->emitted_us != 0)
+			report_tick_handled(mc, event.type, *tick);
+	}
+	interface::MutexScope ms(mc->stats_mutex);
+	interface::EventTypeStats &stats = mc->event_stats[event.type];
+	stats.count++;
+	stats.total_us += handling_us;
+	if(handling_us > stats.max_us)
+		stats.max_us = handling_us;
+	mc->num_events_handled++;
 }
 
+struct ModuleBuildInfo
+{
+	ss_ init_cpp_path;
+	sv_<ss_> includes;
+	ss_ extra_cxxflags;
+	ss_ extra_ldflags;
+	ss_ content_hash;
+	ss_ build_dst;
+	ss_ hashfile_path;
+	bool skip_compile = false; // Up to date or skipped by configuration
+};
+
+struct CompileJob
+{
+	ss_ name;
+	ModuleBuildInfo build;
+	bool ok = false;
+};
+
+// Events emitted for a module while it is being swapped to a new version
+struct HeldEvents
+{
+	set_<Event::Type> types; // Subscriptions of the old version
+	sv_<Event> events;
+};
+
+// Hands out compile jobs to whichever thread asks first
+struct CompileQueue
+{
+	rccpp::Compiler *m_compiler;
+	sv_<CompileJob> *m_jobs;
+	size_t m_next_job = 0;
+	interface::Mutex m_mutex; // Protects m_next_job
+
+	CompileQueue(rccpp::Compiler *compiler, sv_<CompileJob> *jobs):
+		m_compiler(compiler),
+		m_jobs(jobs)
+	{}
+
+	void run()
+	{
+		for(;;){
+			CompileJob *job = nullptr;
+			{
+				interface::MutexScope ms(m_mutex);
+				if(m_next_job == m_jobs->size())
+					return;
+				job = &(*m_jobs)[m_next_job++];
+			}
+			log_v(MODULE, "Compiling %s", cs(job->name));
+			job->ok = m_compiler->compile(job->build.init_cpp_path,
+					job->build.build_dst, job->build.extra_cxxflags,
+					job->build.extra_ldflags);
+			if(!job->ok)
+				log_w(MODULE, "Failed to compile module %s", cs(job->name));
+		}
+	}
+};
+
+struct CompileThread: public interface::ThreadedThing
+{
+	CompileQueue *m_queue;
+
+	CompileThread(CompileQueue *queue):
+		m_queue(queue)
+	{}
+
+	void run(interface::Thread *thread)
+	{
+		m_queue->run();
+	}
+
+	void on_crash(interface::Thread *thread)
+	{
+		// The jobs this thread took stay marked as failed
+	}
+};
+
+// A new version of a module being compiled in the background while the old
+// one keeps running
+struct ReloadBuild
+{
+	interface::ModuleInfo info;
+	sv_<CompileJob> jobs; // The one job; empty build_dst if nothing to compile
+	up_<CompileQueue> queue;
+	up_<interface::Thread> thread;
+	ss_ build_dst; // Where the result is moved when swapping
+	// Set if a reload was requested again during the build
+	bool restart = false;
+	interface::ModuleInfo restart_info;
+};
+
 struct CState;
 
 struct FileWatchThread: public interface::ThreadedThing
@@ -422,6 +655,9 @@ struct CState: public State, public interface::Server
 	interface::Mutex m_shutdown_mutex;
 
 	up_<rccpp::Compiler> m_compiler;
+	ss_ m_build_flags_hash; // Added to the content hash of every module
+	sv_<ss_> m_pch_headers;
+	bool m_pch_prepared = false;
 	ss_ m_modules_path;
 
 	// Thread-local pointer to ModuleContainer of the module of each module
@@ -441,6 +677,7 @@ struct CState: public State, public interface::Server
 	//       everything until top)
 	sv_<ss_> m_module_load_order;
 	sv_<sv_<wp_<ModuleContainer>>> m_event_subs;
+	sm_<ss_, HeldEvents> m_held_events; // By name of module being swapped
 	// NOTE: You can make a copy of an sp_<ModuleContainer> and unlock this
 	//       mutex for processing the module asynchronously (just lock mc->mutex)
 	interface::Mutex m_modules_mutex;
@@ -454,6 +691,16 @@ struct CState: public State, public interface::Server
 	sp_<interface::thread_pool::ThreadPool> m_thread_pool;
 	interface::Mutex m_thread_pool_mutex;
 
+	// Accessed only by the main thread
+	sm_<ss_, sp_<ReloadBuild>> m_reload_builds;
+
+	int64_t m_last_stats_report_us = 0;
+	sm_<ss_, size_t> m_last_stats_num_events; // By module name
+	sm_<ss_, double> m_events_per_second; // By module name
+	std::function<void(const Event::Type &type, int64_t emitted_us,
+			int64_t tick_us)> m_tick_handled_cb;
+	interface::Mutex m_stats_mutex; // Protects each of the former variables
+
 	// Must come after the members this will access, which are m_modules_mutex
 	// and m_module_file_watches.
 	up_<interface::Thread> m_file_watch_thread;
@@ -463,7 +710,8 @@ struct CState: public State, public interface::Server
 				g_server_config.get<ss_>("compiler_command"))),
 		m_thread_pool(interface::thread_pool::createThreadPool())
 	{
-		m_thread_pool->start(4); // TODO: Configurable
+		m_thread_pool->start(
+				g_server_config.get<int64_t>("thread_pool_size"));
 
 		m_file_watch_thread.reset(interface::createThread(
 				new FileWatchThread(this)));
@@ -503,6 +751,67 @@ struct CState: public State, public interface::Server
 		m_compiler->libraries.push_back("-lUrho3D");
 		m_compiler->include_directories.push_back(
 				g_server_config.get<ss_>("urho3d_path")+"/Source/ThirdParty/Bullet/src");
+
+		// Headers used by most modules are precompiled
+
+		m_pch_headers = {
+			"\"core/log.h\"",
+			"\"interface/module.h\"",
+			"\"interface/module_info.h\"",
+			"\"interface/server.h\"",
+			"\"interface/event.h\"",
+			"<cereal/archives/portable_binary.hpp>",
+			"<cereal/types/string.hpp>",
+			"<cereal/types/vector.hpp>",
+			"<cereal/types/unordered_map.hpp>",
+			"<Context.h>",
+			"<Scene.h>",
+			"<Node.h>",
+			"<ResourceCache.h>",
+			"<Model.h>",
+			"<StaticModel.h>",
+			"<Material.h>",
+			"<RigidBody.h>",
+			"<CollisionShape.h>",
+		};
+
+		// Register modules that are linked in
+
+		for(const StaticModule &sm : get_static_modules())
+			m_compiler->add_static_module(sm.name, sm.constructor);
+
+		// Set build profile
+
+		ss_ profile_name = g_server_config.get<ss_>("rccpp_build_profile");
+		ss_ pgo_mode = g_server_config.get<ss_>("rccpp_pgo");
+		ss_ pgo_path = g_server_config.get<ss_>("rccpp_pgo_path");
+		if(pgo_path == "")
+			pgo_path = g_server_config.get<ss_>("rccpp_build_path")+"/pgo";
+		rccpp::BuildProfile profile;
+		if(!rccpp::get_build_profile(profile_name, pgo_mode, pgo_path,
+				&profile)){
+			throw Exception("Invalid rccpp_build_profile \""+profile_name+
+					"\" or rccpp_pgo \""+pgo_mode+"\"");
+		}
+		log_i(MODULE, "Module build profile: %s%s", cs(profile_name),
+				pgo_mode == "" ? "" : cs(" (PGO: "+pgo_mode+")"));
+		m_compiler->profile_cxxflags = profile.cxxflags;
+		m_compiler->profile_ldflags = profile.ldflags;
+		// Modules are rebuilt when the flags change
+		m_build_flags_hash = profile.cxxflags+"\n"+profile.ldflags;
+		if(pgo_mode == "generate"){
+			interface::fs::create_directories(pgo_path);
+		} else if(pgo_mode == "use"){
+			// ...and when there is new profile data
+			sv_<ss_> profile_files;
+			for(const interface::fs::Node &n :
+					interface::fs::list_directory(pgo_path)){
+				if(!n.is_directory)
+					profile_files.push_back(pgo_path+"/"+n.name);
+			}
+			std::sort(profile_files.begin(), profile_files.end());
+			m_build_flags_hash += "\n"+hash_files(profile_files);
+		}
 	}
 	~CState()
 	{
@@ -546,6 +855,13 @@ struct CState: public State, public interface::Server
 		log_v(MODULE, "Waiting: file watch");
 		m_file_watch_thread->join();
 
+		log_v(MODULE, "Waiting: reload builds");
+		for(auto &pair : m_reload_builds){
+			if(pair.second->thread)
+				pair.second->thread->join();
+		}
+		m_reload_builds.clear();
+
 		sv_<sp_<ModuleContainer>> mcs = get_modules_in_unload_order();
 
 		// Wait for threads to stop and delete module container references
@@ -587,105 +903,158 @@ struct CState: public State, public interface::Server
 		return m_shutdown_requested;
 	}
 
-	interface::Module* build_module_u(const interface::ModuleInfo &info)
+	// Figures out how a module is built and whether it needs to be compiled
+	ModuleBuildInfo get_module_build_info_u(const interface::ModuleInfo &info)
 	{
-		ss_ init_cpp_path = info.path+"/"+info.name+".cpp";
-
-		// Set up file watch
-
-		sv_<ss_> files_to_watch = {init_cpp_path};
-		sv_<ss_> include_dirs = m_compiler->include_directories;
-		include_dirs.push_back(m_modules_path);
-		sv_<ss_> includes = list_includes(init_cpp_path, include_dirs);
-		log_d(MODULE, "Includes: %s", cs(dump(includes)));
-		files_to_watch.insert(files_to_watch.end(), includes.begin(),
-				includes.end());
-
-		if(m_module_file_watches.count(info.name) == 0){
-			sp_<interface::FileWatch> w(interface::createFileWatch());
-			for(const ss_ &watch_path : files_to_watch){
-				ss_ dir_path = interface::fs::strip_file_name(watch_path);
-				w->add(dir_path, [this, info, watch_path](const ss_ &modified_path){
-					if(modified_path != watch_path)
-						return;
-					log_i(MODULE, "Module modified: %s: %s",
-							cs(info.name), cs(info.path));
-					m_modified_modules.insert(info.name);
-				});
-			}
-			m_module_file_watches[info.name] = w;
-		}
+		ModuleBuildInfo b;
+		b.init_cpp_path = info.path+"/"+info.name+".cpp";
 
-		// Build
+		b.includes = list_includes(b.init_cpp_path,
+				m_compiler->include_directories);
+		log_d(MODULE, "Includes: %s", cs(dump(b.includes)));
 
-		ss_ extra_cxxflags = info.meta.cxxflags;
-		ss_ extra_ldflags = info.meta.ldflags;
+		b.extra_cxxflags = info.meta.cxxflags;
+		b.extra_ldflags = info.meta.ldflags;
 #ifdef _WIN32
-		extra_cxxflags += " "+info.meta.cxxflags_windows;
-		extra_ldflags += " "+info.meta.ldflags_windows;
+		b.extra_cxxflags += " "+info.meta.cxxflags_windows;
+		b.extra_ldflags += " "+info.meta.ldflags_windows;
 		// Needed for every module
-		extra_ldflags += " -lbuildat_core";
+		b.extra_ldflags += " -lbuildat_core";
 		// Always include these to make life easier
-		extra_ldflags += " -lwsock32 -lws2_32";
+		b.extra_ldflags += " -lwsock32 -lws2_32";
 		// Add the path of the current executable to the library search path
 		{
 			ss_ exe_path = interface::os::get_current_exe_path();
 			ss_ exe_dir = interface::fs::strip_file_name(exe_path);
-			extra_ldflags += " -L\""+exe_dir+"\"";
+			b.extra_ldflags += " -L\""+exe_dir+"\"";
 		}
 #else
-		extra_cxxflags += " "+info.meta.cxxflags_linux;
-		extra_ldflags += " "+info.meta.ldflags_linux;
+		b.extra_cxxflags += " "+info.meta.cxxflags_linux;
+		b.extra_ldflags += " "+info.meta.ldflags_linux;
 #endif
-		log_d(MODULE, "extra_cxxflags: %s", cs(extra_cxxflags));
-		log_d(MODULE, "extra_ldflags: %s", cs(extra_ldflags));
+		log_d(MODULE, "extra_cxxflags: %s", cs(b.extra_cxxflags));
+		log_d(MODULE, "extra_ldflags: %s", cs(b.extra_ldflags));
 
-		bool skip_compile = g_server_config.get<json::Value>(
+		b.skip_compile = g_server_config.get<json::Value>(
 				"skip_compiling_modules").get(info.name).as_boolean();
 
-		sv_<ss_> files_to_hash = {init_cpp_path};
+		sv_<ss_> files_to_hash = {b.init_cpp_path};
 		files_to_hash.insert(
-				files_to_hash.begin(), includes.begin(), includes.end());
-		ss_ content_hash = hash_files(files_to_hash);
-		log_d(MODULE, "Module hash: %s", cs(interface::sha1::hex(content_hash)));
+				files_to_hash.begin(), b.includes.begin(), b.includes.end());
+		b.content_hash = interface::sha1::calculate(hash_files(files_to_hash)+
+				b.extra_cxxflags+"\n"+b.extra_ldflags+"\n"+m_build_flags_hash);
+		log_d(MODULE, "Module hash: %s",
+				cs(interface::sha1::hex(b.content_hash)));
 
 #ifdef _WIN32
 		// On Windows, we need a new name for each modification of the module
 		// because Windows caches DLLs by name
-		ss_ build_dst = g_server_config.get<ss_>("rccpp_build_path") +
-				"/"+info.name+"_"+interface::sha1::hex(content_hash)+"."+
+		b.build_dst = g_server_config.get<ss_>("rccpp_build_path") +
+				"/"+info.name+"_"+interface::sha1::hex(b.content_hash)+"."+
 				MODULE_EXTENSION;
 		// TODO: Delete old ones
 #else
-		ss_ build_dst = g_server_config.get<ss_>("rccpp_build_path") +
+		b.build_dst = g_server_config.get<ss_>("rccpp_build_path") +
 				"/"+info.name+"."+MODULE_EXTENSION;
 #endif
 
-		ss_ hashfile_path = build_dst+".hash";
+		b.hashfile_path = b.build_dst+".hash";
 
-		if(!skip_compile){
-			if(!std::ifstream(build_dst).good()){
+		if(!b.skip_compile){
+			if(!std::ifstream(b.build_dst).good()){
 				// Result file does not exist at all, no need to check hashes
 			} else {
 				ss_ previous_hash;
 				{
-					std::ifstream f(hashfile_path);
+					std::ifstream f(b.hashfile_path);
 					if(f.good()){
 						previous_hash = ss_((std::istreambuf_iterator<char>(f)),
 								std::istreambuf_iterator<char>());
 					}
 				}
-				if(previous_hash == content_hash){
+				if(previous_hash == b.content_hash){
 					log_v(MODULE, "No need to recompile %s", cs(info.name));
-					skip_compile = true;
+					b.skip_compile = true;
 				}
 			}
 		}
+		return b;
+	}
 
-		m_compiler->include_directories.push_back(m_modules_path);
-		bool build_ok = m_compiler->build(info.name, init_cpp_path, build_dst,
-				extra_cxxflags, extra_ldflags, skip_compile);
-		m_compiler->include_directories.pop_back();
+	// Done when the first module needs to be compiled
+	void prepare_pch_u()
+	{
+		if(m_pch_prepared)
+			return;
+		m_pch_prepared = true;
+		if(!g_server_config.get<bool>("rccpp_precompiled_header"))
+			return;
+
+		ss_ build_path = g_server_config.get<ss_>("rccpp_build_path");
+		ss_ header_path = build_path+"/buildat_pch.h";
+		{
+			std::ofstream f(header_path);
+			f<<"// Generated by buildat_server; included first in every module"
+					<<std::endl;
+			for(const ss_ &header : m_pch_headers)
+				f<<"#include "<<header<<std::endl;
+		}
+
+		// Hashing everything that ends up in it covers changes in the
+		// interface of buildat_core and in the bundled libraries
+		sv_<ss_> includes = list_includes_recursive(
+				header_path, m_compiler->include_directories);
+		ss_ content_hash = hash_files(includes);
+
+		int64_t t0 = interface::os::time_us();
+		if(m_compiler->prepare_pch(header_path, build_path, content_hash)){
+			log_v(MODULE, "Precompiled header ready in %ims",
+					(int)((interface::os::time_us() - t0) / 1000));
+		}
+	}
+
+	interface::Module* build_module_u(const interface::ModuleInfo &info)
+	{
+		if(m_compiler->is_static_module(info.name)){
+			// Linked in; there is nothing to compile or watch
+			if(!m_compiler->build(info.name, "", "", "", "", true)){
+				log_w(MODULE, "Failed to build module %s", cs(info.name));
+				return nullptr;
+			}
+			return static_cast<interface::Module*>(
+					m_compiler->construct(info.name.c_str(), this));
+		}
+
+		ModuleBuildInfo b = get_module_build_info_u(info);
+
+		// Set up file watch
+
+		sv_<ss_> files_to_watch = {b.init_cpp_path};
+		files_to_watch.insert(files_to_watch.end(), b.includes.begin(),
+				b.includes.end());
+
+		if(m_module_file_watches.count(info.name) == 0){
+			sp_<interface::FileWatch> w(interface::createFileWatch());
+			for(const ss_ &watch_path : files_to_watch){
+				ss_ dir_path = interface::fs::strip_file_name(watch_path);
+				w->add(dir_path, [this, info, watch_path](const ss_ &modified_path){
+					if(modified_path != watch_path)
+						return;
+					log_i(MODULE, "Module modified: %s: %s",
+							cs(info.name), cs(info.path));
+					m_modified_modules.insert(info.name);
+				});
+			}
+			m_module_file_watches[info.name] = w;
+		}
+
+		// Build
+
+		if(!b.skip_compile)
+			prepare_pch_u();
+
+		bool build_ok = m_compiler->build(info.name, b.init_cpp_path,
+				b.build_dst, b.extra_cxxflags, b.extra_ldflags, b.skip_compile);
 
 		if(!build_ok){
 			log_w(MODULE, "Failed to build module %s", cs(info.name));
@@ -693,9 +1062,9 @@ struct CState: public State, public interface::Server
 		}
 
 		// Update hash file
-		if(!skip_compile){
-			std::ofstream f(hashfile_path);
-			f<<content_hash;
+		if(!b.skip_compile){
+			std::ofstream f(b.hashfile_path);
+			f<<b.content_hash;
 		}
 
 		// Construct instance
@@ -705,6 +1074,80 @@ struct CState: public State, public interface::Server
 		return m;
 	}
 
+	// Compiles every given module that is not up to date, using up to
+	// module_compile_jobs compiler processes at once. The modules are not
+	// loaded; load_module() finds them up to date afterwards.
+	bool build_modules(const sv_<interface::ModuleInfo> &infos)
+	{
+		// Hold this for the whole time like load_module() does; this makes
+		// sure nothing loads modules meanwhile.
+		interface::MutexScope ms(m_modules_mutex);
+
+		sv_<CompileJob> jobs;
+		for(const interface::ModuleInfo &info : infos){
+			if(info.meta.disable_cpp)
+				continue;
+			if(m_modules.count(info.name))
+				continue;
+			if(m_compiler->is_static_module(info.name))
+				continue;
+			CompileJob job;
+			job.name = info.name;
+			job.build = get_module_build_info_u(info);
+			if(job.build.skip_compile)
+				continue;
+			jobs.push_back(job);
+		}
+		if(jobs.empty())
+			return true;
+
+		size_t num_threads = g_server_config.get<int64_t>("module_compile_jobs");
+		if(num_threads == 0)
+			num_threads = interface::os::get_num_cpus();
+		if(num_threads > jobs.size())
+			num_threads = jobs.size();
+
+		log_i(MODULE, "Compiling %zu modules using %zu jobs",
+				jobs.size(), num_threads);
+		int64_t t0 = interface::os::time_us();
+
+		prepare_pch_u();
+
+		CompileQueue queue(m_compiler.get(), &jobs);
+		{
+			// This thread works too
+			sv_<up_<interface::Thread>> threads;
+			for(size_t i = 1; i < num_threads; i++){
+				up_<interface::Thread> thread(interface::createThread(
+						new CompileThread(&queue)));
+				thread->set_name("state/compile");
+				thread->start();
+				threads.push_back(std::move(thread));
+			}
+			queue.run();
+			for(up_<interface::Thread> &thread : threads)
+				thread->join();
+		}
+
+		sv_<ss_> failed;
+		for(const CompileJob &job : jobs){
+			if(!job.ok){
+				failed.push_back(job.name);
+				continue;
+			}
+			std::ofstream f(job.build.hashfile_path);
+			f<<job.build.content_hash;
+		}
+		log_i(MODULE, "Compiled %zu modules in %ims",
+				jobs.size() - failed.size(),
+				(int)((interface::os::time_us() - t0) / 1000));
+		if(!failed.empty()){
+			log_w(MODULE, "Failed to compile modules: %s", cs(dump(failed)));
+			return false;
+		}
+		return true;
+	}
+
 	// Can be used for loading hardcoded modules.
 	// There intentionally is no core:module_loaded event.
 	void load_module_direct_u(interface::Module *m, const ss_ &name)
@@ -782,6 +1225,10 @@ struct CState: public State, public interface::Server
 	void load_modules(const ss_ &path)
 	{
 		m_modules_path = path;
+		// Modules can include each other's headers. The include directories
+		// are not modified after this so that modules can be compiled in
+		// other threads.
+		m_compiler->include_directories.push_back(m_modules_path);
 
 		interface::ModuleInfo info;
 		info.name = "__loader";
@@ -848,7 +1295,10 @@ struct CState: public State, public interface::Server
 
 	// Direct version; internal and unsafe
 	// Call with no mutexes locked.
-	void unload_module_u(const ss_ &module_name)
+	// If hold_events is set, events to the module are collected from the
+	// moment its subscriptions are removed, including those left in its queue,
+	// until release_held_events() is called.
+	void unload_module_u(const ss_ &module_name, bool hold_events = false)
 	{
 		log_i(MODULE, "unload_module_u(): module_name=%s", cs(module_name));
 		sp_<ModuleContainer> mc;
@@ -873,15 +1323,20 @@ struct CState: public State, public interface::Server
 						sv_<wp_<ModuleContainer>> new_sublist;
 						for(wp_<ModuleContainer> &mc1 : sublist){
 							if(sp_<ModuleContainer>(mc1.lock()).get() !=
-									mc.get())
+									mc.get()){
 								new_sublist.push_back(mc1);
-							else
+							} else {
 								log_v(MODULE,
 										"Removing %s subscription to event %zu",
 										cs(module_name), type);
+								if(hold_events)
+									m_held_events[module_name].types.insert(type);
+							}
 						}
 						sublist = new_sublist;
 					}
+					if(hold_events)
+						m_held_events[module_name]; // Hold even if none
 				}
 				// Remove server-wide reference to module container
 				m_modules.erase(module_name);
@@ -901,6 +1356,12 @@ struct CState: public State, public interface::Server
 				log_w(MODULE, "unload_module_u[%s]: This is not the last container"
 						" reference; unloading shared executable is probably unsafe",
 						cs(module_name));
+			if(hold_events){
+				// The queue is not touched by anything anymore
+				HeldEvents &held = m_held_events[module_name];
+				held.events.insert(held.events.begin(),
+						mc->event_queue.begin(), mc->event_queue.end());
+			}
 			// Drop reference to container
 			log_t(MODULE, "unload_module_u[%s]: Dropping container",
 					cs(module_name));
@@ -1167,6 +1628,18 @@ struct CState: public State, public interface::Server
 		sublist.push_back(wp_<ModuleContainer>(mc0));
 	}
 
+	bool is_subscribed_u(const ss_ &module_name, const Event::Type &type)
+	{
+		if(type >= m_event_subs.size())
+			return false;
+		for(wp_<ModuleContainer> &mc_weak : m_event_subs[type]){
+			sp_<ModuleContainer> mc(mc_weak.lock());
+			if(mc && mc->info.name == module_name)
+				return true;
+		}
+		return false;
+	}
+
 	// Do not use synchronous=true unless specifically needed in a special case.
 	void emit_event(Event event, bool synchronous)
 	{
@@ -1177,9 +1650,17 @@ struct CState: public State, public interface::Server
 		}
 
 		sv_<sv_<wp_<ModuleContainer>>> event_subs_snapshot;
+		set_<ss_> holding_modules;
 		{
 			interface::MutexScope ms(m_modules_mutex);
 			event_subs_snapshot = m_event_subs;
+			// Modules being swapped get the event later, in order
+			for(auto &pair : m_held_events){
+				holding_modules.insert(pair.first);
+				if(pair.second.types.count(event.type) ||
+						is_subscribed_u(pair.first, event.type))
+					pair.second.events.push_back(event);
+			}
 		}
 
 		if(event.type >= event_subs_snapshot.size()){
@@ -1198,6 +1679,10 @@ struct CState: public State, public interface::Server
 		}
 		for(wp_<ModuleContainer> &mc_weak : sublist){
 			sp_<ModuleContainer> mc(mc_weak.lock());
+			if(mc && !holding_modules.empty() &&
+					holding_modules.count(mc->info.name)){
+				continue; // Held
+			}
 			if(mc){
 				if(synchronous)
 					mc->emit_event_sync(event);
@@ -1216,6 +1701,57 @@ struct CState: public State, public interface::Server
 		emit_event(event, false);
 	}
 
+	// Like emit_event() for each, but the subscriptions are looked up once
+	// and each module's queue is locked once for the whole batch
+	void emit_events(sv_<Event> &events)
+	{
+		if(events.empty())
+			return;
+		sv_<sv_<wp_<ModuleContainer>>> event_subs_snapshot;
+		set_<ss_> holding_modules;
+		{
+			interface::MutexScope ms(m_modules_mutex);
+			event_subs_snapshot = m_event_subs;
+			// Modules being swapped get the events later, in order
+			for(auto &pair : m_held_events){
+				holding_modules.insert(pair.first);
+				for(const Event &event : events){
+					if(pair.second.types.count(event.type) ||
+							is_subscribed_u(pair.first, event.type))
+						pair.second.events.push_back(event);
+				}
+			}
+		}
+
+		// Events of each module in the order they were emitted
+		sv_<std::pair<sp_<ModuleContainer>, sv_<const Event*>>> module_events;
+		sm_<ModuleContainer*, size_t> module_indices;
+		for(const Event &event : events){
+			if(event.type >= event_subs_snapshot.size())
+				continue;
+			for(wp_<ModuleContainer> &mc_weak :
+					event_subs_snapshot[event.type]){
+				sp_<ModuleContainer> mc(mc_weak.lock());
+				if(!mc)
+					continue;
+				if(!holding_modules.empty() &&
+						holding_modules.count(mc->info.name))
+					continue; // Held
+				auto it = module_indices.find(mc.get());
+				if(it == module_indices.end()){
+					it = module_indices.insert(std::make_pair(
+							mc.get(), module_events.size())).first;
+					module_events.push_back(std::make_pair(
+							mc, sv_<const Event*>()));
+				}
+				module_events[it->second].second.push_back(&event);
+			}
+		}
+		for(auto &pair : module_events)
+			pair.first->push_events(pair.second);
+		events.clear();
+	}
+
 	void handle_events()
 	{
 		// Get modified modules and push events to queue
@@ -1236,13 +1772,134 @@ struct CState: public State, public interface::Server
 
 		// Handle module unloads and reloads as requested
 		handle_unloads_and_reloads();
+
+		report_module_stats_if_due();
+	}
+
+	void report_module_stats_if_due()
+	{
+		int64_t interval_s = g_server_config.get<int64_t>(
+				"module_stats_interval_s");
+		if(interval_s <= 0)
+			return;
+		int64_t now_us = interface::os::time_us();
+		{
+			interface::MutexScope ms(m_stats_mutex);
+			if(m_last_stats_report_us == 0)
+				m_last_stats_report_us = now_us;
+			int64_t elapsed_us = now_us - m_last_stats_report_us;
+			if(elapsed_us < interval_s * 1000000)
+				return;
+			m_last_stats_report_us = now_us;
+			// Update event rates
+			sm_<ss_, size_t> num_events;
+			for(const interface::ModuleStats &stats : get_module_stats())
+				num_events[stats.name] = stats.num_events;
+			m_events_per_second.clear();
+			for(auto &pair : num_events){
+				size_t last = m_last_stats_num_events[pair.first];
+				if(pair.second < last) // Module was reloaded
+					last = 0;
+				m_events_per_second[pair.first] =
+						(pair.second - last) / (elapsed_us / 1e6);
+			}
+			m_last_stats_num_events = num_events;
+		}
+		sv_<interface::ModuleStats> stats = get_module_stats();
+
+		log_v(MODULE, "Module stats:\n%s", cs(format_module_stats(stats)));
+
+		interface::event_pool::PoolStats pool_stats =
+				interface::event_pool::get_stats();
+		log_v(MODULE, "Event pool: %zu allocations, %zu reused, %zu unpooled, "
+				"%zu free blocks", pool_stats.num_allocs, pool_stats.num_reused,
+				pool_stats.num_unpooled, pool_stats.num_free_blocks);
+
+		ss_ json_path = g_server_config.get<ss_>("module_stats_json_path");
+		if(!json_path.empty()){
+			std::ofstream f(json_path.c_str(), std::ios::binary);
+			f<<module_stats_to_json(stats).stringify();
+			if(!f.good())
+				log_w(MODULE, "Failed to write module stats to \"%s\"",
+						cs(json_path));
+		}
+
+		emit_event(Event("core:stats", new interface::StatsEvent(stats)));
+	}
+
+	static ss_ format_module_stats(const sv_<interface::ModuleStats> &stats)
+	{
+		ss_ s;
+		char buf[200];
+		for(const interface::ModuleStats &m : stats){
+			snprintf(buf, sizeof buf, "%s: %zu events (%.1f/s), queue %zu "
+					"(max %zu), %zu coalesced, tick lag %ims\n",
+					cs(m.name), m.num_events, m.events_per_second,
+					m.queue_length, m.max_queue_length, m.num_coalesced_events,
+					(int)(m.last_tick_lag_us / 1000));
+			s += buf;
+			for(auto &pair : m.events){
+				const interface::EventTypeStats &e = pair.second;
+				snprintf(buf, sizeof buf, "  %s: %zux, total %ims, "
+						"max %ius\n", cs(pair.first), e.count,
+						(int)(e.total_us / 1000), (int)e.max_us);
+				s += buf;
+			}
+			for(auto &pair : m.direct_cbs){
+				const interface::DirectCbStats &d = pair.second;
+				snprintf(buf, sizeof buf, "  direct_cb from %s: %zux, "
+						"wait %ims, exec %ims\n", cs(pair.first), d.count,
+						(int)(d.wait_us / 1000), (int)(d.exec_us / 1000));
+				s += buf;
+			}
+		}
+		return s;
+	}
+
+	static json::Value module_stats_to_json(
+			const sv_<interface::ModuleStats> &stats)
+	{
+		json::Value modules = json::object();
+		for(const interface::ModuleStats &m : stats){
+			json::Value v = json::object();
+			v.set("num_events", json::Value((int64_t)m.num_events));
+			v.set("events_per_second", json::Value(m.events_per_second));
+			v.set("queue_length", json::Value((int64_t)m.queue_length));
+			v.set("max_queue_length", json::Value((int64_t)m.max_queue_length));
+			v.set("num_coalesced_events",
+					json::Value((int64_t)m.num_coalesced_events));
+			v.set("last_tick_lag_us", json::Value(m.last_tick_lag_us));
+			json::Value events = json::object();
+			for(auto &pair : m.events){
+				json::Value e = json::object();
+				e.set("count", json::Value((int64_t)pair.second.count));
+				e.set("total_us", json::Value(pair.second.total_us));
+				e.set("max_us", json::Value(pair.second.max_us));
+				events.set(pair.first, e);
+			}
+			v.set("events", events);
+			json::Value direct_cbs = json::object();
+			for(auto &pair : m.direct_cbs){
+				json::Value d = json::object();
+				d.set("count", json::Value((int64_t)pair.second.count));
+				d.set("wait_us", json::Value(pair.second.wait_us));
+				d.set("exec_us", json::Value(pair.second.exec_us));
+				direct_cbs.set(pair.first, d);
+			}
+			v.set("direct_cbs", direct_cbs);
+			modules.set(m.name, v);
+		}
+		json::Value root = json::object();
+		root.set("time_us", json::Value(interface::os::time_us()));
+		root.set("modules", modules);
+		return root;
 	}
 
 	void handle_unloads_and_reloads()
 	{
-		// Grab unload and reload requests into unload and load queues
+		// Grab unload and reload requests
 		sv_<ss_> unloads_requested;
-		sv_<interface::ModuleInfo> loads_requested;
+		sv_<interface::ModuleInfo> reloads_requested;
 		{
 			interface::MutexScope ms(m_modules_mutex);
 
@@ -1251,15 +1908,11 @@ struct CState: public State, public interface::Server
 			}
 			m_unloads_requested.clear();
 
-			for(const interface::ModuleInfo &info : m_reloads_requested){
-				unloads_requested.push_back(info.name);
-				loads_requested.push_back(info);
-			}
-			m_reloads_requested.clear();
+			reloads_requested.swap(m_reloads_requested);
 		}
 		// Send core:unload events synchronously to modules
 		for(const ss_ &module_name : unloads_requested){
-			log_t(MODULE, "reload[%s]: Synchronous core:unload", cs(module_name));
+			log_t(MODULE, "unload[%s]: Synchronous core:unload", cs(module_name));
 			access_module(module_name, [&](interface::Module *module){
 				module->event(Event::t("core:unload"), nullptr);
 			});
@@ -1269,16 +1922,162 @@ struct CState: public State, public interface::Server
 			log_i(MODULE, "Unloading %s", cs(module_name));
 			unload_module_u(module_name);
 		}
-		// Load modules
-		for(const interface::ModuleInfo &info : loads_requested){
-			log_i(MODULE, "Loading %s (reload requested)", cs(info.name));
-			// Load module
-			load_module(info);
+		// Build new versions of reloaded modules in the background; the old
+		// versions keep running meanwhile
+		for(const interface::ModuleInfo &info : reloads_requested){
+			start_reload_build(info);
+		}
+		// Swap in the ones that have been built
+		finish_reload_builds();
+	}
+
+	void start_reload_build(const interface::ModuleInfo &info)
+	{
+		auto it = m_reload_builds.find(info.name);
+		if(it != m_reload_builds.end()){
+			// Build again when the current build finishes
+			it->second->restart = true;
+			it->second->restart_info = info;
+			return;
+		}
+
+		sp_<ReloadBuild> rb(new ReloadBuild());
+		rb->info = info;
+		CompileJob job;
+		job.name = info.name;
+		{
+			interface::MutexScope ms(m_modules_mutex);
+			if(!info.meta.disable_cpp &&
+					!m_compiler->is_static_module(info.name)){
+				job.build = get_module_build_info_u(info);
+				if(!job.build.skip_compile)
+					prepare_pch_u();
+			}
+		}
+		m_reload_builds[info.name] = rb;
+
+		if(job.build.build_dst.empty() || job.build.skip_compile){
+			// Nothing to compile; swap right away
+			job.ok = true;
+			rb->jobs.push_back(job);
+			return;
+		}
+
+		// Don't overwrite the version that is currently loaded
+		rb->build_dst = job.build.build_dst;
+		job.build.build_dst += ".new";
+		rb->jobs.push_back(job);
+
+		log_i(MODULE, "Building %s in the background", cs(info.name));
+		rb->queue.reset(new CompileQueue(m_compiler.get(), &rb->jobs));
+		rb->thread.reset(interface::createThread(
+				new CompileThread(rb->queue.get())));
+		rb->thread->set_name("state/reload");
+		rb->thread->start();
+	}
+
+	void finish_reload_builds()
+	{
+		sv_<sp_<ReloadBuild>> finished;
+		for(auto &pair : m_reload_builds){
+			sp_<ReloadBuild> &rb = pair.second;
+			if(rb->thread){
+				if(rb->thread->is_running())
+					continue;
+				rb->thread->join();
+			}
+			finished.push_back(rb);
+		}
+		for(sp_<ReloadBuild> &rb : finished){
+			m_reload_builds.erase(rb->info.name);
+			const CompileJob &job = rb->jobs[0];
+			if(rb->restart){
+				log_i(MODULE, "%s was modified during the build; building again",
+						cs(rb->info.name));
+				if(rb->thread)
+					remove(job.build.build_dst.c_str());
+				start_reload_build(rb->restart_info);
+				continue;
+			}
+			if(!job.ok){
+				log_w(MODULE, "Failed to build %s; keeping the old version",
+						cs(rb->info.name));
+				continue;
+			}
+			swap_module(*rb);
+		}
+	}
+
+	// Replaces the running version of a module with the one that was built.
+	// Events emitted to the module meanwhile are held and then handed to the
+	// new version.
+	void swap_module(const ReloadBuild &rb)
+	{
+		const ss_ &module_name = rb.info.name;
+		int64_t t0 = interface::os::time_us();
+
+		if(has_module(module_name)){
+			log_t(MODULE, "reload[%s]: Synchronous core:unload",
+					cs(module_name));
+			access_module(module_name, [&](interface::Module *module){
+				module->event(Event::t("core:unload"), nullptr);
+			});
+			unload_module_u(module_name, true);
+		}
+
+		if(rb.thread){
+			// Move the new version in place; load_module() finds it up to date
+			const ModuleBuildInfo &b = rb.jobs[0].build;
+			remove(rb.build_dst.c_str());
+			if(rename(b.build_dst.c_str(), rb.build_dst.c_str()) != 0){
+				log_w(MODULE, "Failed to rename %s to %s", cs(b.build_dst),
+						cs(rb.build_dst));
+			} else {
+				std::ofstream f(b.hashfile_path);
+				f<<b.content_hash;
+			}
+		}
+
+		log_i(MODULE, "Loading %s (reload requested)", cs(module_name));
+		if(load_module(rb.info)){
 			// Send core:continue synchronously to module
-			access_module(info.name, [&](interface::Module *module){
+			access_module(module_name, [&](interface::Module *module){
 				module->event(Event::t("core:continue"), nullptr);
 			});
 		}
+		release_held_events(module_name);
+
+		log_i(MODULE, "Swapped %s in %ims", cs(module_name),
+				(int)((interface::os::time_us() - t0) / 1000));
+	}
+
+	void release_held_events(const ss_ &module_name)
+	{
+		interface::MutexScope ms(m_modules_mutex);
+		auto it = m_held_events.find(module_name);
+		if(it == m_held_events.end())
+			return;
+		sv_<Event> events;
+		events.swap(it->second.events);
+		m_held_events.erase(it);
+
+		auto mit = m_modules.find(module_name);
+		if(mit == m_modules.end()){
+			log_w(MODULE, "Module %s is gone; dropping %zu held events",
+					cs(module_name), events.size());
+			return;
+		}
+		sp_<ModuleContainer> mc = mit->second;
+		size_t num_dropped = 0;
+		for(const Event &event : events){
+			// The new version may not be interested anymore
+			if(is_subscribed_u(module_name, event.type))
+				mc->push_event(event);
+			else
+				num_dropped++;
+		}
+		log_v(MODULE, "Released %zu held events to %s (%zu unsubscribed)",
+				events.size() - num_dropped, cs(module_name), num_dropped);
 	}
 
 	void tmp_store_data(const ss_ &name, const ss_ &data)
@@ -1324,8 +2123,69 @@ struct CState: public State, public interface::Server
 		interface::MutexScope ms(m_thread_pool_mutex);
 		cb(m_thread_pool.get());
 	}
+
+	void set_tick_handled_cb(std::function<void(const Event::Type &type,
+			int64_t emitted_us, int64_t tick_us)> cb)
+	{
+		interface::MutexScope ms(m_stats_mutex);
+		m_tick_handled_cb = cb;
+	}
+
+	void tick_handled(const Event::Type &type,
+			const interface::TickEvent &tick)
+	{
+		int64_t tick_us = interface::os::time_us() - tick.emitted_us;
+		interface::MutexScope ms(m_stats_mutex);
+		if(m_tick_handled_cb)
+			m_tick_handled_cb(type, tick.emitted_us, tick_us);
+	}
+
+	sv_<interface::ModuleStats> get_module_stats()
+	{
+		sv_<sp_<ModuleContainer>> mcs;
+		{
+			interface::MutexScope ms(m_modules_mutex);
+			for(auto &pair : m_modules)
+				mcs.push_back(pair.second);
+		}
+		sm_<ss_, double> events_per_second;
+		{
+			interface::MutexScope ms(m_stats_mutex);
+			events_per_second = m_events_per_second;
+		}
+		auto *evreg = interface::getGlobalEventRegistry();
+		sv_<interface::ModuleStats> result;
+		for(sp_<ModuleContainer> &mc : mcs){
+			interface::ModuleStats stats;
+			stats.name = mc->info.name;
+			{
+				interface::MutexScope ms(mc->event_queue_mutex);
+				stats.queue_length = mc->event_queue.size();
+				stats.max_queue_length = mc->max_event_queue_length;
+				stats.num_coalesced_events = mc->num_coalesced_events;
+			}
+			{
+				interface::MutexScope ms(mc->stats_mutex);
+				for(auto &pair : mc->event_stats)
+					stats.events[evreg->name(pair.first)] = pair.second;
+				stats.direct_cbs = mc->direct_cb_stats;
+				stats.num_events = mc->num_events_handled;
+				stats.last_tick_lag_us = mc->last_tick_lag_us;
+			}
+			stats.events_per_second = events_per_second[stats.name];
+			result.push_back(stats);
+		}
+		return result;
+	}
 };
 
+static void report_tick_handled(ModuleContainer *mc, const Event::Type &type,
+		const interface::TickEvent &tick)
+{
+	// Every ModuleContainer is created by CState
+	static_cast<CState*>(mc->server)->tick_handled(type, tick);
+}
+
 void FileWatchThread::run(interface::Thread *thread)
 {
 	interface::SelectHandler handler;
@@ -50,6 +50,13 @@ namespace server
 
 		virtual void access_thread_pool(std::function<void(
 				interface::thread_pool::ThreadPool*pool)> cb) = 0;
+
+		// Called from module threads whenever a module has handled a
+		// core:tick or core:replication_tick, with the time from emitting the
+		// tick to the end of handling it
+		virtual void set_tick_handled_cb(std::function<void(
+				const interface::Event::Type &type, int64_t emitted_us,
+				int64_t tick_us)> cb) = 0;
 	};
 
 	State* createState();
@@ -0,0 +1,25 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+#pragma once
+#include "core/types.h"
+
+namespace interface {
+	struct Server;
+}
+
+namespace server
+{
+	typedef void*(*ModuleConstructor)(interface::Server *server);
+
+	struct StaticModule
+	{
+		const char *name;
+		ModuleConstructor constructor; // createModule_<name>
+	};
+
+	// C++ modules linked into the executable. Empty in a normal build;
+	// buildat_server_precompiled generates this from the builtin modules and
+	// the game set in PRECOMPILED_GAME (see CMakeLists.txt).
+	sv_<StaticModule> get_static_modules();
+}
+// vim: set noet ts=4 sw=4:
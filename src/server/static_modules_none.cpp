@@ -0,0 +1,13 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+#include "server/static_modules.h"
+
+namespace server {
+
+sv_<StaticModule> get_static_modules()
+{
+	return {};
+}
+
+}
+// vim: set noet ts=4 sw=4:
@@ -0,0 +1,196 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+#include "server/tick_scheduler.h"
+#include "interface/os.h"
+#include "interface/mutex.h"
+#include "core/log.h"
+#include <algorithm>
+#include <cstdio>
+#define MODULE "tick_scheduler"
+
+namespace server {
+
+// A timer further behind than this many periods drops the extra deadlines
+static const int64_t MAX_CATCH_UP_PERIODS = 5;
+static const size_t NUM_SAMPLES = 1000;
+
+// Fixed-size window of the latest values
+struct SampleWindow
+{
+	sv_<int64_t> m_samples;
+	size_t m_next = 0;
+
+	void add(int64_t v)
+	{
+		if(m_samples.size() < NUM_SAMPLES){
+			m_samples.push_back(v);
+			return;
+		}
+		m_samples[m_next] = v;
+		m_next = (m_next + 1) % NUM_SAMPLES;
+	}
+
+	// Returns p50, p90, p99 and max in that order
+	void get_percentiles(int64_t *p50, int64_t *p90, int64_t *p99,
+			int64_t *max) const
+	{
+		if(m_samples.empty())
+			return;
+		sv_<int64_t> sorted = m_samples;
+		std::sort(sorted.begin(), sorted.end());
+		size_t n = sorted.size();
+		*p50 = sorted[n * 50 / 100];
+		*p90 = sorted[n * 90 / 100];
+		*p99 = sorted[n * 99 / 100];
+		*max = sorted[n - 1];
+	}
+};
+
+struct TickTimer
+{
+	TickTimerStats stats;
+	int64_t deadline_us = 0;
+	int64_t tick_start_us = 0;
+	int64_t last_skip_warning_us = 0;
+	int64_t last_overrun_started_us = -1;
+	SampleWindow jitter;
+	SampleWindow tick_time;
+};
+
+struct CTickScheduler: public TickScheduler
+{
+	sv_<TickTimer> m_timers;
+	// Protects m_timers against add_tick_time() of other threads; the thread
+	// running the timers reads the deadlines without it
+	interface::Mutex m_mutex;
+
+	TickTimer& check_timer(TickTimerId id)
+	{
+		if(id >= m_timers.size())
+			throw Exception("tick_scheduler: Invalid timer id");
+		return m_timers[id];
+	}
+
+	// Interface
+
+	TickTimerId add_timer(const ss_ &name, int64_t period_us)
+	{
+		if(period_us <= 0)
+			throw Exception("tick_scheduler: Invalid period for "+name);
+		interface::MutexScope ms(m_mutex);
+		m_timers.push_back(TickTimer());
+		TickTimer &timer = m_timers.back();
+		timer.stats.name = name;
+		timer.stats.period_us = period_us;
+		timer.deadline_us = interface::os::monotonic_us();
+		return m_timers.size() - 1;
+	}
+
+	void sleep_until_next(int64_t max_sleep_us)
+	{
+		int64_t now_us = interface::os::monotonic_us();
+		int64_t deadline_us = now_us + max_sleep_us;
+		for(TickTimer &timer : m_timers){
+			if(timer.deadline_us < deadline_us)
+				deadline_us = timer.deadline_us;
+		}
+		if(deadline_us > now_us)
+			interface::os::sleep_until_monotonic_us(deadline_us);
+	}
+
+	sv_<TickTimerId> take_due()
+	{
+		sv_<TickTimerId> due;
+		int64_t now_us = interface::os::monotonic_us();
+		interface::MutexScope ms(m_mutex);
+		for(size_t id = 0; id < m_timers.size(); id++){
+			TickTimer &timer = m_timers[id];
+			if(timer.deadline_us > now_us)
+				continue;
+			int64_t period_us = timer.stats.period_us;
+			int64_t late_us = now_us - timer.deadline_us;
+			if(late_us >= MAX_CATCH_UP_PERIODS * period_us){
+				int64_t num_skipped = late_us / period_us;
+				timer.stats.num_skipped += num_skipped;
+				timer.deadline_us += num_skipped * period_us;
+				if(now_us - timer.last_skip_warning_us >= 10000000){
+					timer.last_skip_warning_us = now_us;
+					log_w(MODULE, "%s: Skipping %i ticks (%ims behind)",
+							cs(timer.stats.name), (int)num_skipped,
+							(int)(late_us / 1000));
+				}
+			}
+			timer.jitter.add(now_us - timer.deadline_us);
+			timer.deadline_us += period_us;
+			timer.tick_start_us = now_us;
+			timer.stats.num_ticks++;
+			due.push_back(id);
+		}
+		return due;
+	}
+
+	void end_tick(TickTimerId id)
+	{
+		int64_t tick_start_us;
+		{
+			interface::MutexScope ms(m_mutex);
+			tick_start_us = check_timer(id).tick_start_us;
+		}
+		add_tick_time(id, tick_start_us,
+				interface::os::monotonic_us() - tick_start_us);
+	}
+
+	void add_tick_time(TickTimerId id, int64_t started_us, int64_t tick_us)
+	{
+		interface::MutexScope ms(m_mutex);
+		TickTimer &timer = check_timer(id);
+		timer.tick_time.add(tick_us);
+		if(tick_us > timer.stats.period_us &&
+				started_us != timer.last_overrun_started_us){
+			timer.last_overrun_started_us = started_us;
+			timer.stats.num_overruns++;
+		}
+	}
+
+	sv_<TickTimerStats> get_stats()
+	{
+		interface::MutexScope ms(m_mutex);
+		sv_<TickTimerStats> result;
+		for(TickTimer &timer : m_timers){
+			TickTimerStats stats = timer.stats;
+			timer.jitter.get_percentiles(&stats.jitter_p50_us,
+					&stats.jitter_p90_us, &stats.jitter_p99_us,
+					&stats.jitter_max_us);
+			timer.tick_time.get_percentiles(&stats.tick_p50_us,
+					&stats.tick_p90_us, &stats.tick_p99_us, &stats.tick_max_us);
+			result.push_back(stats);
+		}
+		return result;
+	}
+};
+
+TickScheduler* createTickScheduler()
+{
+	return new CTickScheduler();
+}
+
+ss_ format_tick_stats(const sv_<TickTimerStats> &stats)
+{
+	ss_ s;
+	char buf[300];
+	for(const TickTimerStats &t : stats){
+		snprintf(buf, sizeof buf, "%s (%.1fHz): %zu ticks (%zu overruns, "
+				"%zu skipped); jitter p50 %ius, p90 %ius, p99 %ius, max %ius; "
+				"tick time p50 %ius, p90 %ius, p99 %ius, max %ius\n",
+				cs(t.name), 1e6 / t.period_us, t.num_ticks, t.num_overruns,
+				t.num_skipped, (int)t.jitter_p50_us, (int)t.jitter_p90_us,
+				(int)t.jitter_p99_us, (int)t.jitter_max_us,
+				(int)t.tick_p50_us, (int)t.tick_p90_us, (int)t.tick_p99_us,
+				(int)t.tick_max_us);
+		s += buf;
+	}
+	return s;
+}
+
+}
+// vim: set noet ts=4 sw=4:
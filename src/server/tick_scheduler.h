@@ -0,0 +1,64 @@
+// http://www.apache.org/licenses/LICENSE-2.0
+// Copyright 2014 Perttu Ahola <celeron55@gmail.com>
+#pragma once
+#include "core/types.h"
+
+namespace server
+{
+	typedef size_t TickTimerId;
+
+	// Percentiles are over the last ticks of the timer
+	struct TickTimerStats
+	{
+		ss_ name;
+		int64_t period_us = 0;
+		size_t num_ticks = 0;
+		// Ticks that were still being handled one period after they were
+		// started
+		size_t num_overruns = 0;
+		// Deadlines dropped because the timer fell too far behind
+		size_t num_skipped = 0;
+		// Lateness of the start of a tick compared to its deadline
+		int64_t jitter_p50_us = 0;
+		int64_t jitter_p90_us = 0;
+		int64_t jitter_p99_us = 0;
+		int64_t jitter_max_us = 0;
+		// Time taken by handling a tick; for a tick handled by modules, from
+		// emitting it to each module having handled it
+		int64_t tick_p50_us = 0;
+		int64_t tick_p90_us = 0;
+		int64_t tick_p99_us = 0;
+		int64_t tick_max_us = 0;
+	};
+
+	// Runs timers of fixed rates on the monotonic clock. A timer's deadline
+	// advances by exactly one period per tick so that its rate does not drift
+	// with the time taken by the ticks or by oversleeping. add_tick_time() can
+	// be called from any thread; the rest only from the one running the
+	// timers.
+	struct TickScheduler
+	{
+		virtual ~TickScheduler(){}
+		virtual TickTimerId add_timer(const ss_ &name, int64_t period_us) = 0;
+		// Sleeps until the earliest deadline, at most max_sleep_us; returns
+		// early if interrupted by a signal
+		virtual void sleep_until_next(int64_t max_sleep_us) = 0;
+		// Returns the timers whose deadline has passed and moves their
+		// deadlines to the next period
+		virtual sv_<TickTimerId> take_due() = 0;
+		// For a tick handled right away by the caller of take_due()
+		virtual void end_tick(TickTimerId id) = 0;
+		// For a tick handled elsewhere, eg. emitted as an event and handled by
+		// modules; can be called once per handler. started_us identifies the
+		// tick so that it is counted as an overrun only once.
+		virtual void add_tick_time(TickTimerId id, int64_t started_us,
+				int64_t tick_us) = 0;
+		virtual sv_<TickTimerStats> get_stats() = 0;
+	};
+
+	TickScheduler* createTickScheduler();
+
+	// Human-readable multi-line summary for logging
+	ss_ format_tick_stats(const sv_<TickTimerStats> &stats);
+}
+// vim: set noet ts=4 sw=4: